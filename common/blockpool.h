@@ -0,0 +1,134 @@
+/*
+    Copyright (C) 2017 Yuchen Ma <15208850@hdu.edu.cn>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <utility>
+#include <vector>
+
+namespace DogeFS {
+
+// Scratch buffers are aligned to this, so that they can be handed to
+// O_DIRECT I/O.
+constexpr size_t BufferAlignment = 4096;
+
+// A per thread free list of block sized buffers.  Only buffers of the size
+// given to setBlockSize, once at startup, are recycled; any other size, such
+// as a sub-block span or a multi-block run, goes straight to the heap.  Being
+// per thread, it needs no locking.
+class BlockPool {
+public:
+    static void setBlockSize(size_t size) {
+        pooledSize().store(size);
+    }
+
+    ~BlockPool() {
+        for(void *buffer : spare) {
+            std::free(buffer);
+        }
+    }
+
+    static BlockPool &local() {
+        static thread_local BlockPool pool;
+        return pool;
+    }
+
+    void *take(size_t size) {
+        if(size == pooledSize().load() && !spare.empty()) {
+            void *buffer = spare.back();
+            spare.pop_back();
+            return buffer;
+        }
+        void *buffer = nullptr;
+        if(posix_memalign(&buffer, BufferAlignment, size) != 0) {
+            throw std::bad_alloc();
+        }
+        return buffer;
+    }
+
+    void give(void *buffer, size_t size) {
+        if(size == pooledSize().load() && spare.size() < maxSpare) {
+            spare.push_back(buffer);
+        } else {
+            std::free(buffer);
+        }
+    }
+
+private:
+    static constexpr size_t maxSpare = 32;
+
+    static std::atomic<size_t> &pooledSize() {
+        static std::atomic<size_t> size(0);
+        return size;
+    }
+
+    std::vector<void *> spare;
+};
+
+// A scratch buffer from the calling thread's pool, given back when the
+// handle goes out of scope.  A size of 0 holds nothing.
+class BlockBuffer {
+public:
+    BlockBuffer() {}
+
+    explicit BlockBuffer(size_t size, bool zero = false) :
+        size(size),
+        data(size != 0 ? (char *) BlockPool::local().take(size) : nullptr) {
+        if(zero && data) {
+            std::memset(data, 0, size);
+        }
+    }
+
+    BlockBuffer(BlockBuffer &&other) : size(other.size), data(other.data) {
+        other.size = 0;
+        other.data = nullptr;
+    }
+
+    BlockBuffer &operator=(BlockBuffer &&other) {
+        std::swap(size, other.size);
+        std::swap(data, other.data);
+        return *this;
+    }
+
+    BlockBuffer(const BlockBuffer &) = delete;
+    BlockBuffer &operator=(const BlockBuffer &) = delete;
+
+    ~BlockBuffer() {
+        if(data) {
+            BlockPool::local().give(data, size);
+        }
+    }
+
+    char *get() const {
+        return data;
+    }
+
+    template <typename T>
+    T *as() const {
+        return (T *) data;
+    }
+
+private:
+    size_t size = 0;
+    char *data = nullptr;
+};
+
+}
@@ -0,0 +1,279 @@
+/*
+    Copyright (C) 2017 Yuchen Ma <15208850@hdu.edu.cn>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#include <atomic>
+#include <cerrno>
+#include <cinttypes>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#endif
+#include "blockpool.h"
+#include "device.h"
+#include "types.h"
+
+// Every block the superblock's checksumFlags select has a CRC32C in the
+// checksum area, one uint32_t per device block, indexed by block number.
+// A block is verified whenever it is read through freadsum() and its
+// checksum is updated by fwritesum() and storeChecksums().  An area that
+// is not there (ptrChecksum == 0) turns all of this off.
+
+namespace DogeFS {
+
+namespace CRC32C {
+
+static inline const uint32_t *table() {
+    static uint32_t entries[256];
+    static std::once_flag once;
+    std::call_once(once, [] {
+        for(uint32_t i = 0; i < 256; ++i) {
+            uint32_t crc = i;
+            for(int k = 0; k < 8; ++k) {
+                crc = crc & 1 ? (crc >> 1) ^ 0x82f63b78 : crc >> 1;
+            }
+            entries[i] = crc;
+        }
+    });
+    return entries;
+}
+
+static inline uint32_t software(uint32_t crc, const uint8_t *p, size_t size) {
+    const uint32_t *t = table();
+    for(size_t i = 0; i < size; ++i) {
+        crc = t[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+// The SSE4.2 crc32 instruction consumes eight bytes per cycle or so, which
+// keeps verification far below the cost of the read itself.
+__attribute__((target("sse4.2")))
+static inline uint32_t hardware(uint32_t crc, const uint8_t *p, size_t size) {
+    uint64_t crc64 = crc;
+    for(; size >= 8; p += 8, size -= 8) {
+        uint64_t v;
+        std::memcpy(&v, p, sizeof v);
+        crc64 = _mm_crc32_u64(crc64, v);
+    }
+    crc = (uint32_t) crc64;
+    for(; size != 0; ++p, --size) {
+        crc = _mm_crc32_u8(crc, *p);
+    }
+    return crc;
+}
+
+static inline bool hasHardware() {
+    static const bool result = __builtin_cpu_supports("sse4.2");
+    return result;
+}
+#endif
+
+}
+
+static inline uint32_t crc32c(const void *data, size_t size, uint32_t crc = 0) {
+    crc = ~crc;
+#if defined(__x86_64__)
+    if(CRC32C::hasHardware()) {
+        return ~CRC32C::hardware(crc, (const uint8_t *) data, size);
+    }
+#endif
+    return ~CRC32C::software(crc, (const uint8_t *) data, size);
+}
+
+struct ChecksumStats {
+    std::atomic<uint64_t> verified { 0 };
+    std::atomic<uint64_t> failures { 0 };
+};
+
+static inline ChecksumStats &checksumStats() {
+    static ChecksumStats stats;
+    return stats;
+}
+
+static inline bool metaChecksums(const SuperBlock *super) {
+    return super->ptrChecksum != 0 && (super->checksumFlags & CHECKSUM_META) != 0;
+}
+
+static inline bool dataChecksums(const SuperBlock *super) {
+    return super->ptrChecksum != 0 && (super->checksumFlags & CHECKSUM_DATA) != 0;
+}
+
+// Writers that update part of a block hold the lock its number hashes to
+// across the read-modify-write, and readers hold it while they verify, so
+// that nobody sees the contents and the checksum of different versions.
+static inline std::mutex &checksumLock(uint64_t block) {
+    static std::mutex locks[64];
+    return locks[block % (sizeof locks / sizeof locks[0])];
+}
+
+// Record the checksums of the count blocks starting at block, whose contents
+// are in data.  A null data stands for zero-filled blocks.
+static inline bool storeChecksums(Device *devFile, const SuperBlock *super, uint64_t block, uint64_t count, const void *data) {
+    std::vector<uint32_t> sums(count);
+    if(data) {
+        for(uint64_t i = 0; i < count; ++i) {
+            sums[i] = crc32c((const char *) data + i * super->blockSize, super->blockSize);
+        }
+    } else if(count != 0) {
+        BlockBuffer zero(super->blockSize, true);
+        std::fill(sums.begin(), sums.end(), crc32c(zero.get(), super->blockSize));
+    }
+    if(fwriteat(devFile, sums.data(), super->ptrChecksum * super->blockSize + block * sizeof (uint32_t), count * sizeof (uint32_t)) <= 0) {
+        std::perror("Write error");
+        return false;
+    }
+    return true;
+}
+
+// Check the count blocks starting at block, whose contents are in data.
+// A mismatch is counted, logged, and reported as EIO.
+static inline bool verifyChecksums(Device *devFile, const SuperBlock *super, uint64_t block, uint64_t count, const void *data) {
+    std::vector<uint32_t> sums(count);
+    if(freadat(devFile, sums.data(), super->ptrChecksum * super->blockSize + block * sizeof (uint32_t), count * sizeof (uint32_t)) <= 0) {
+        return false;
+    }
+    ChecksumStats &stats = checksumStats();
+    for(uint64_t i = 0; i < count; ++i) {
+        stats.verified += 1;
+        if(crc32c((const char *) data + i * super->blockSize, super->blockSize) != sums[i]) {
+            stats.failures += 1;
+            std::fprintf(stderr, "Checksum mismatch in block %#" PRIx64 "\n", block + i);
+            errno = EIO;
+            return false;
+        }
+    }
+    return true;
+}
+
+// freadat() for bytes within one block, verifying the whole block.
+static inline int freadsum(Device *devFile, const SuperBlock *super, void *ptr, off_t pos, size_t size) {
+    uint64_t block = pos / super->blockSize;
+    uint64_t begin = pos % super->blockSize;
+    bool whole = begin == 0 && size == super->blockSize;
+    BlockBuffer buf(whole ? 0 : super->blockSize);
+    char *data = whole ? (char *) ptr : buf.get();
+    std::lock_guard<std::mutex> lock(checksumLock(block));
+    if(freadat(devFile, data, block * super->blockSize, super->blockSize) <= 0 || !verifyChecksums(devFile, super, block, 1, data)) {
+        return 0;
+    }
+    if(!whole) {
+        std::memcpy(ptr, data + begin, size);
+    }
+    return (int) size;
+}
+
+// fwriteat() for bytes within one block, updating the block's checksum.  A
+// partial update verifies the rest of the block first, so that corruption
+// is never sealed in with a fresh checksum.
+static inline int fwritesum(Device *devFile, const SuperBlock *super, const void *ptr, off_t pos, size_t size) {
+    uint64_t block = pos / super->blockSize;
+    uint64_t begin = pos % super->blockSize;
+    bool whole = begin == 0 && size == super->blockSize;
+    BlockBuffer buf(whole ? 0 : super->blockSize);
+    const char *data = whole ? (const char *) ptr : buf.get();
+    std::lock_guard<std::mutex> lock(checksumLock(block));
+    if(!whole) {
+        if(freadat(devFile, buf.get(), block * super->blockSize, super->blockSize) <= 0 || !verifyChecksums(devFile, super, block, 1, buf.get())) {
+            return 0;
+        }
+        std::memcpy(buf.get() + begin, ptr, size);
+    }
+    if(fwriteat(devFile, ptr, pos, size) <= 0 || !storeChecksums(devFile, super, block, 1, data)) {
+        return 0;
+    }
+    return (int) size;
+}
+
+// Give a freshly allocated block whatever it holds a valid checksum, so that
+// the first partial write to it passes verification.
+static inline bool sealBlock(Device *devFile, const SuperBlock *super, uint64_t block) {
+    BlockBuffer buf(super->blockSize);
+    std::lock_guard<std::mutex> lock(checksumLock(block));
+    if(freadat(devFile, buf.get(), block * super->blockSize, super->blockSize) <= 0) {
+        std::perror("Read error");
+        return false;
+    }
+    return storeChecksums(devFile, super, block, 1, buf.get());
+}
+
+// Metadata I/O goes through these, which checksum when the superblock says so.
+static inline int freadmeta(Device *devFile, const SuperBlock *super, void *ptr, off_t pos, size_t size) {
+    return metaChecksums(super) ? freadsum(devFile, super, ptr, pos, size) : freadat(devFile, ptr, pos, size);
+}
+
+static inline int fwritemeta(Device *devFile, const SuperBlock *super, const void *ptr, off_t pos, size_t size) {
+    return metaChecksums(super) ? fwritesum(devFile, super, ptr, pos, size) : fwriteat(devFile, ptr, pos, size);
+}
+
+// File data and fragments, likewise.  With data checksums on, each call must
+// stay within one block.
+static inline int freaddata(Device *devFile, const SuperBlock *super, void *ptr, off_t pos, size_t size) {
+    return dataChecksums(super) ? freadsum(devFile, super, ptr, pos, size) : freadat(devFile, ptr, pos, size);
+}
+
+static inline int fwritedata(Device *devFile, const SuperBlock *super, const void *ptr, off_t pos, size_t size) {
+    return dataChecksums(super) ? fwritesum(devFile, super, ptr, pos, size) : fwriteat(devFile, ptr, pos, size);
+}
+
+static inline int fzerodata(Device *devFile, const SuperBlock *super, off_t pos, size_t size) {
+    if(!dataChecksums(super)) {
+        return fzeroat(devFile, pos, size);
+    }
+    BlockBuffer zero(size, true);
+    return fwritesum(devFile, super, zero.get(), pos, size);
+}
+
+// Return [pos, pos + size) within one block in place when the device can
+// lend it, verified like freadsum() when checksummed is set, and read into
+// *buffer otherwise.  Returns nullptr on failure, or when there is nothing
+// to lend and no buffer.  The bytes lent stay put
+// only as long as the caller keeps their writers out, as with any read.
+static inline const char *fviewat(Device *devFile, const SuperBlock *super, bool checksummed, BlockBuffer *buffer, off_t pos, size_t size) {
+    uint64_t block = pos / super->blockSize;
+    const char *data = devFile->view(block * super->blockSize, super->blockSize);
+    if(data) {
+        if(checksummed) {
+            std::lock_guard<std::mutex> lock(checksumLock(block));
+            if(!verifyChecksums(devFile, super, block, 1, data)) {
+                return nullptr;
+            }
+        }
+        return data + pos % super->blockSize;
+    } else if(!buffer) {
+        return nullptr;
+    }
+    *buffer = BlockBuffer(super->blockSize);
+    int ok = checksummed ? freadsum(devFile, super, buffer->get(), pos, size) : freadat(devFile, buffer->get(), pos, size);
+    return ok > 0 ? buffer->get() : nullptr;
+}
+
+static inline const char *fviewmeta(Device *devFile, const SuperBlock *super, BlockBuffer *buffer, off_t pos, size_t size) {
+    return fviewat(devFile, super, metaChecksums(super), buffer, pos, size);
+}
+
+static inline const char *fviewdata(Device *devFile, const SuperBlock *super, BlockBuffer *buffer, off_t pos, size_t size) {
+    return fviewat(devFile, super, dataChecksums(super), buffer, pos, size);
+}
+
+}
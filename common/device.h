@@ -0,0 +1,795 @@
+/*
+    Copyright (C) 2017 Yuchen Ma <15208850@hdu.edu.cn>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cinttypes>
+#include <climits>
+#include <cstdint>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <fcntl.h>
+#include <functional>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+#include "blockpool.h"
+#include "types.h"
+
+namespace DogeFS {
+
+// Where the blocks of a filesystem live.  Reads and writes are positioned,
+// so several threads may share one device; sync() makes everything written
+// so far durable.
+class Device {
+public:
+    virtual ~Device() {}
+
+    uint64_t size() const {
+        return length;
+    }
+
+    virtual bool read(void *ptr, uint64_t pos, size_t size) = 0;
+    virtual bool write(const void *ptr, uint64_t pos, size_t size) = 0;
+    virtual bool sync() = 0;
+
+    // Write count buffers back to back, starting at pos.  Backends that
+    // cannot take them in one go get them gathered into one buffer.
+    virtual bool writev(const iovec *iov, int count, uint64_t pos) {
+        size_t size = 0;
+        for(int i = 0; i < count; ++i) {
+            size += iov[i].iov_len;
+        }
+        BlockBuffer buffer(size);
+        for(int i = 0, done = 0; i < count; done += iov[i].iov_len, ++i) {
+            std::memcpy(buffer.get() + done, iov[i].iov_base, iov[i].iov_len);
+        }
+        return write(buffer.get(), pos, size);
+    }
+
+    // Lend [pos, pos + size) in place, valid until the device is closed, or
+    // return nullptr when this backend cannot.
+    virtual const char *view(uint64_t, size_t) {
+        return nullptr;
+    }
+
+    // Tell the backend how [pos, pos + size) is about to be used, in terms of
+    // madvise() advice.
+    virtual void advise(uint64_t, size_t, int) {}
+
+protected:
+    uint64_t length = 0;
+};
+
+// pread() and pwrite() on a file descriptor, which the device owns.
+class FileDevice : public Device {
+public:
+    explicit FileDevice(int fd) : fd(fd) {
+        off_t end = lseek(fd, 0, SEEK_END);
+        length = end > 0 ? end : 0;
+    }
+
+    ~FileDevice() {
+        close(fd);
+    }
+
+    bool read(void *ptr, uint64_t pos, size_t size) override {
+        for(size_t done = 0; done < size;) {
+            ssize_t n = pread(fd, (char *) ptr + done, size - done, pos + done);
+            if(n <= 0) {
+                return false;
+            }
+            done += n;
+        }
+        return true;
+    }
+
+    bool write(const void *ptr, uint64_t pos, size_t size) override {
+        for(size_t done = 0; done < size;) {
+            ssize_t n = pwrite(fd, (const char *) ptr + done, size - done, pos + done);
+            if(n <= 0) {
+                return false;
+            }
+            done += n;
+        }
+        return true;
+    }
+
+    bool writev(const iovec *iov, int count, uint64_t pos) override {
+        std::vector<iovec> rest(iov, iov + count);
+        for(size_t first = 0; first < rest.size();) {
+            ssize_t n = pwritev(fd, rest.data() + first, (int) std::min<size_t>(rest.size() - first, IOV_MAX), pos);
+            if(n <= 0) {
+                return false;
+            }
+            pos += n;
+            for(; first < rest.size() && (size_t) n >= rest[first].iov_len; ++first) {
+                n -= rest[first].iov_len;
+            }
+            if(n != 0) {
+                rest[first].iov_base = (char *) rest[first].iov_base + n;
+                rest[first].iov_len -= n;
+            }
+        }
+        return true;
+    }
+
+    bool sync() override {
+        return fsync(fd) == 0;
+    }
+
+protected:
+    int fd;
+};
+
+// The whole device mapped into memory.  Reads copy out of the mapping, or
+// skip the copy through view(); writes land in the page cache and the pages
+// they dirtied are written back with msync() at the next sync().
+//
+// An I/O error on a mapped page raises SIGBUS instead of failing a call, so
+// this is meant for healthy, read-mostly images.
+class MappedDevice : public FileDevice {
+public:
+    MappedDevice(int fd, bool readOnly) : FileDevice(fd) {
+        void *addr = length != 0 ? mmap(nullptr, length, readOnly ? PROT_READ : PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+        if(addr != MAP_FAILED) {
+            base = (char *) addr;
+            // Metadata is scattered; sequential file reads ask for more.
+            madvise(base, length, MADV_RANDOM);
+        }
+    }
+
+    ~MappedDevice() {
+        if(base) {
+            sync();
+            munmap(base, length);
+        }
+    }
+
+    bool mapped() const {
+        return base != nullptr;
+    }
+
+    bool read(void *ptr, uint64_t pos, size_t size) override {
+        if(!inRange(pos, size)) {
+            return false;
+        }
+        std::memcpy(ptr, base + pos, size);
+        return true;
+    }
+
+    bool write(const void *ptr, uint64_t pos, size_t size) override {
+        if(!inRange(pos, size)) {
+            return false;
+        }
+        std::memcpy(base + pos, ptr, size);
+        markDirty(pos, size);
+        return true;
+    }
+
+    bool writev(const iovec *iov, int count, uint64_t pos) override {
+        for(int i = 0; i < count; pos += iov[i].iov_len, ++i) {
+            if(!write(iov[i].iov_base, pos, iov[i].iov_len)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool sync() override {
+        std::map<uint64_t, uint64_t> ranges;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            ranges.swap(dirty);
+        }
+        bool ok = true;
+        for(auto &range : ranges) {
+            if(msync(base + range.first, range.second - range.first, MS_SYNC) != 0) {
+                ok = false;
+            }
+        }
+        return ok;
+    }
+
+    const char *view(uint64_t pos, size_t size) override {
+        return inRange(pos, size) ? base + pos : nullptr;
+    }
+
+    void advise(uint64_t pos, size_t size, int advice) override {
+        uint64_t begin = pos / pageSize() * pageSize();
+        if(inRange(pos, size)) {
+            madvise(base + begin, pos + size - begin, advice);
+        }
+    }
+
+private:
+    static uint64_t pageSize() {
+        static const uint64_t size = sysconf(_SC_PAGESIZE);
+        return size;
+    }
+
+    bool inRange(uint64_t pos, size_t size) const {
+        if(pos > length || size > length - pos) {
+            errno = EIO;
+            return false;
+        }
+        return true;
+    }
+
+    // Record the pages [pos, pos + size) touches, merged with the runs that
+    // are already recorded next to them.
+    void markDirty(uint64_t pos, size_t size) {
+        uint64_t begin = pos / pageSize() * pageSize();
+        uint64_t end = std::min(length, (pos + size + pageSize() - 1) / pageSize() * pageSize());
+        std::lock_guard<std::mutex> guard(lock);
+        auto it = dirty.upper_bound(begin);
+        if(it != dirty.begin() && std::prev(it)->second >= begin) {
+            --it;
+            begin = it->first;
+        }
+        while(it != dirty.end() && it->first <= end) {
+            end = std::max(end, it->second);
+            it = dirty.erase(it);
+        }
+        dirty[begin] = end;
+    }
+
+    char *base = nullptr;
+    std::mutex lock;
+    std::map<uint64_t, uint64_t> dirty;     // begin -> end of dirty page runs
+};
+
+// Every member of a striped set starts with this much room for its label, a
+// copy of the superblock naming the member, so that the stripes after it
+// stay aligned.
+constexpr uint64_t MemberHeaderSize = 1048576;
+
+// Several devices striped into one block space.  Stripe s, of stripeSize
+// bytes, lives on member s % N as its stripe s / N, after the member header.  Every member has a
+// queue and a thread of its own, so that a request spanning several members
+// is served by all of them at once; a request within one stripe runs on the
+// calling thread.  The striped device owns its members.
+class StripedDevice : public Device {
+public:
+    StripedDevice(const std::vector<Device *> &devices, uint64_t stripeSize) : stripeSize(stripeSize) {
+        uint64_t memberStripes = UINT64_MAX;
+        for(Device *device : devices) {
+            memberStripes = std::min(memberStripes, (std::max(device->size(), MemberHeaderSize) - MemberHeaderSize) / stripeSize);
+            members.emplace_back(new Member(device));
+        }
+        length = memberStripes * stripeSize * devices.size();
+    }
+
+    size_t memberCount() const {
+        return members.size();
+    }
+
+    bool read(void *ptr, uint64_t pos, size_t size) override {
+        return transfer((char *) ptr, pos, size, false);
+    }
+
+    bool write(const void *ptr, uint64_t pos, size_t size) override {
+        return transfer((char *) ptr, pos, size, true);
+    }
+
+    bool sync() override {
+        std::vector<std::function<bool()>> work;
+        for(auto &member : members) {
+            Device *device = member->device;
+            work.push_back([device] { return device->sync(); });
+        }
+        return dispatch(work);
+    }
+
+    const char *view(uint64_t pos, size_t size) override {
+        Piece piece = locate(pos);
+        if(pos + size > length || pos % stripeSize + size > stripeSize) {
+            return nullptr;
+        }
+        return members[piece.member]->device->view(piece.pos, size);
+    }
+
+    void advise(uint64_t pos, size_t size, int advice) override {
+        for(size_t done = 0; done < size && pos + done < length;) {
+            Piece piece = locate(pos + done);
+            size_t count = std::min<uint64_t>(size - done, stripeSize - (pos + done) % stripeSize);
+            members[piece.member]->device->advise(piece.pos, count, advice);
+            done += count;
+        }
+    }
+
+private:
+    struct Member {
+        explicit Member(Device *device) : device(device), worker([this] { serve(); }) {}
+
+        ~Member() {
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                stopping = true;
+            }
+            wake.notify_all();
+            worker.join();
+            delete device;
+        }
+
+        void push(std::function<void()> task) {
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                tasks.push_back(std::move(task));
+            }
+            wake.notify_one();
+        }
+
+        void serve() {
+            std::unique_lock<std::mutex> guard(lock);
+            for(;;) {
+                wake.wait(guard, [this] { return stopping || !tasks.empty(); });
+                if(tasks.empty()) {
+                    return;
+                }
+                std::function<void()> task = std::move(tasks.front());
+                tasks.pop_front();
+                guard.unlock();
+                task();
+                guard.lock();
+            }
+        }
+
+        Device *device;
+        std::mutex lock;
+        std::condition_variable wake;
+        std::deque<std::function<void()>> tasks;
+        bool stopping = false;
+        std::thread worker;     // last, so that it starts on a complete member
+    };
+
+    // A stretch of a request within one stripe: where it lives, and where it
+    // goes in the caller's buffer.
+    struct Piece {
+        size_t member;
+        uint64_t pos;
+        size_t offset;
+        size_t size;
+    };
+
+    Piece locate(uint64_t pos) const {
+        uint64_t stripe = pos / stripeSize;
+        return Piece { stripe % members.size(), MemberHeaderSize + stripe / members.size() * stripeSize + pos % stripeSize, 0, 0 };
+    }
+
+    bool transfer(char *ptr, uint64_t pos, size_t size, bool write) {
+        if(pos > length || size > length - pos) {
+            errno = EIO;
+            return false;
+        }
+        if(pos % stripeSize + size <= stripeSize) {
+            Piece piece = locate(pos);
+            Device *device = members[piece.member]->device;
+            return write ? device->write(ptr, piece.pos, size) : device->read(ptr, piece.pos, size);
+        }
+        std::vector<std::vector<Piece>> pieces(members.size());
+        for(size_t done = 0; done < size;) {
+            Piece piece = locate(pos + done);
+            piece.offset = done;
+            piece.size = std::min<uint64_t>(size - done, stripeSize - (pos + done) % stripeSize);
+            pieces[piece.member].push_back(piece);
+            done += piece.size;
+        }
+        std::vector<std::function<bool()>> work(members.size());
+        for(size_t i = 0; i < members.size(); ++i) {
+            if(pieces[i].empty()) {
+                continue;
+            }
+            Device *device = members[i]->device;
+            const std::vector<Piece> *list = &pieces[i];
+            work[i] = [device, list, ptr, write] {
+                for(const Piece &piece : *list) {
+                    if(!(write ? device->write(ptr + piece.offset, piece.pos, piece.size) : device->read(ptr + piece.offset, piece.pos, piece.size))) {
+                        return false;
+                    }
+                }
+                return true;
+            };
+        }
+        return dispatch(work);
+    }
+
+    // Run work[i] on member i, the first of them on the calling thread, and
+    // wait for all.  Empty entries are skipped.  On failure errno is that of
+    // a failed entry.
+    bool dispatch(std::vector<std::function<bool()>> &work) {
+        std::mutex lock;
+        std::condition_variable done;
+        size_t pending = 0;
+        bool ok = true;
+        int error = 0;
+        std::function<bool()> *local = nullptr;
+        for(size_t i = 0; i < work.size(); ++i) {
+            if(!work[i]) {
+                continue;
+            } else if(!local) {
+                local = &work[i];
+                continue;
+            }
+            std::function<bool()> *job = &work[i];
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                pending += 1;
+            }
+            members[i]->push([job, &lock, &done, &pending, &ok, &error] {
+                bool result = (*job)();
+                int jobError = errno;
+                std::lock_guard<std::mutex> guard(lock);
+                if(!result) {
+                    ok = false;
+                    error = jobError;
+                }
+                if(--pending == 0) {
+                    done.notify_all();
+                }
+            });
+        }
+        bool localOk = !local || (*local)();
+        int localError = errno;
+        std::unique_lock<std::mutex> guard(lock);
+        done.wait(guard, [&pending] { return pending == 0; });
+        if(!localOk) {
+            ok = false;
+            error = localError;
+        }
+        if(!ok) {
+            errno = error;
+        }
+        return ok;
+    }
+
+    uint64_t stripeSize;
+    std::vector<std::unique_ptr<Member>> members;
+};
+
+// Writes smaller than a block gathered into whole blocks.  A write of whole
+// blocks that are not held goes straight through; any other write lands in a
+// copy of its blocks kept here, so that the many small inode, directory item,
+// space map and checksum updates to one block cost one write between them and
+// their read-modify-writes never reach the device.  Held blocks are written
+// back in device order, each run of adjacent ones as a single vectored write,
+// at sync(), when more than limit bytes are held, and every interval.  A
+// flush takes the held blocks out and writes them without holding the lock,
+// through writeBack if one is given; reads see them until it is done.  The
+// writeback device owns the device below it.
+class WritebackDevice : public Device {
+public:
+    typedef std::function<bool(Device *device, const struct iovec *iov, int count, uint64_t pos)> WriteBack;
+
+    WritebackDevice(Device *device, uint64_t blockSize, uint64_t limit, std::chrono::seconds interval, WriteBack writeBack = nullptr) :
+        device(device), blockSize(blockSize), limit(limit), interval(interval), writeBack(writeBack), flusher([this] { serve(); }) {
+        length = device->size();
+    }
+
+    ~WritebackDevice() {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stopping = true;
+        }
+        wake.notify_all();
+        flusher.join();
+        flush();
+        delete device;
+    }
+
+    bool read(void *ptr, uint64_t pos, size_t size) override {
+        for(;;) {
+            uint64_t seen;
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                const char *held = heldCopy(pos / blockSize);
+                if(held && pos % blockSize + size <= blockSize) {
+                    std::memcpy(ptr, held + pos % blockSize, size);
+                    return true;
+                }
+                seen = flushes;
+            }
+            if(!device->read(ptr, pos, size)) {
+                return false;
+            }
+            std::lock_guard<std::mutex> guard(lock);
+            // A flush in between may have written blocks the read missed.
+            if(flushes != seen) {
+                continue;
+            }
+            // Blocks being written back are older than the held ones.
+            overlay(writing, ptr, pos, size);
+            overlay(blocks, ptr, pos, size);
+            return true;
+        }
+    }
+
+    bool write(const void *ptr, uint64_t pos, size_t size) override {
+        uint64_t first = pos / blockSize;
+        uint64_t last = (pos + size + blockSize - 1) / blockSize;
+        if(pos > length || last > length / blockSize) {
+            return device->write(ptr, pos, size);
+        }
+        std::unique_lock<std::mutex> guard(lock);
+        if(pos % blockSize == 0 && size % blockSize == 0 && !holds(blocks, pos, size) && !holds(writing, pos, size)) {
+            guard.unlock();
+            return device->write(ptr, pos, size);
+        }
+        for(uint64_t block = first; block < last;) {
+            uint64_t begin = std::max(pos, block * blockSize);
+            uint64_t end = std::min(pos + size, (block + 1) * blockSize);
+            auto it = blocks.find(block);
+            if(it == blocks.end()) {
+                BlockBuffer buffer(blockSize);
+                auto old = writing.find(block);
+                if(end - begin != blockSize && old != writing.end()) {
+                    std::memcpy(buffer.get(), old->second.get(), blockSize);
+                } else if(end - begin != blockSize) {
+                    uint64_t seen = flushes;
+                    guard.unlock();
+                    bool ok = device->read(buffer.get(), block * blockSize, blockSize);
+                    guard.lock();
+                    if(!ok) {
+                        return false;
+                    } else if(blocks.count(block) == 0 && (flushes != seen || writing.count(block) != 0)) {
+                        // Someone held and flushed the block meanwhile.
+                        continue;
+                    }
+                }
+                it = blocks.emplace(block, std::move(buffer)).first;
+            }
+            std::memcpy(it->second.get() + (begin - block * blockSize), (const char *) ptr + (begin - pos), end - begin);
+            block += 1;
+        }
+        // The write itself is done; a failed flush shows at the next sync().
+        if(blocks.size() * blockSize > limit) {
+            flushHeld(guard);
+        }
+        return true;
+    }
+
+    bool sync() override {
+        bool ok = flush();
+        return device->sync() && ok;
+    }
+
+    // Lend only blocks that are not held, whose device copy is current.
+    const char *view(uint64_t pos, size_t size) override {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            if(holds(blocks, pos, size) || holds(writing, pos, size)) {
+                return nullptr;
+            }
+        }
+        return device->view(pos, size);
+    }
+
+    void advise(uint64_t pos, size_t size, int advice) override {
+        device->advise(pos, size, advice);
+    }
+
+private:
+    typedef std::map<uint64_t, BlockBuffer> Blocks;
+
+    const char *heldCopy(uint64_t block) {
+        auto it = blocks.find(block);
+        if(it != blocks.end()) {
+            return it->second.get();
+        }
+        it = writing.find(block);
+        return it != writing.end() ? it->second.get() : nullptr;
+    }
+
+    bool holds(Blocks &from, uint64_t pos, size_t size) {
+        auto it = from.lower_bound(pos / blockSize);
+        return it != from.end() && it->first * blockSize < pos + size;
+    }
+
+    void overlay(Blocks &from, void *ptr, uint64_t pos, size_t size) {
+        for(auto it = from.lower_bound(pos / blockSize); it != from.end() && it->first * blockSize < pos + size; ++it) {
+            uint64_t begin = std::max(pos, it->first * blockSize);
+            uint64_t end = std::min(pos + size, (it->first + 1) * blockSize);
+            std::memcpy((char *) ptr + (begin - pos), it->second.get() + (begin - it->first * blockSize), end - begin);
+        }
+    }
+
+    bool flush() {
+        std::unique_lock<std::mutex> guard(lock);
+        return flushHeld(guard);
+    }
+
+    // One flush runs at a time.  Blocks whose write fails are held again,
+    // unless they were rewritten meanwhile, to be tried again.
+    bool flushHeld(std::unique_lock<std::mutex> &guard) {
+        while(flushing) {
+            flushed.wait(guard);
+        }
+        if(blocks.empty()) {
+            return true;
+        }
+        flushing = true;
+        writing.swap(blocks);
+        guard.unlock();
+        bool ok = true;
+        std::vector<std::pair<Blocks::iterator, Blocks::iterator>> failed;
+        std::vector<iovec> run;
+        for(auto it = writing.begin(); it != writing.end();) {
+            uint64_t start = it->first;
+            auto next = it;
+            run.clear();
+            for(; next != writing.end() && next->first == start + run.size() && run.size() < (size_t) IOV_MAX; ++next) {
+                run.push_back(iovec { next->second.get(), blockSize });
+            }
+            bool written = writeBack ? writeBack(device, run.data(), (int) run.size(), start * blockSize) : device->writev(run.data(), (int) run.size(), start * blockSize);
+            if(!written) {
+                std::perror("Write error");
+                ok = false;
+                failed.emplace_back(it, next);
+            }
+            it = next;
+        }
+        guard.lock();
+        for(auto &range : failed) {
+            for(auto it = range.first; it != range.second; ++it) {
+                if(blocks.count(it->first) == 0) {
+                    blocks.emplace(it->first, std::move(it->second));
+                }
+            }
+        }
+        writing.clear();
+        flushing = false;
+        flushes += 1;
+        flushed.notify_all();
+        return ok;
+    }
+
+    void serve() {
+        std::unique_lock<std::mutex> guard(lock);
+        while(!stopping) {
+            wake.wait_for(guard, interval);
+            if(!blocks.empty()) {
+                flushHeld(guard);
+            }
+        }
+    }
+
+    Device *device;
+    uint64_t blockSize;
+    uint64_t limit;
+    std::chrono::seconds interval;
+    WriteBack writeBack;
+    std::mutex lock;
+    std::condition_variable wake;
+    std::condition_variable flushed;
+    Blocks blocks;              // held blocks by number
+    Blocks writing;             // blocks taken out by the flush in progress
+    bool flushing = false;
+    uint64_t flushes = 0;       // flushes so far, for reads and writes racing one
+    bool stopping = false;
+    std::thread flusher;        // last, so that it starts on a complete device
+};
+
+// Open a device file, mapped into memory if asked to.  Returns nullptr with
+// errno set on failure.
+static inline Device *openDevice(const std::string &path, bool readOnly = false, bool mapped = false) {
+    int fd = open(path.c_str(), readOnly ? O_RDONLY : O_RDWR);
+    if(fd < 0) {
+        return nullptr;
+    }
+    if(!mapped) {
+        return new FileDevice(fd);
+    }
+    MappedDevice *device = new MappedDevice(fd, readOnly);
+    if(!device->mapped()) {
+        int err = errno;
+        delete device;
+        errno = err;
+        return nullptr;
+    }
+    return device;
+}
+
+// Open the devices of a filesystem, in order, and stripe them together when
+// there are several.  The label at the start of every member must name it
+// as that member of the same set.  Returns nullptr with
+// a message printed on failure.  A single device without a DogeFS
+// superblock is returned as is, for the caller to reject.
+static inline Device *openDeviceSet(const std::vector<std::string> &paths, bool readOnly = false, bool mapped = false) {
+    std::vector<Device *> members;
+    SuperBlock first;
+    for(size_t i = 0; i < paths.size(); ++i) {
+        Device *member = openDevice(paths[i], readOnly, mapped);
+        SuperBlock super;
+        bool ok = member && member->read(&super, 0, sizeof super);
+        if(member) {
+            members.push_back(member);
+        }
+        if(!ok) {
+            std::fprintf(stderr, "%s: %s\n", paths[i].c_str(), std::strerror(errno));
+        } else {
+            if(i == 0) {
+                first = super;
+            }
+            uint32_t count = std::max<uint32_t>(super.deviceCount, 1);
+            if(super.magic != SuperBlockMagic) {
+                // A lone device is left to the caller, which says the same.
+                if(paths.size() > 1) {
+                    std::fprintf(stderr, "%s: not a DogeFS device\n", paths[i].c_str());
+                    ok = false;
+                }
+            } else if(super.setID != first.setID) {
+                std::fprintf(stderr, "%s: belongs to another DogeFS filesystem\n", paths[i].c_str());
+                ok = false;
+            } else if(super.deviceIndex != i || count != paths.size()) {
+                std::fprintf(stderr, "%s: is device %" PRIu32 " of %" PRIu32 ", not %zu of %zu\n", paths[i].c_str(), super.deviceIndex + 1, count, i + 1, paths.size());
+                ok = false;
+            }
+        }
+        if(!ok) {
+            for(Device *device : members) {
+                delete device;
+            }
+            return nullptr;
+        }
+    }
+    if(members.size() == 1) {
+        return members[0];
+    }
+    return new StripedDevice(members, first.stripeBlocks * first.blockSize);
+}
+
+// Positioned I/O in the style of fread(), returning 0 on failure.
+static inline int fwriteat(Device *dev, const void *ptr, off_t pos, size_t size) {
+    if(size == 0) {
+        return 1;
+    }
+    return dev->write(ptr, pos, size) ? (int) std::min<size_t>(size, INT_MAX) : 0;
+}
+
+static inline int fzeroat(Device *dev, off_t pos, size_t size) {
+    static const char zero[65536] = {};
+    if(size == 0) {
+        return 1;
+    }
+    for(size_t done = 0; done < size; done += sizeof zero) {
+        if(fwriteat(dev, zero, pos + done, std::min(size - done, sizeof zero)) <= 0) {
+            return 0;
+        }
+    }
+    return (int) std::min<size_t>(size, INT_MAX);
+}
+
+static inline int freadat(Device *dev, void *ptr, off_t pos, size_t size) {
+    if(size == 0) {
+        return 1;
+    }
+    return dev->read(ptr, pos, size) ? (int) std::min<size_t>(size, INT_MAX) : 0;
+}
+
+}
@@ -0,0 +1,192 @@
+/*
+    Copyright (C) 2017 Yuchen Ma <15208850@hdu.edu.cn>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+// A small, self-contained codec for the LZ4 block format.  The compressor is
+// the plain greedy single-probe variant, which is what "fast" LZ4 does, and
+// its output can be read by any LZ4 block decoder.
+
+namespace DogeFS {
+
+namespace LZ4 {
+
+constexpr size_t MinMatch = 4;
+constexpr size_t LastLiterals = 5;
+constexpr size_t MatchFindLimit = 12;
+constexpr unsigned HashLog = 12;
+
+static inline uint32_t read32(const uint8_t *p) {
+    uint32_t v;
+    std::memcpy(&v, p, sizeof v);
+    return v;
+}
+
+static inline uint32_t hash(uint32_t sequence) {
+    return (sequence * 2654435761u) >> (32 - HashLog);
+}
+
+static inline bool writeLength(uint8_t *&op, const uint8_t *oend, size_t length) {
+    for(; length >= 255; length -= 255) {
+        if(op >= oend) {
+            return false;
+        }
+        *op++ = 255;
+    }
+    if(op >= oend) {
+        return false;
+    }
+    *op++ = (uint8_t) length;
+    return true;
+}
+
+static inline bool writeSequence(uint8_t *&op, const uint8_t *oend, const uint8_t *literals, size_t literalLength, size_t offset, size_t matchLength) {
+    if(op >= oend) {
+        return false;
+    }
+    uint8_t *token = op++;
+    *token = (uint8_t) (std::min<size_t>(literalLength, 15) << 4);
+    if(literalLength >= 15 && !writeLength(op, oend, literalLength - 15)) {
+        return false;
+    }
+    if((size_t) (oend - op) < literalLength) {
+        return false;
+    }
+    std::memcpy(op, literals, literalLength);
+    op += literalLength;
+    if(matchLength == 0) {
+        return true;
+    }
+    if(oend - op < 2) {
+        return false;
+    }
+    *op++ = (uint8_t) offset;
+    *op++ = (uint8_t) (offset >> 8);
+    matchLength -= MinMatch;
+    *token |= (uint8_t) std::min<size_t>(matchLength, 15);
+    return matchLength < 15 || writeLength(op, oend, matchLength - 15);
+}
+
+}
+
+// Compress src into dst.  Returns the compressed size, or 0 when the result
+// would not fit in dstCapacity bytes.
+static inline size_t lz4Compress(const void *src, size_t srcSize, void *dst, size_t dstCapacity) {
+    const uint8_t *base = (const uint8_t *) src;
+    const uint8_t *ip = base;
+    const uint8_t *anchor = base;
+    const uint8_t *iend = base + srcSize;
+    uint8_t *op = (uint8_t *) dst;
+    const uint8_t *oend = op + dstCapacity;
+    if(srcSize > LZ4::MatchFindLimit) {
+        int32_t table[1 << LZ4::HashLog];
+        std::memset(table, 0xff, sizeof table);
+        const uint8_t *mflimit = iend - LZ4::MatchFindLimit;
+        const uint8_t *matchlimit = iend - LZ4::LastLiterals;
+        while(ip < mflimit) {
+            uint32_t sequence = LZ4::read32(ip);
+            uint32_t h = LZ4::hash(sequence);
+            int32_t ref = table[h];
+            table[h] = (int32_t) (ip - base);
+            if(ref < 0 || ip - (base + ref) > 65535 || LZ4::read32(base + ref) != sequence) {
+                ++ip;
+                continue;
+            }
+            const uint8_t *match = base + ref;
+            size_t matchLength = LZ4::MinMatch;
+            while(ip + matchLength < matchlimit && ip[matchLength] == match[matchLength]) {
+                ++matchLength;
+            }
+            if(!LZ4::writeSequence(op, oend, anchor, ip - anchor, ip - match, matchLength)) {
+                return 0;
+            }
+            ip += matchLength;
+            anchor = ip;
+        }
+    }
+    if(!LZ4::writeSequence(op, oend, anchor, iend - anchor, 0, 0)) {
+        return 0;
+    }
+    return op - (uint8_t *) dst;
+}
+
+// Decompress src into dst.  Returns the decompressed size, or -1 when the
+// input is malformed or would overflow dstCapacity bytes.
+static inline ptrdiff_t lz4Decompress(const void *src, size_t srcSize, void *dst, size_t dstCapacity) {
+    const uint8_t *ip = (const uint8_t *) src;
+    const uint8_t *iend = ip + srcSize;
+    uint8_t *op = (uint8_t *) dst;
+    uint8_t *oend = op + dstCapacity;
+    while(ip < iend) {
+        uint8_t token = *ip++;
+        size_t literalLength = token >> 4;
+        if(literalLength == 15) {
+            uint8_t extra;
+            do {
+                if(ip >= iend) {
+                    return -1;
+                }
+                extra = *ip++;
+                literalLength += extra;
+            } while(extra == 255);
+        }
+        if((size_t) (iend - ip) < literalLength || (size_t) (oend - op) < literalLength) {
+            return -1;
+        }
+        std::memcpy(op, ip, literalLength);
+        ip += literalLength;
+        op += literalLength;
+        if(ip == iend) {
+            break;
+        }
+        if(iend - ip < 2) {
+            return -1;
+        }
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if(offset == 0 || offset > (size_t) (op - (uint8_t *) dst)) {
+            return -1;
+        }
+        size_t matchLength = token & 15;
+        if(matchLength == 15) {
+            uint8_t extra;
+            do {
+                if(ip >= iend) {
+                    return -1;
+                }
+                extra = *ip++;
+                matchLength += extra;
+            } while(extra == 255);
+        }
+        matchLength += LZ4::MinMatch;
+        if((size_t) (oend - op) < matchLength) {
+            return -1;
+        }
+        const uint8_t *match = op - offset;
+        for(size_t i = 0; i < matchLength; ++i) {
+            op[i] = match[i];
+        }
+        op += matchLength;
+    }
+    return op - (uint8_t *) dst;
+}
+
+}
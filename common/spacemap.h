@@ -17,176 +17,915 @@
 
 #pragma once
 #include <algorithm>
+#include <atomic>
 #include <cstdio>
+#include <cstring>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "blockpool.h"
+#include "checksum.h"
 #include "types.h"
 
 namespace DogeFS {
 
-static inline uint64_t allocateBlock(std::FILE *devFile, SuperBlock *super, BlockType type) {
-    SpaceMap *spacemap = (SpaceMap *) new char[super->blockSize];
-    for(uint64_t i = 0; i < super->blkSpaceMap; ++i) {
-        if(freadat(devFile, spacemap, (i + super->ptrSpaceMap) * super->blockSize, super->blockSize) <= 0) {
+// Inode blocks are allocated this many at a time, contiguously, so that the
+// inodes of a group form a dense table instead of being scattered among its
+// data blocks.
+constexpr uint64_t InodeChunkBlocks = 8;
+
+// An allocation group covers the blocks described by one space map block.
+// Each group keeps a small free-space summary in memory, and its space map
+// block once something has needed it, and has its own lock, so that threads
+// allocating in different groups never wait for each other.
+struct AllocGroup {
+    std::mutex lock;
+    std::unique_ptr<SpaceMap[]> spacemap;   // nullptr until first used
+    uint64_t freeBlocks;    // BLK_UNUSED entries
+    uint64_t freeInodes;    // itemsLeft summed over BLK_INODE entries
+    uint64_t firstFree;     // no BLK_UNUSED entry lives below this index
+    std::vector<uint32_t> inodeBlocks;  // BLK_INODE entries with free slots, taken from the back
+    uint64_t fragBlock = UINT64_MAX;    // BLK_FRAG entry being filled since mount, if any
+    uint64_t fragNext = 0;              // its first slot not handed out yet
+};
+
+struct AllocGroups {
+    Device *devFile = nullptr;
+    SuperBlock *super = nullptr;
+    uint64_t count = 0;
+    uint64_t blocksPerGroup = 0;
+    std::unique_ptr<AllocGroup[]> groups;
+    // Filesystem-wide totals, kept up to date so that statfs never scans.
+    std::atomic<uint64_t> freeBlocks{0};
+    std::atomic<uint64_t> freeInodes{0};
+    std::atomic<uint64_t> usedInodes{0};
+    std::atomic<uint64_t> freeDirItems{0};
+};
+
+static inline AllocSummary summarizeSpaceMap(const SpaceMap *spacemap, uint64_t blocksPerGroup) {
+    AllocSummary summary;
+    std::memset(&summary, 0, sizeof summary);
+    summary.firstFree = (uint32_t) blocksPerGroup;
+    for(uint64_t j = 0; j < blocksPerGroup; ++j) {
+        if(spacemap[j].blockType == BLK_UNUSED) {
+            summary.freeBlocks += 1;
+            summary.firstFree = std::min<uint32_t>(summary.firstFree, (uint32_t) j);
+        } else if(spacemap[j].blockType == BLK_INODE) {
+            summary.freeInodes += spacemap[j].itemsLeft;
+        }
+    }
+    return summary;
+}
+
+// Add the free blocks and the inode and directory item slots described by
+// count space map entries to the totals in the superblock.
+static inline void countAllocTotals(SuperBlock *super, const SpaceMap *spacemap, uint64_t count) {
+    uint64_t inodesPerBlock = std::min<uint64_t>(super->blockSize / sizeof (Inode), 255);
+    for(uint64_t j = 0; j < count; ++j) {
+        if(spacemap[j].blockType == BLK_UNUSED) {
+            super->freeBlocks += 1;
+        } else if(spacemap[j].blockType == BLK_INODE) {
+            super->freeInodes += spacemap[j].itemsLeft;
+            super->usedInodes += inodesPerBlock - std::min<uint64_t>(spacemap[j].itemsLeft, inodesPerBlock);
+        } else if(spacemap[j].blockType == BLK_DIR) {
+            super->freeDirItems += spacemap[j].itemsLeft;
+        }
+    }
+}
+
+// Read the space map block of a group the first time it is needed.  The
+// caller holds the group lock.
+static inline bool loadAllocGroup(AllocGroups *groups, uint64_t groupID) {
+    AllocGroup &group = groups->groups[groupID];
+    if(group.spacemap) {
+        return true;
+    }
+    std::unique_ptr<SpaceMap[]> spacemap(new SpaceMap[groups->blocksPerGroup]);
+    if(freadmeta(groups->devFile, groups->super, spacemap.get(), (groupID + groups->super->ptrSpaceMap) * groups->super->blockSize, groups->super->blockSize) <= 0) {
+        std::perror("Read error");
+        return false;
+    }
+    group.spacemap = std::move(spacemap);
+    for(uint64_t j = groups->blocksPerGroup; j-- > 0;) {
+        if(group.spacemap[j].blockType == BLK_INODE && group.spacemap[j].itemsLeft != 0) {
+            group.inodeBlocks.push_back((uint32_t) j);
+        }
+    }
+    return true;
+}
+
+// Read the summary area written at the last clean unmount.  Only the
+// summaries are loaded; space map blocks follow on demand.
+static inline bool loadAllocSummary(Device *devFile, SuperBlock *super, AllocGroups *groups) {
+    uint64_t perBlock = super->blockSize / sizeof (AllocSummary);
+    BlockBuffer buffer(super->blockSize);
+    AllocSummary *area = buffer.as<AllocSummary>();
+    for(uint64_t i = 0; i < groups->count; ++i) {
+        if(i % perBlock == 0 && freadmeta(devFile, super, area, (super->ptrAllocSummary + i / perBlock) * super->blockSize, super->blockSize) <= 0) {
             std::perror("Read error");
-            delete[] spacemap;
-            return 0;
+            return false;
         }
-        for(uint64_t j = 0; j < super->blockSize / sizeof (SpaceMap); ++j) {
-            uint64_t targetBlock = i * (super->blockSize / sizeof (SpaceMap)) + j;
-            if(spacemap[j].blockType == BLK_UNUSED) {
-                spacemap[j].blockType = type;
-                if(type == BLK_INODE) {
-                    spacemap[j].itemsLeft = (uint8_t) std::min<uint64_t>(super->blockSize / sizeof (Inode) - 1, 255);
-                } else if(type == BLK_DIR) {
-                    spacemap[j].itemsLeft = (uint8_t) std::min<uint64_t>(super->blockSize / sizeof (DirItem) - 1, 255);
-                } else {
-                    spacemap[j].itemsLeft = type;
-                }
-                if(fwriteat(devFile, spacemap, (i + super->ptrSpaceMap) * super->blockSize, super->blockSize) <= 0) {
-                    std::perror("Write error");
-                    delete[] spacemap;
-                    return 0;
-                }
-                delete[] spacemap;
-                return targetBlock;
+        const AllocSummary &summary = area[i % perBlock];
+        if(summary.freeBlocks > groups->blocksPerGroup || summary.firstFree > groups->blocksPerGroup) {
+            std::printf("Allocator summary of group %" PRIu64 " is corrupted\n", i);
+            return false;
+        }
+        groups->groups[i].freeBlocks = summary.freeBlocks;
+        groups->groups[i].freeInodes = summary.freeInodes;
+        groups->groups[i].firstFree = summary.firstFree;
+    }
+    return true;
+}
+
+// Set up the allocation groups.  After a clean unmount only the summary area
+// is read, so mounting takes the same time whatever the device size;
+// otherwise every space map block is read and summarized again.
+static inline bool loadAllocGroups(Device *devFile, SuperBlock *super, AllocGroups *groups) {
+    groups->devFile = devFile;
+    groups->super = super;
+    groups->count = super->blkSpaceMap;
+    groups->blocksPerGroup = super->blockSize / sizeof (SpaceMap);
+    groups->groups.reset(new AllocGroup[groups->count]);
+    if(super->dirtyLevel == 0 && super->blkAllocSummary != 0) {
+        if(loadAllocSummary(devFile, super, groups)) {
+            groups->freeBlocks = super->freeBlocks;
+            groups->freeInodes = super->freeInodes;
+            groups->usedInodes = super->usedInodes;
+            groups->freeDirItems = super->freeDirItems;
+            return true;
+        }
+        std::puts("Rebuilding the allocator summary from the space map");
+    }
+    super->freeBlocks = 0;
+    super->freeInodes = 0;
+    super->usedInodes = 0;
+    super->freeDirItems = 0;
+    for(uint64_t i = 0; i < groups->count; ++i) {
+        AllocGroup &group = groups->groups[i];
+        if(!loadAllocGroup(groups, i)) {
+            return false;
+        }
+        AllocSummary summary = summarizeSpaceMap(group.spacemap.get(), groups->blocksPerGroup);
+        group.freeBlocks = summary.freeBlocks;
+        group.freeInodes = summary.freeInodes;
+        group.firstFree = summary.firstFree;
+        countAllocTotals(super, group.spacemap.get(), groups->blocksPerGroup);
+    }
+    groups->freeBlocks = super->freeBlocks;
+    groups->freeInodes = super->freeInodes;
+    groups->usedInodes = super->usedInodes;
+    groups->freeDirItems = super->freeDirItems;
+    return true;
+}
+
+// Write the in-memory summaries to the summary area and the totals to the
+// superblock, for the next mount.  The caller writes the superblock.
+static inline bool writeAllocSummary(Device *devFile, SuperBlock *super, AllocGroups *groups) {
+    super->freeBlocks = groups->freeBlocks;
+    super->freeInodes = groups->freeInodes;
+    super->usedInodes = groups->usedInodes;
+    super->freeDirItems = groups->freeDirItems;
+    if(super->blkAllocSummary == 0) {
+        return true;
+    }
+    uint64_t perBlock = super->blockSize / sizeof (AllocSummary);
+    BlockBuffer buffer(super->blockSize);
+    AllocSummary *area = buffer.as<AllocSummary>();
+    for(uint64_t i = 0; i < groups->count; i += perBlock) {
+        std::memset(area, 0, super->blockSize);
+        for(uint64_t k = 0; k < perBlock && i + k < groups->count; ++k) {
+            AllocGroup &group = groups->groups[i + k];
+            std::lock_guard<std::mutex> lock(group.lock);
+            area[k].freeBlocks = (uint32_t) group.freeBlocks;
+            area[k].freeInodes = (uint32_t) group.freeInodes;
+            area[k].firstFree = (uint32_t) group.firstFree;
+        }
+        if(fwritemeta(devFile, super, area, (super->ptrAllocSummary + i / perBlock) * super->blockSize, super->blockSize) <= 0) {
+            std::perror("Write error");
+            return false;
+        }
+    }
+    return true;
+}
+
+static inline bool writeAllocGroup(Device *devFile, SuperBlock *super, AllocGroups *groups, uint64_t groupID) {
+    if(fwritemeta(devFile, super, groups->groups[groupID].spacemap.get(), (groupID + super->ptrSpaceMap) * super->blockSize, super->blockSize) <= 0) {
+        std::perror("Write error");
+        return false;
+    }
+    return true;
+}
+
+// Threads without a placement goal start from a group derived from their
+// thread ID, which spreads unrelated allocations across the device.
+static inline uint64_t defaultAllocGroup(AllocGroups *groups) {
+    return std::hash<std::thread::id>()(std::this_thread::get_id()) % groups->count;
+}
+
+// Allocate a block inside one group, trying the goal index first and then
+// the first free entry onwards.  The caller holds the group lock.
+static inline uint64_t allocateBlockInGroup(Device *devFile, SuperBlock *super, AllocGroups *groups, uint64_t groupID, BlockType type, uint64_t goal) {
+    AllocGroup &group = groups->groups[groupID];
+    if(group.freeBlocks == 0) {
+        return 0;
+    }
+    if(!loadAllocGroup(groups, groupID)) {
+        return 0;
+    }
+    uint64_t j = group.firstFree;
+    if(goal >= group.firstFree && goal < groups->blocksPerGroup) {
+        for(j = goal; j < groups->blocksPerGroup && group.spacemap[j].blockType != BLK_UNUSED; ++j) {
+        }
+        if(j == groups->blocksPerGroup) {
+            j = group.firstFree;
+        }
+    }
+    for(; j < groups->blocksPerGroup; ++j) {
+        if(group.spacemap[j].blockType == BLK_UNUSED) {
+            break;
+        }
+    }
+    if(j == groups->blocksPerGroup) {
+        return 0;
+    }
+    group.spacemap[j].blockType = type;
+    if(type == BLK_DIR) {
+        // The first two items are "." and "..".
+        group.spacemap[j].itemsLeft = (uint8_t) std::min<uint64_t>(super->blockSize / sizeof (DirItem) - 2, 255);
+        groups->freeDirItems += group.spacemap[j].itemsLeft;
+    } else if(type == BLK_FRAG) {
+        group.spacemap[j].itemsLeft = 0;
+    } else {
+        group.spacemap[j].itemsLeft = type;
+    }
+    group.freeBlocks -= 1;
+    groups->freeBlocks -= 1;
+    if(j == group.firstFree) {
+        for(++group.firstFree; group.firstFree < groups->blocksPerGroup && group.spacemap[group.firstFree].blockType != BLK_UNUSED; ++group.firstFree) {
+        }
+    }
+    if(!writeAllocGroup(devFile, super, groups, groupID)) {
+        return 0;
+    }
+    uint64_t block = groupID * groups->blocksPerGroup + j;
+    if((type == BLK_FILE || type == BLK_FRAG ? dataChecksums(super) : metaChecksums(super)) && !sealBlock(devFile, super, block)) {
+        return 0;
+    }
+    return block;
+}
+
+// Allocate a block as close as possible to the goal block.  A goal of 0
+// means no preference.  Groups other than the goal group are first probed
+// without waiting, so concurrent allocators drift into different groups.
+static inline uint64_t allocateBlock(Device *devFile, SuperBlock *super, AllocGroups *groups, BlockType type, uint64_t goal = 0) {
+    uint64_t goalGroup = goal != 0 ? goal / groups->blocksPerGroup : defaultAllocGroup(groups);
+    uint64_t goalIndex = goal != 0 ? goal % groups->blocksPerGroup : 0;
+    if(goalGroup >= groups->count) {
+        goalGroup = 0;
+    }
+    for(int pass = 0; pass < 2; ++pass) {
+        for(uint64_t k = 0; k < groups->count; ++k) {
+            uint64_t groupID = (goalGroup + k) % groups->count;
+            AllocGroup &group = groups->groups[groupID];
+            std::unique_lock<std::mutex> lock(group.lock, std::defer_lock);
+            if(k == 0 || pass != 0) {
+                lock.lock();
+            } else if(!lock.try_lock()) {
+                continue;
+            }
+            uint64_t result = allocateBlockInGroup(devFile, super, groups, groupID, type, k == 0 ? goalIndex : 0);
+            if(result != 0) {
+                return result;
             }
         }
     }
-    delete[] spacemap;
     return 0;
 }
 
-static inline uint64_t allocateInode(std::FILE *devFile, SuperBlock *super) {
-    SpaceMap *spacemap = (SpaceMap *) new char[super->blockSize];
-    for(uint64_t i = 0; i < super->blkSpaceMap; ++i) {
-        if(freadat(devFile, spacemap, (i + super->ptrSpaceMap) * super->blockSize, super->blockSize) <= 0) {
-            std::perror("Read error");
-            delete[] spacemap;
-            return 0;
+// Allocate up to count contiguous blocks inside one group.  The first free
+// run at or after the goal index that is long enough wins; otherwise the
+// longest run in the group is taken.  The caller holds the group lock.
+static inline uint64_t allocateRunInGroup(Device *devFile, SuperBlock *super, AllocGroups *groups, uint64_t groupID, BlockType type, uint64_t goal, uint64_t count, uint64_t *allocated) {
+    AllocGroup &group = groups->groups[groupID];
+    if(group.freeBlocks == 0) {
+        return 0;
+    }
+    if(!loadAllocGroup(groups, groupID)) {
+        return 0;
+    }
+    uint64_t bestStart = 0;
+    uint64_t bestLength = 0;
+    uint64_t start = std::max(goal, group.firstFree);
+    for(int pass = 0; pass < 2 && bestLength < count; ++pass) {
+        uint64_t j = pass == 0 ? start : group.firstFree;
+        uint64_t end = pass == 0 ? groups->blocksPerGroup : start;
+        while(j < end && bestLength < count) {
+            if(group.spacemap[j].blockType != BLK_UNUSED) {
+                ++j;
+                continue;
+            }
+            uint64_t k = j;
+            while(k < groups->blocksPerGroup && k - j < count && group.spacemap[k].blockType == BLK_UNUSED) {
+                ++k;
+            }
+            if(k - j > bestLength) {
+                bestStart = j;
+                bestLength = k - j;
+            }
+            j = k;
+        }
+    }
+    if(bestLength == 0) {
+        return 0;
+    }
+    // Inode blocks have no free slots until they have been zeroed.
+    for(uint64_t j = bestStart; j < bestStart + bestLength; ++j) {
+        group.spacemap[j].blockType = type;
+        group.spacemap[j].itemsLeft = type == BLK_INODE ? 0 : type;
+    }
+    group.freeBlocks -= bestLength;
+    groups->freeBlocks -= bestLength;
+    if(bestStart == group.firstFree) {
+        for(group.firstFree += bestLength; group.firstFree < groups->blocksPerGroup && group.spacemap[group.firstFree].blockType != BLK_UNUSED; ++group.firstFree) {
+        }
+    }
+    if(!writeAllocGroup(devFile, super, groups, groupID)) {
+        return 0;
+    }
+    *allocated = bestLength;
+    return groupID * groups->blocksPerGroup + bestStart;
+}
+
+// Allocate a run of up to count contiguous data blocks near the goal block.
+// The number of blocks actually obtained is stored into *allocated; callers
+// loop until they have everything they need.
+static inline uint64_t allocateRun(Device *devFile, SuperBlock *super, AllocGroups *groups, BlockType type, uint64_t goal, uint64_t count, uint64_t *allocated) {
+    uint64_t goalGroup = goal != 0 ? goal / groups->blocksPerGroup : defaultAllocGroup(groups);
+    uint64_t goalIndex = goal != 0 ? goal % groups->blocksPerGroup : 0;
+    if(goalGroup >= groups->count) {
+        goalGroup = 0;
+    }
+    *allocated = 0;
+    for(uint64_t k = 0; k < groups->count; ++k) {
+        uint64_t groupID = (goalGroup + k) % groups->count;
+        AllocGroup &group = groups->groups[groupID];
+        std::lock_guard<std::mutex> lock(group.lock);
+        uint64_t result = allocateRunInGroup(devFile, super, groups, groupID, type, k == 0 ? goalIndex : 0, count, allocated);
+        if(result != 0) {
+            return result;
         }
-        for(uint64_t j = 0; j < super->blockSize / sizeof (SpaceMap); ++j) {
-            uint64_t targetBlock = i * (super->blockSize / sizeof (SpaceMap)) + j;
-            if(spacemap[j].blockType == BLK_INODE && spacemap[j].itemsLeft != 0) {
-                uint8_t itemsLeft = spacemap[j].itemsLeft;
-                spacemap[j].itemsLeft = itemsLeft - 1;
-                if(fwriteat(devFile, spacemap, (i + super->ptrSpaceMap) * super->blockSize, super->blockSize) <= 0) {
-                    std::perror("Write error");
-                    delete[] spacemap;
-                    return 0;
+    }
+    return 0;
+}
+
+// Return the number of block maps pointing at a data block.
+static inline unsigned blockRefs(AllocGroups *groups, uint64_t block) {
+    AllocGroup &group = groups->groups[block / groups->blocksPerGroup];
+    std::lock_guard<std::mutex> lock(group.lock);
+    if(!loadAllocGroup(groups, block / groups->blocksPerGroup)) {
+        return 0;
+    }
+    const SpaceMap &entry = group.spacemap[block % groups->blocksPerGroup];
+    if(entry.blockType == BLK_SHARED) {
+        return entry.itemsLeft;
+    }
+    return entry.blockType == BLK_FILE ? 1 : 0;
+}
+
+// Take one more reference on each block of the run [block, block + count).
+// Stops at the first block that is not a data block or whose count would
+// overflow, and returns how many blocks were shared.
+static inline uint64_t shareBlocks(Device *devFile, SuperBlock *super, AllocGroups *groups, uint64_t block, uint64_t count) {
+    uint64_t shared = 0;
+    while(shared < count) {
+        uint64_t groupID = (block + shared) / groups->blocksPerGroup;
+        AllocGroup &group = groups->groups[groupID];
+        std::lock_guard<std::mutex> lock(group.lock);
+        uint64_t before = shared;
+        if(!loadAllocGroup(groups, groupID)) {
+            break;
+        }
+        for(; shared < count && (block + shared) / groups->blocksPerGroup == groupID; ++shared) {
+            SpaceMap &entry = group.spacemap[(block + shared) % groups->blocksPerGroup];
+            if(entry.blockType == BLK_FILE) {
+                entry.blockType = BLK_SHARED;
+                entry.itemsLeft = 2;
+            } else if(entry.blockType == BLK_SHARED && entry.itemsLeft != 255) {
+                entry.itemsLeft += 1;
+            } else {
+                break;
+            }
+        }
+        if(shared != before && !writeAllocGroup(devFile, super, groups, groupID)) {
+            return before;
+        }
+        if(shared < count && (block + shared) / groups->blocksPerGroup == groupID) {
+            break;
+        }
+    }
+    return shared;
+}
+
+// Drop one reference on each block and return the blocks nobody points at
+// any more to their groups.  Each touched group is written once.
+static inline bool releaseBlocks(Device *devFile, SuperBlock *super, AllocGroups *groups, std::vector<uint64_t> blocks) {
+    std::sort(blocks.begin(), blocks.end());
+    bool ok = true;
+    for(size_t i = 0; i < blocks.size();) {
+        uint64_t groupID = blocks[i] / groups->blocksPerGroup;
+        AllocGroup &group = groups->groups[groupID];
+        std::lock_guard<std::mutex> lock(group.lock);
+        if(!loadAllocGroup(groups, groupID)) {
+            for(; i < blocks.size() && blocks[i] / groups->blocksPerGroup == groupID; ++i) {
+            }
+            ok = false;
+            continue;
+        }
+        for(; i < blocks.size() && blocks[i] / groups->blocksPerGroup == groupID; ++i) {
+            uint64_t j = blocks[i] % groups->blocksPerGroup;
+            if(group.spacemap[j].blockType == BLK_UNUSED) {
+                continue;
+            }
+            if(group.spacemap[j].blockType == BLK_SHARED) {
+                group.spacemap[j].itemsLeft -= 1;
+                if(group.spacemap[j].itemsLeft == 1) {
+                    group.spacemap[j].blockType = BLK_FILE;
+                    group.spacemap[j].itemsLeft = BLK_FILE;
                 }
-                delete[] spacemap;
-                return (targetBlock + 1) * (super->blockSize / sizeof (Inode)) - itemsLeft;
+                continue;
+            }
+            if(group.spacemap[j].blockType == BLK_DIR) {
+                groups->freeDirItems -= group.spacemap[j].itemsLeft;
             }
+            group.spacemap[j].blockType = BLK_UNUSED;
+            group.spacemap[j].itemsLeft = BLK_UNUSED;
+            group.freeBlocks += 1;
+            groups->freeBlocks += 1;
+            group.firstFree = std::min(group.firstFree, j);
         }
+        ok = writeAllocGroup(devFile, super, groups, groupID) && ok;
     }
-    delete[] spacemap;
-    return allocateBlock(devFile, super, BLK_INODE) * (super->blockSize / sizeof (Inode));
+    return ok;
 }
 
-static inline uint64_t allocateDirItem(std::FILE *devFile, SuperBlock *super, uint64_t blockID) {
-    size_t i = blockID / (super->blockSize / sizeof (SpaceMap));
-    size_t j = blockID % (super->blockSize / sizeof (SpaceMap));
-    SpaceMap *spacemap = (SpaceMap *) new char[super->blockSize];
-    if(freadat(devFile, spacemap, (i + super->ptrSpaceMap) * super->blockSize, super->blockSize) <= 0) {
-        std::perror("Read error");
-        delete[] spacemap;
+// Take up to count consecutive slots from the inode block at index j of a
+// group.  The caller holds the group lock and writes the group back.
+static inline uint64_t takeInodeSlots(SuperBlock *super, AllocGroups *groups, uint64_t groupID, uint64_t j, uint64_t count, uint64_t *taken) {
+    AllocGroup &group = groups->groups[groupID];
+    uint8_t itemsLeft = group.spacemap[j].itemsLeft;
+    *taken = std::min<uint64_t>(count, itemsLeft);
+    group.spacemap[j].itemsLeft = itemsLeft - (uint8_t) *taken;
+    group.freeInodes -= *taken;
+    groups->freeInodes -= *taken;
+    groups->usedInodes += *taken;
+    if(group.spacemap[j].itemsLeft == 0) {
+        auto it = std::find(group.inodeBlocks.rbegin(), group.inodeBlocks.rend(), (uint32_t) j);
+        if(it != group.inodeBlocks.rend()) {
+            group.inodeBlocks.erase(std::next(it).base());
+        }
+    }
+    return (groupID * groups->blocksPerGroup + j + 1) * (super->blockSize / sizeof (Inode)) - itemsLeft;
+}
+
+// Add a chunk of up to InodeChunkBlocks zeroed inode blocks to a group's
+// inode table, placed at or after the goal index.  The caller holds the
+// group lock.
+static inline bool allocateInodeChunkInGroup(Device *devFile, SuperBlock *super, AllocGroups *groups, uint64_t groupID, uint64_t goal) {
+    AllocGroup &group = groups->groups[groupID];
+    uint64_t count = 0;
+    uint64_t first = allocateRunInGroup(devFile, super, groups, groupID, BLK_INODE, goal, InodeChunkBlocks, &count);
+    if(first == 0) {
+        return false;
+    }
+    bool ok = fzeroat(devFile, first * super->blockSize, count * super->blockSize) > 0;
+    if(!ok) {
+        std::perror("Write error");
+    } else if(metaChecksums(super)) {
+        ok = storeChecksums(devFile, super, first, count, nullptr);
+    }
+    if(!ok) {
+        // The chunk goes back to the group rather than sitting in the
+        // inode table unzeroed.
+        for(uint64_t i = 0; i < count; ++i) {
+            uint64_t j = (first + i) % groups->blocksPerGroup;
+            group.spacemap[j].blockType = BLK_UNUSED;
+            group.spacemap[j].itemsLeft = BLK_UNUSED;
+        }
+        group.freeBlocks += count;
+        groups->freeBlocks += count;
+        group.firstFree = std::min(group.firstFree, first % groups->blocksPerGroup);
+        writeAllocGroup(devFile, super, groups, groupID);
+        return false;
+    }
+    uint8_t slots = (uint8_t) std::min<uint64_t>(super->blockSize / sizeof (Inode), 255);
+    for(uint64_t i = count; i-- > 0;) {
+        uint64_t j = (first + i) % groups->blocksPerGroup;
+        group.spacemap[j].itemsLeft = slots;
+        group.inodeBlocks.push_back((uint32_t) j);
+    }
+    group.freeInodes += count * slots;
+    groups->freeInodes += count * slots;
+    return writeAllocGroup(devFile, super, groups, groupID);
+}
+
+// Take up to count consecutive inodes from the group's inode table, growing
+// the table by a chunk when it is full and grow is set.  The caller holds
+// the group lock.
+static inline uint64_t allocateInodesInGroup(Device *devFile, SuperBlock *super, AllocGroups *groups, uint64_t groupID, uint64_t goal, bool grow, uint64_t count, uint64_t *taken) {
+    AllocGroup &group = groups->groups[groupID];
+    if(group.freeInodes == 0 && (!grow || group.freeBlocks == 0)) {
         return 0;
     }
-    if(spacemap[j].blockType == BLK_DIR && spacemap[j].itemsLeft != 0) {
-        uint8_t itemsLeft = spacemap[j].itemsLeft;
-        spacemap[j].itemsLeft = itemsLeft - 1;
-        if(fwriteat(devFile, spacemap, (i + super->ptrSpaceMap) * super->blockSize, super->blockSize) <= 0) {
-            std::perror("Write error");
-            delete[] spacemap;
+    if(!loadAllocGroup(groups, groupID)) {
+        return 0;
+    }
+    if(group.inodeBlocks.empty() && (!grow || !allocateInodeChunkInGroup(devFile, super, groups, groupID, goal))) {
+        return 0;
+    }
+    uint64_t result = takeInodeSlots(super, groups, groupID, group.inodeBlocks.back(), count, taken);
+    if(!writeAllocGroup(devFile, super, groups, groupID)) {
+        return 0;
+    }
+    return result;
+}
+
+// Allocate up to count consecutive inodes near the goal block, normally the
+// parent directory's inode, with a single space map write.  A free slot in
+// the goal group wins, then a new inode chunk in the goal group, and only
+// then a slot anywhere else.  Returns the first inode and stores how many
+// were obtained into *taken.
+static inline uint64_t allocateInodes(Device *devFile, SuperBlock *super, AllocGroups *groups, uint64_t goal, uint64_t count, uint64_t *taken) {
+    uint64_t goalGroup = goal != 0 ? goal / groups->blocksPerGroup : defaultAllocGroup(groups);
+    if(goalGroup >= groups->count) {
+        goalGroup = 0;
+    }
+    {
+        AllocGroup &group = groups->groups[goalGroup];
+        std::lock_guard<std::mutex> lock(group.lock);
+        uint64_t result = allocateInodesInGroup(devFile, super, groups, goalGroup, goal % groups->blocksPerGroup, true, count, taken);
+        if(result != 0) {
+            return result;
+        }
+    }
+    for(int pass = 0; pass < 2; ++pass) {
+        for(uint64_t k = 1; k < groups->count; ++k) {
+            uint64_t groupID = (goalGroup + k) % groups->count;
+            AllocGroup &group = groups->groups[groupID];
+            std::lock_guard<std::mutex> lock(group.lock);
+            uint64_t result = allocateInodesInGroup(devFile, super, groups, groupID, 0, pass != 0, count, taken);
+            if(result != 0) {
+                return result;
+            }
+        }
+    }
+    return 0;
+}
+
+static inline uint64_t allocateInode(Device *devFile, SuperBlock *super, AllocGroups *groups, uint64_t goal = 0) {
+    uint64_t taken;
+    return allocateInodes(devFile, super, groups, goal, 1, &taken);
+}
+
+// Give back the unused tail [first, first + count) of a batch of slots in an
+// inode or directory block.  Slots are handed out from the front of a block,
+// so this only works while nobody has taken slots after them; otherwise they
+// stay allocated until fsck reclaims them.
+static inline bool returnSlots(Device *devFile, SuperBlock *super, AllocGroups *groups, BlockType type, uint64_t first, uint64_t count) {
+    uint64_t perBlock = super->blockSize / (type == BLK_INODE ? sizeof (Inode) : sizeof (DirItem));
+    uint64_t block = first / perBlock;
+    uint64_t groupID = block / groups->blocksPerGroup;
+    if(count == 0 || groupID >= groups->count) {
+        return false;
+    }
+    AllocGroup &group = groups->groups[groupID];
+    std::lock_guard<std::mutex> lock(group.lock);
+    if(!loadAllocGroup(groups, groupID)) {
+        return false;
+    }
+    SpaceMap &entry = group.spacemap[block % groups->blocksPerGroup];
+    if(entry.blockType != type || (block + 1) * perBlock - entry.itemsLeft != first + count || entry.itemsLeft + count > 255) {
+        return false;
+    }
+    if(type == BLK_INODE && entry.itemsLeft == 0) {
+        group.inodeBlocks.push_back((uint32_t) (block % groups->blocksPerGroup));
+    }
+    entry.itemsLeft += count;
+    if(type == BLK_INODE) {
+        group.freeInodes += count;
+        groups->freeInodes += count;
+        groups->usedInodes -= count;
+    } else {
+        groups->freeDirItems += count;
+    }
+    return writeAllocGroup(devFile, super, groups, groupID);
+}
+
+// Take slots contiguous fragment slots from a fragment block of one group.
+// Slots are handed out from the front of the block the group has been
+// filling since mount, and a new block is started when that one has too few
+// left.  Only the number of slots in use is kept on disk, so blocks filled
+// before mount are not appended to; they are freed once their last slot is.
+// The caller holds the group lock.
+static inline uint64_t allocateFragmentInGroup(Device *devFile, SuperBlock *super, AllocGroups *groups, uint64_t groupID, uint64_t slots, uint64_t goal) {
+    AllocGroup &group = groups->groups[groupID];
+    if(!loadAllocGroup(groups, groupID)) {
+        return 0;
+    }
+    uint64_t slotsPerBlock = std::min<uint64_t>(super->blockSize / FragmentSlotSize, 255);
+    if(group.fragBlock >= groups->blocksPerGroup || group.spacemap[group.fragBlock].blockType != BLK_FRAG || group.fragNext + slots > slotsPerBlock || group.spacemap[group.fragBlock].itemsLeft + slots > 255) {
+        uint64_t block = allocateBlockInGroup(devFile, super, groups, groupID, BLK_FRAG, goal);
+        if(block == 0) {
+            return 0;
+        }
+        group.fragBlock = block % groups->blocksPerGroup;
+        group.fragNext = 0;
+    }
+    uint64_t slot = group.fragNext;
+    group.fragNext += slots;
+    group.spacemap[group.fragBlock].itemsLeft += (uint8_t) slots;
+    if(!writeAllocGroup(devFile, super, groups, groupID)) {
+        return 0;
+    }
+    return (groupID * groups->blocksPerGroup + group.fragBlock) * (super->blockSize / FragmentSlotSize) + slot;
+}
+
+// Allocate fragment slots for a small file near the goal block.  Returns
+// the fragment address, the byte offset divided by FragmentSlotSize.
+static inline uint64_t allocateFragment(Device *devFile, SuperBlock *super, AllocGroups *groups, uint64_t slots, uint64_t goal = 0) {
+    uint64_t goalGroup = goal != 0 ? goal / groups->blocksPerGroup : defaultAllocGroup(groups);
+    if(goalGroup >= groups->count) {
+        goalGroup = 0;
+    }
+    for(uint64_t k = 0; k < groups->count; ++k) {
+        uint64_t groupID = (goalGroup + k) % groups->count;
+        AllocGroup &group = groups->groups[groupID];
+        std::lock_guard<std::mutex> lock(group.lock);
+        uint64_t result = allocateFragmentInGroup(devFile, super, groups, groupID, slots, k == 0 ? goal % groups->blocksPerGroup : 0);
+        if(result != 0) {
+            return result;
+        }
+    }
+    return 0;
+}
+
+// Give back slots fragment slots starting at address.  The fragment block is
+// returned to its group once none of its slots is in use.
+static inline bool releaseFragment(Device *devFile, SuperBlock *super, AllocGroups *groups, uint64_t address, uint64_t slots) {
+    uint64_t block = address / (super->blockSize / FragmentSlotSize);
+    uint64_t groupID = block / groups->blocksPerGroup;
+    if(slots == 0 || groupID >= groups->count) {
+        return false;
+    }
+    AllocGroup &group = groups->groups[groupID];
+    std::lock_guard<std::mutex> lock(group.lock);
+    if(!loadAllocGroup(groups, groupID)) {
+        return false;
+    }
+    uint64_t j = block % groups->blocksPerGroup;
+    SpaceMap &entry = group.spacemap[j];
+    if(entry.blockType != BLK_FRAG) {
+        return false;
+    }
+    entry.itemsLeft -= (uint8_t) std::min<uint64_t>(entry.itemsLeft, slots);
+    if(entry.itemsLeft == 0) {
+        entry.blockType = BLK_UNUSED;
+        entry.itemsLeft = BLK_UNUSED;
+        group.freeBlocks += 1;
+        groups->freeBlocks += 1;
+        group.firstFree = std::min(group.firstFree, j);
+        if(group.fragBlock == j) {
+            group.fragBlock = UINT64_MAX;
+        }
+    }
+    return writeAllocGroup(devFile, super, groups, groupID);
+}
+
+// Take one more reference on slots fragment slots starting at address, for
+// a compressed block mapped by another file.  Fails when the fragment
+// block's count is full; the caller copies the data instead.
+static inline bool shareFragment(Device *devFile, SuperBlock *super, AllocGroups *groups, uint64_t address, uint64_t slots) {
+    uint64_t block = address / (super->blockSize / FragmentSlotSize);
+    uint64_t groupID = block / groups->blocksPerGroup;
+    if(slots == 0 || groupID >= groups->count) {
+        return false;
+    }
+    AllocGroup &group = groups->groups[groupID];
+    std::lock_guard<std::mutex> lock(group.lock);
+    if(!loadAllocGroup(groups, groupID)) {
+        return false;
+    }
+    SpaceMap &entry = group.spacemap[block % groups->blocksPerGroup];
+    if(entry.blockType != BLK_FRAG || entry.itemsLeft + slots > 255) {
+        return false;
+    }
+    entry.itemsLeft += (uint8_t) slots;
+    return writeAllocGroup(devFile, super, groups, groupID);
+}
+
+// Take up to count consecutive directory item slots from a directory block
+// with a single space map write.  Returns the first slot and stores how many
+// were obtained into *taken.
+static inline uint64_t allocateDirItems(Device *devFile, SuperBlock *super, AllocGroups *groups, uint64_t blockID, uint64_t count, uint64_t *taken) {
+    uint64_t i = blockID / groups->blocksPerGroup;
+    uint64_t j = blockID % groups->blocksPerGroup;
+    if(i >= groups->count) {
+        return 0;
+    }
+    AllocGroup &group = groups->groups[i];
+    std::lock_guard<std::mutex> lock(group.lock);
+    if(!loadAllocGroup(groups, i)) {
+        return 0;
+    }
+    if(group.spacemap[j].blockType == BLK_DIR && group.spacemap[j].itemsLeft != 0) {
+        uint8_t itemsLeft = group.spacemap[j].itemsLeft;
+        *taken = std::min<uint64_t>(count, itemsLeft);
+        group.spacemap[j].itemsLeft = itemsLeft - (uint8_t) *taken;
+        groups->freeDirItems -= *taken;
+        if(!writeAllocGroup(devFile, super, groups, i)) {
             return 0;
         }
-        delete[] spacemap;
         return (blockID + 1) * (super->blockSize / sizeof (DirItem)) - itemsLeft;
     }
-    delete[] spacemap;
     return 0;
 }
 
-static inline uint64_t getIndexForRead(std::FILE *devFile, SuperBlock *super, Inode *inode, uint64_t block) {
+static inline uint64_t allocateDirItem(Device *devFile, SuperBlock *super, AllocGroups *groups, uint64_t blockID) {
+    uint64_t taken;
+    return allocateDirItems(devFile, super, groups, blockID, 1, &taken);
+}
+
+// Read the block map entries of the logical blocks [0, count) of a file,
+// with at most one index block read.
+static inline bool readIndex(Device *devFile, SuperBlock *super, Inode *inode, uint64_t count, std::vector<uint64_t> *index) {
+    uint64_t indexEntries = super->blockSize / sizeof (uint64_t);
+    if(count > 4 + indexEntries) {
+        return false;
+    }
+    index->assign(count, 0);
+    for(uint64_t block = 0; block < std::min<uint64_t>(count, 4); ++block) {
+        (*index)[block] = inode->ptrDirect[block];
+    }
+    if(count <= 4 || inode->ptrIndirect1 == 0) {
+        return true;
+    }
+    BlockBuffer buffer(super->blockSize);
+    uint64_t *indirect = buffer.as<uint64_t>();
+    if(freadmeta(devFile, super, indirect, inode->ptrIndirect1 * super->blockSize, super->blockSize) <= 0) {
+        std::perror("Read error");
+        return false;
+    }
+    std::copy(indirect, indirect + (count - 4), index->begin() + 4);
+    return true;
+}
+
+static inline uint64_t getIndexForRead(Device *devFile, SuperBlock *super, Inode *inode, uint64_t block) {
     if(block < 4) {
         return inode->ptrDirect[block];
     } else if(block < 4 + super->blockSize / sizeof (uint64_t)) {
         if(inode->ptrIndirect1 == 0) {
             return 0;
         }
-        uint64_t *index = (uint64_t *) new char[super->blockSize];
-        if(freadat(devFile, index, inode->ptrIndirect1 * super->blockSize, super->blockSize) <= 0) {
+        BlockBuffer buffer(super->blockSize);
+        uint64_t *index = buffer.as<uint64_t>();
+        if(freadmeta(devFile, super, index, inode->ptrIndirect1 * super->blockSize, super->blockSize) <= 0) {
             std::perror("Read error");
-            delete[] index;
             return 0;
         }
         uint64_t result = index[block - 4];
-        delete[] index;
         return result;
     } else {
         return 0;
     }
 }
 
-static inline uint64_t getIndexForWrite(std::FILE *devFile, SuperBlock *super, Inode *inode, uint64_t block) {
-    if(block < 4) {
-        if(inode->ptrDirect[block] == 0) {
-            uint64_t ptrDataBlock = allocateBlock(devFile, super, BLK_FILE);
-            if(ptrDataBlock == 0) {
-                std::printf("\tFailed to allocate data block [%" PRIu64 "]\n", block);
-                return 0;
-            }
-            std::printf("\tAllocate data block [%" PRIu64 "] at %#" PRIx64"\n", block, ptrDataBlock);
-            if(fzeroat(devFile, ptrDataBlock * super->blockSize, super->blockSize) <= 0) {
-                std::perror("Write error");
-                return 0;
-            }
-            inode->ptrDirect[block] = ptrDataBlock;
+// Point the logical blocks [block, block + count) of a file at the physical
+// run starting at ptrBlock.  The single indirect index block is allocated on
+// first use and written once per call.
+static inline bool setIndexRun(Device *devFile, SuperBlock *super, AllocGroups *groups, Inode *inode, uint64_t block, uint64_t ptrBlock, uint64_t count) {
+    uint64_t indexEntries = super->blockSize / sizeof (uint64_t);
+    if(block + count > 4 + indexEntries) {
+        std::printf("\tFailed to map data block [%" PRIu64 "], limits exceeded\n", block + count - 1);
+        return false;
+    }
+    for(; count != 0 && block < 4; ++block, ++ptrBlock, --count) {
+        inode->ptrDirect[block] = ptrBlock;
+    }
+    if(count == 0) {
+        return true;
+    }
+    BlockBuffer buffer(super->blockSize);
+    uint64_t *index = buffer.as<uint64_t>();
+    if(inode->ptrIndirect1 == 0) {
+        uint64_t ptrIndexBlock = allocateBlock(devFile, super, groups, BLK_INDEX, ptrDeviceBlock(super, ptrBlock) + count);
+        if(ptrIndexBlock == 0) {
+            std::printf("\tFailed to allocate index block [%" PRIu64 "]\n", block);
+            return false;
         }
-        return inode->ptrDirect[block];
-    } else if(block < 4 + super->blockSize / sizeof (uint64_t)) {
-        if(inode->ptrIndirect1 == 0) {
-            uint64_t ptrIndexBlock = allocateBlock(devFile, super, BLK_INDEX);
-            if(ptrIndexBlock == 0) {
-                std::printf("\tFailed to allocate index block [%" PRIu64 "]\n", block);
-                return 0;
-            }
-            std::printf("\tAllocate index block [1] at %#" PRIx64"\n", ptrIndexBlock);
-            if(fzeroat(devFile, ptrIndexBlock * super->blockSize, super->blockSize) <= 0) {
-                std::perror("Write error");
-                return 0;
-            }
-            inode->ptrIndirect1 = ptrIndexBlock;
+        std::printf("\tAllocate index block [1] at %#" PRIx64"\n", ptrIndexBlock);
+        std::memset(index, 0, super->blockSize);
+        inode->ptrIndirect1 = ptrIndexBlock;
+    } else if(freadmeta(devFile, super, index, inode->ptrIndirect1 * super->blockSize, super->blockSize) <= 0) {
+        std::perror("Read error");
+        return false;
+    }
+    for(; count != 0; ++block, ++ptrBlock, --count) {
+        index[block - 4] = ptrBlock;
+    }
+    if(fwritemeta(devFile, super, index, inode->ptrIndirect1 * super->blockSize, super->blockSize) <= 0) {
+        std::perror("Write error");
+        return false;
+    }
+    return true;
+}
+
+// Drop the references a list of block map entries holds.  Compressed blocks
+// give back their fragment slots, and empty entries are skipped.
+static inline bool releaseEntries(Device *devFile, SuperBlock *super, AllocGroups *groups, const std::vector<uint64_t> &entries) {
+    bool ok = true;
+    std::vector<uint64_t> blocks;
+    for(uint64_t entry : entries) {
+        uint64_t length = compressedLength(entry);
+        if(length != 0) {
+            ok = releaseFragment(devFile, super, groups, compressedAddress(entry), ceilDiv(length, FragmentSlotSize)) && ok;
+        } else if(entry != 0) {
+            blocks.push_back(entry);
+        }
+    }
+    return releaseBlocks(devFile, super, groups, blocks) && ok;
+}
+
+// Unmap the logical blocks [begin, end) of a file and free them.  The
+// indirect index block goes too once it no longer points anywhere.  The
+// unmapped entries are appended to *freed.  Compressed blocks drop their
+// references on the fragment slots they live in.
+static inline bool punchIndex(Device *devFile, SuperBlock *super, AllocGroups *groups, Inode *inode, uint64_t begin, uint64_t end, std::vector<uint64_t> *freed) {
+    size_t firstFreed = freed->size();
+    for(uint64_t block = begin; block < std::min<uint64_t>(end, 4); ++block) {
+        if(inode->ptrDirect[block] != 0) {
+            freed->push_back(inode->ptrDirect[block]);
+            inode->ptrDirect[block] = 0;
         }
-        uint64_t *index = (uint64_t *) new char[super->blockSize];
-        if(freadat(devFile, index, inode->ptrIndirect1 * super->blockSize, super->blockSize) <= 0) {
+    }
+    if(end > 4 && inode->ptrIndirect1 != 0) {
+        BlockBuffer buffer(super->blockSize);
+        uint64_t *index = buffer.as<uint64_t>();
+        if(freadmeta(devFile, super, index, inode->ptrIndirect1 * super->blockSize, super->blockSize) <= 0) {
             std::perror("Read error");
-            delete[] index;
-            return 0;
+            return false;
         }
-        if(index[block - 4] == 0) {
-            uint64_t ptrDataBlock = allocateBlock(devFile, super, BLK_FILE);
-            if(ptrDataBlock == 0) {
-                return 0;
-            }
-            std::printf("\tAllocate data block [%" PRIu64 "] at %#" PRIx64"\n", block, ptrDataBlock);
-            if(fzeroat(devFile, ptrDataBlock * super->blockSize, super->blockSize) <= 0) {
-                std::perror("Write error");
-                return 0;
-            }
-            index[block - 4] = ptrDataBlock;
-            if(fwriteat(devFile, index, inode->ptrIndirect1 * super->blockSize, super->blockSize) <= 0) {
-                std::perror("Write error");
-                delete[] index;
-                return 0;
+        bool changed = false;
+        bool empty = true;
+        for(uint64_t i = 0; i < super->blockSize / sizeof (uint64_t); ++i) {
+            if(index[i] != 0 && i + 4 >= begin && i + 4 < end) {
+                freed->push_back(index[i]);
+                index[i] = 0;
+                changed = true;
             }
+            empty = empty && index[i] == 0;
+        }
+        if(empty) {
+            freed->push_back(inode->ptrIndirect1);
+            inode->ptrIndirect1 = 0;
+        } else if(changed && fwritemeta(devFile, super, index, inode->ptrIndirect1 * super->blockSize, super->blockSize) <= 0) {
+            std::perror("Write error");
+            return false;
+        }
+    }
+    return releaseEntries(devFile, super, groups, std::vector<uint64_t>(freed->begin() + firstFreed, freed->end()));
+}
+
+// Find the first file block at or after block that is mapped (data) or
+// unmapped (!data).  An indirect pointer of 0 stands for a whole empty
+// subtree and is skipped without reading anything.  Returns the block
+// count limit when there is no such block.
+static inline uint64_t seekIndex(Device *devFile, SuperBlock *super, Inode *inode, uint64_t block, bool data) {
+    uint64_t indexEntries = super->blockSize / sizeof (uint64_t);
+    for(; block < 4; ++block) {
+        if((inode->ptrDirect[block] != 0) == data) {
+            return block;
+        }
+    }
+    if(block >= 4 + indexEntries) {
+        return 4 + indexEntries;
+    }
+    if(inode->ptrIndirect1 == 0) {
+        return data ? 4 + indexEntries : block;
+    }
+    BlockBuffer buffer(super->blockSize);
+    uint64_t *index = buffer.as<uint64_t>();
+    if(freadmeta(devFile, super, index, inode->ptrIndirect1 * super->blockSize, super->blockSize) <= 0) {
+        std::perror("Read error");
+        return 4 + indexEntries;
+    }
+    for(; block < 4 + indexEntries; ++block) {
+        if((index[block - 4] != 0) == data) {
+            break;
         }
-        uint64_t result = index[block - 4];
-        delete[] index;
-        return result;
-    } else {
-        std::printf("\tFailed to allocate data block [%" PRIu64 "], limits exceeded\n", block);
-        return 0;
     }
+    return block;
 }
 
 }
@@ -25,6 +25,9 @@ constexpr uint64_t SuperBlockMagic  = 6000595048440531660;
 constexpr uint64_t DirItemMagic     = 2322280074159983117;
 constexpr uint64_t JournalItemMagic = 2322287779482569229;
 
+// Small files are packed into fragment blocks in units of this many bytes.
+constexpr uint64_t FragmentSlotSize = 256;
+
 enum BlockType {
     BLK_BAD     = 0x00,
     BLK_INDEX   = 0x11,
@@ -34,9 +37,26 @@ enum BlockType {
     BLK_UNUSED  = 0x55,
     BLK_FILE    = 0x66,
     BLK_JOURNAL = 0x77,
+    BLK_SHARED  = 0x88,     // BLK_FILE mapped more than once, itemsLeft counts the references
+    BLK_FRAG    = 0x99,     // small file fragments, itemsLeft counts the slots in use
+    BLK_DEDUP   = 0xaa,     // persistent dedup index, see DedupBlockHeader
     BLK_SPECIAL = 0xcc,
 };
 
+// Flags kept in the upper half of Inode::mode, above the POSIX mode bits.
+enum InodeFlag : uint32_t {
+    INODE_MODE_MASK = 0177777,
+    INODE_BLOCKS    = 0x00010000,   // contents holds block pointers, whatever the size
+    INODE_FRAGMENT  = 0x00020000,   // data lives in fragment slots, see ptrFragment
+    INODE_SNAPSHOT  = 0x00040000,   // part of a read-only snapshot, or /.snapshots itself
+};
+
+// Which blocks the checksum area covers, kept in SuperBlock::checksumFlags.
+enum ChecksumFlag : uint32_t {
+    CHECKSUM_META = 0x00000001,     // space map, inode, directory, index and dedup blocks
+    CHECKSUM_DATA = 0x00000002,     // file data and fragment blocks
+};
+
 struct SuperBlock {
     // 0
     uint8_t bootJump[16];
@@ -60,11 +80,59 @@ struct SuperBlock {
     uint64_t ptrLabelDirectory;
     uint64_t ptrRootInode;
     // 96
-    uint8_t bootCode[416];
+    uint8_t bootCode[64];
+    // 160
+    uint64_t ptrDedupIndex;
+    // 168
+    uint64_t ptrChecksum;
+    uint64_t blkChecksum;
+    // 184
+    uint32_t checksumFlags;
+    // 188
+    uint32_t reserved1;
+    // 192
+    uint64_t ptrAllocSummary;
+    uint64_t blkAllocSummary;
+    // 208, allocator totals, valid under the same rule as the summary area
+    uint64_t freeBlocks;
+    uint64_t freeInodes;
+    uint64_t usedInodes;
+    uint64_t freeDirItems;
+    // 240, striping across several devices; deviceCount is 0 or 1 on one
+    uint32_t deviceCount;
+    uint32_t deviceIndex;       // of the device this copy was written to
+    uint64_t stripeBlocks;
+    uint64_t setID;             // shared by the members of one filesystem
+    // 264, the directory holding the snapshot roots, 0 until it is made
+    uint64_t ptrSnapshotDir;
+    // 272
+    uint8_t reserved[240];
     // 512
 } DOGEFS_PACKED;
 static_assert(sizeof (SuperBlock) == 512, "sizeof (SuperBlock) == 512");
 
+// A block map entry with a nonzero length in its top bits points at an LZ4
+// compressed block: the low bits are then the fragment address of that many
+// bytes of compressed data.  Plain entries are device block numbers.
+constexpr unsigned PtrLengthShift = 48;
+constexpr uint64_t PtrAddressMask = (UINT64_C(1) << PtrLengthShift) - 1;
+
+static inline uint64_t compressedLength(uint64_t ptr) {
+    return ptr >> PtrLengthShift;
+}
+
+static inline uint64_t compressedAddress(uint64_t ptr) {
+    return ptr & PtrAddressMask;
+}
+
+// The device block a block map entry lives in, for placement decisions.
+static inline uint64_t ptrDeviceBlock(const SuperBlock *super, uint64_t ptr) {
+    if(compressedLength(ptr) != 0) {
+        return compressedAddress(ptr) * FragmentSlotSize / super->blockSize;
+    }
+    return ptr;
+}
+
 struct SpaceMap {
     // 0
     uint8_t blockType;
@@ -74,6 +142,21 @@ struct SpaceMap {
 } DOGEFS_PACKED;
 static_assert(sizeof (SpaceMap) == 2, "sizeof (SpaceMap) == 2");
 
+// The free-space summary of one allocation group, as kept in the allocator
+// summary area.  It is only trusted when the superblock's dirtyLevel is 0.
+struct AllocSummary {
+    // 0
+    uint32_t freeBlocks;
+    // 4
+    uint32_t freeInodes;
+    // 8
+    uint32_t firstFree;
+    // 12
+    uint32_t reserved;
+    // 16
+} DOGEFS_PACKED;
+static_assert(sizeof (AllocSummary) == 16, "sizeof (AllocSummary) == 16");
+
 struct Inode {
     // 0
     uint32_t mode;
@@ -110,11 +193,29 @@ struct Inode {
             uint64_t ptrIndirect3;
             uint64_t ptrIndirect4;
         };
+        struct {
+            uint64_t ptrFragment;       // byte offset / FragmentSlotSize
+            uint64_t fragmentSlots;
+        };
     };
     // 128
 } DOGEFS_PACKED;
 static_assert(sizeof (Inode) == 128, "sizeof (Inode) == 128");
 
+// Files of up to 64 bytes keep their data in Inode::contents until they are
+// switched to block storage.
+static inline bool isInline(const Inode *inode) {
+    return inode->size <= 64 && (inode->mode & (INODE_BLOCKS | INODE_FRAGMENT)) == 0;
+}
+
+static inline bool isFragment(const Inode *inode) {
+    return (inode->mode & INODE_FRAGMENT) != 0;
+}
+
+static inline bool isSnapshot(const Inode *inode) {
+    return (inode->mode & INODE_SNAPSHOT) != 0;
+}
+
 struct DirItem {
     // 0
     uint64_t magic;
@@ -130,6 +231,26 @@ struct DirItem {
 } DOGEFS_PACKED;
 static_assert(sizeof (DirItem) == 64, "sizeof (DirItem) == 64");
 
+// The dedup index is saved as a chain of BLK_DEDUP blocks, each holding a
+// header followed by up to blockSize / sizeof (DedupEntry) - 1 entries.
+struct DedupBlockHeader {
+    // 0
+    uint64_t ptrNext;
+    // 8
+    uint64_t count;
+    // 16
+} DOGEFS_PACKED;
+static_assert(sizeof (DedupBlockHeader) == 16, "sizeof (DedupBlockHeader) == 16");
+
+struct DedupEntry {
+    // 0
+    uint64_t hash;
+    // 8
+    uint64_t ptrBlock;
+    // 16
+} DOGEFS_PACKED;
+static_assert(sizeof (DedupEntry) == 16, "sizeof (DedupEntry) == 16");
+
 struct JournalItem {
     // 0
     uint64_t magic;
@@ -0,0 +1,620 @@
+/*
+    Copyright (C) 2017 Yuchen Ma <15208850@hdu.edu.cn>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <atomic>
+#include <cinttypes>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+#include "../common/checksum.h"
+#include "../common/device.h"
+#include "../common/spacemap.h"
+#include "../common/types.h"
+
+// Metadata is read in runs of up to this many contiguous blocks, shared out
+// among a pool of worker threads.
+constexpr uint64_t maxRunBlocks = 256;
+
+using namespace DogeFS;
+
+// What a device block turned out to be used for.
+enum BlockRole : uint8_t {
+    ROLE_NONE = 0,
+    ROLE_DATA,
+    ROLE_INDEX,
+    ROLE_INODE,
+    ROLE_DIR,
+    ROLE_FRAG,
+    ROLE_DEDUP,
+};
+
+// One per device block.  refs counts the block maps pointing at a data
+// block; items is one past the last slot in use in an inode, directory or
+// fragment block.
+struct BlockUse {
+    uint8_t role;
+    uint8_t refs;
+    uint16_t items;
+};
+
+struct Run {
+    uint64_t block;
+    uint64_t count;
+};
+
+struct InodeInfo {
+    bool reached = false;
+    uint64_t links = 0;
+    uint64_t subdirs = 0;
+};
+
+static Device *g_devFile = nullptr;
+static SuperBlock *g_super = nullptr;
+static bool g_readOnly = false;
+static bool g_superDirty = false;
+static std::atomic<uint64_t> g_fixed(0);
+static std::atomic<uint64_t> g_unfixed(0);
+static std::mutex g_reportLock;
+
+static uint64_t g_inodesPerBlock;
+static uint64_t g_itemsPerBlock;
+static uint64_t g_indexEntries;
+
+static std::vector<SpaceMap> g_spacemap;
+static std::vector<BlockUse> g_uses;
+
+// Metadata blocks read so far, and the ones changed by repairs.
+static std::mutex g_metaLock;
+static std::vector<std::unique_ptr<char[]>> g_metaBuffers;
+static std::unordered_map<uint64_t, char *> g_meta;
+static std::set<uint64_t> g_dirtyMeta;
+
+// Report a problem.  Repairs are only made when the device was opened for
+// writing, so a fixable problem only counts as fixed then.
+static void problem(bool fixable, const char *format, ...) {
+    std::lock_guard<std::mutex> lock(g_reportLock);
+    va_list args;
+    va_start(args, format);
+    std::vprintf(format, args);
+    va_end(args);
+    if(fixable && !g_readOnly) {
+        std::puts(" Fixed.");
+        g_fixed += 1;
+    } else {
+        std::puts(fixable ? " Not fixed." : " Cannot fix.");
+        g_unfixed += 1;
+    }
+}
+
+// Call fn(i) for every i in [0, count) from a pool of worker threads.
+template <typename F>
+static void parallelFor(uint64_t count, F fn) {
+    std::atomic<uint64_t> next(0);
+    unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<std::thread> workers;
+    for(unsigned t = 0; t < threads; ++t) {
+        workers.emplace_back([&] {
+            for(uint64_t i; (i = next++) < count;) {
+                fn(i);
+            }
+        });
+    }
+    for(std::thread &worker : workers) {
+        worker.join();
+    }
+}
+
+// Split the blocks matching want into runs of contiguous blocks.
+template <typename F>
+static std::vector<Run> findRuns(uint64_t begin, uint64_t end, F want) {
+    std::vector<Run> runs;
+    for(uint64_t block = begin; block < end; ++block) {
+        if(!want(block)) {
+            continue;
+        }
+        if(!runs.empty() && runs.back().block + runs.back().count == block && runs.back().count < maxRunBlocks) {
+            runs.back().count += 1;
+        } else {
+            runs.push_back(Run { block, 1 });
+        }
+    }
+    return runs;
+}
+
+// Read a run of blocks into dst with one request, and verify them when the
+// filesystem keeps metadata checksums.
+static bool readRun(const Run &run, char *dst) {
+    uint64_t blockSize = g_super->blockSize;
+    if(freadat(g_devFile, dst, run.block * blockSize, run.count * blockSize) <= 0) {
+        std::perror("Read error");
+        return false;
+    }
+    if(!metaChecksums(g_super)) {
+        return true;
+    }
+    std::vector<uint32_t> sums(run.count);
+    if(freadat(g_devFile, sums.data(), g_super->ptrChecksum * blockSize + run.block * sizeof (uint32_t), run.count * sizeof (uint32_t)) <= 0) {
+        std::perror("Read error");
+        return false;
+    }
+    for(uint64_t i = 0; i < run.count; ++i) {
+        if(crc32c(dst + i * blockSize, blockSize) != sums[i]) {
+            problem(false, "Checksum mismatch in block %#" PRIx64 ".", run.block + i);
+        }
+    }
+    return true;
+}
+
+static void loadMetadata(const std::vector<Run> &runs) {
+    parallelFor(runs.size(), [&](uint64_t i) {
+        std::unique_ptr<char[]> buf(new char[runs[i].count * g_super->blockSize]);
+        if(!readRun(runs[i], buf.get())) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(g_metaLock);
+        for(uint64_t j = 0; j < runs[i].count; ++j) {
+            g_meta[runs[i].block + j] = buf.get() + j * g_super->blockSize;
+        }
+        g_metaBuffers.push_back(std::move(buf));
+    });
+}
+
+// Return a metadata block, reading it now if the bulk pass did not.
+static char *loadBlock(uint64_t block) {
+    if(block == 0 || block >= g_super->blockCount) {
+        return nullptr;
+    }
+    auto it = g_meta.find(block);
+    if(it != g_meta.end()) {
+        return it->second;
+    }
+    std::unique_ptr<char[]> buf(new char[g_super->blockSize]);
+    if(!readRun(Run { block, 1 }, buf.get())) {
+        return nullptr;
+    }
+    char *result = buf.get();
+    g_meta[block] = result;
+    g_metaBuffers.push_back(std::move(buf));
+    return result;
+}
+
+static Inode *inodeAt(uint64_t ino) {
+    uint64_t block = ino / g_inodesPerBlock;
+    if(block == 0 || block >= g_super->blockCount || g_spacemap[block].blockType != BLK_INODE) {
+        return nullptr;
+    }
+    char *data = loadBlock(block);
+    return data ? (Inode *) (data + ino % g_inodesPerBlock * sizeof (Inode)) : nullptr;
+}
+
+// Record a use of a block.  Inode and fragment blocks are shared by many
+// inodes and data blocks by up to 255 block maps; every other role is
+// exclusive.  Returns false when the block cannot be used that way.
+static bool useBlock(uint64_t block, BlockRole role, uint64_t items = 0) {
+    if(block == 0 || block >= g_super->blockCount) {
+        return false;
+    }
+    uint8_t type = g_spacemap[block].blockType;
+    if(type == BLK_BAD || type == BLK_SUPER || type == BLK_SPECIAL || type == BLK_JOURNAL) {
+        return false;
+    }
+    BlockUse &use = g_uses[block];
+    if(use.role != ROLE_NONE && (use.role != role || (role != ROLE_DATA && role != ROLE_INODE && role != ROLE_FRAG))) {
+        return false;
+    }
+    if(role == ROLE_DATA && use.refs == 255) {
+        return false;
+    }
+    use.role = role;
+    use.refs = std::min(use.refs + 1, 255);
+    // Fragment blocks count the slots in use, once for each reference.
+    use.items = (uint16_t) (role == ROLE_FRAG ? std::min<uint64_t>(use.items + items, 255) : std::max<uint64_t>(use.items, items));
+    return true;
+}
+
+// Account for one block map entry of an inode.  A bad entry is cleared and
+// false returned, so that the caller writes the block holding it back.
+static bool checkPointer(uint64_t ino, uint64_t *ptr) {
+    if(*ptr == 0) {
+        return true;
+    }
+    uint64_t length = compressedLength(*ptr);
+    bool ok;
+    if(length != 0) {
+        uint64_t address = compressedAddress(*ptr);
+        uint64_t slotsPerBlock = g_super->blockSize / FragmentSlotSize;
+        ok = length <= g_super->blockSize / 2 && address % slotsPerBlock + ceilDiv(length, FragmentSlotSize) <= slotsPerBlock && useBlock(address / slotsPerBlock, ROLE_FRAG, ceilDiv(length, FragmentSlotSize));
+    } else {
+        ok = useBlock(*ptr, ROLE_DATA);
+    }
+    if(!ok) {
+        problem(true, "Inode #%" PRIu64 " maps a bad or conflicting block %#" PRIx64 ".", ino, *ptr);
+        *ptr = 0;
+    }
+    return ok;
+}
+
+static void scanFile(uint64_t ino, Inode *inode) {
+    if(isInline(inode)) {
+        return;
+    }
+    uint64_t slotsPerBlock = g_super->blockSize / FragmentSlotSize;
+    if(isFragment(inode)) {
+        uint64_t slot = inode->ptrFragment % slotsPerBlock;
+        if(inode->fragmentSlots == 0 || slot + inode->fragmentSlots > slotsPerBlock || !useBlock(inode->ptrFragment / slotsPerBlock, ROLE_FRAG, inode->fragmentSlots)) {
+            problem(false, "Inode #%" PRIu64 " has a bad fragment %#" PRIx64 ".", ino, inode->ptrFragment);
+        }
+        return;
+    }
+    bool changed = false;
+    for(uint64_t i = 0; i < 4; ++i) {
+        uint64_t ptr = inode->ptrDirect[i];
+        if(!checkPointer(ino, &ptr)) {
+            inode->ptrDirect[i] = ptr;
+            changed = true;
+        }
+    }
+    if(inode->ptrIndirect1 != 0) {
+        uint64_t *index = useBlock(inode->ptrIndirect1, ROLE_INDEX) ? (uint64_t *) loadBlock(inode->ptrIndirect1) : nullptr;
+        if(!index) {
+            problem(true, "Inode #%" PRIu64 " has a bad index block %#" PRIx64 ".", ino, inode->ptrIndirect1);
+            inode->ptrIndirect1 = 0;
+            changed = true;
+        } else {
+            bool indexChanged = false;
+            for(uint64_t i = 0; i < g_indexEntries; ++i) {
+                indexChanged = !checkPointer(ino, &index[i]) || indexChanged;
+            }
+            if(indexChanged) {
+                g_dirtyMeta.insert(inode->ptrIndirect1);
+            }
+        }
+    }
+    if(inode->ptrIndirect2 != 0 || inode->ptrIndirect3 != 0 || inode->ptrIndirect4 != 0) {
+        problem(true, "Inode #%" PRIu64 " uses unsupported index levels.", ino);
+        inode->ptrIndirect2 = inode->ptrIndirect3 = inode->ptrIndirect4 = 0;
+        changed = true;
+    }
+    if(changed) {
+        g_dirtyMeta.insert(ino / g_inodesPerBlock);
+    }
+}
+
+// Walk the directory tree from the root, accounting for every block that a
+// reachable inode uses, and fix the link counts.  Returns the number of
+// reachable inodes.
+static uint64_t walkTree() {
+    std::unordered_map<uint64_t, InodeInfo> inodes;
+    uint64_t root = g_super->ptrRootInode;
+    Inode *rootInode = inodeAt(root);
+    if(!rootInode || (rootInode->mode & 0170000) != 0040000) {
+        problem(false, "Root inode #%" PRIu64 " is not a directory.", root);
+        return 0;
+    }
+    inodes[root].reached = true;
+    useBlock(root / g_inodesPerBlock, ROLE_INODE, root % g_inodesPerBlock + 1);
+    std::vector<uint64_t> stack { root };
+    while(!stack.empty()) {
+        uint64_t dirIno = stack.back();
+        stack.pop_back();
+        uint64_t dirBlock = inodeAt(dirIno)->ptrDirect[0];
+        DirItem *items = useBlock(dirBlock, ROLE_DIR) ? (DirItem *) loadBlock(dirBlock) : nullptr;
+        if(!items) {
+            problem(false, "Directory #%" PRIu64 " has a bad directory block %#" PRIx64 ".", dirIno, dirBlock);
+            continue;
+        }
+        uint64_t used = 0;
+        bool changed = false;
+        for(uint64_t i = 0; i < g_itemsPerBlock; ++i) {
+            DirItem &item = items[i];
+            if(item.magic != DirItemMagic) {
+                continue;
+            }
+            std::string name(item.filename, strnlen(item.filename, sizeof item.filename));
+            if(name == "." || name == "..") {
+                used = i + 1;
+                continue;
+            }
+            Inode *child = inodeAt(item.inode);
+            uint32_t type = child ? child->mode & 0170000 : 0;
+            if(type != 0040000 && type != 0100000) {
+                problem(true, "Entry \"%s\" of directory #%" PRIu64 " points at a bad inode #%" PRIu64 ".", name.c_str(), dirIno, item.inode);
+                item.magic = 0;
+                changed = true;
+                continue;
+            }
+            InodeInfo &info = inodes[item.inode];
+            if(type == 0040000 && info.reached) {
+                problem(true, "Entry \"%s\" of directory #%" PRIu64 " is another link to directory #%" PRIu64 ".", name.c_str(), dirIno, item.inode);
+                item.magic = 0;
+                changed = true;
+                continue;
+            }
+            used = i + 1;
+            info.links += 1;
+            if(type == 0040000) {
+                inodes[dirIno].subdirs += 1;
+            }
+            if(!info.reached) {
+                info.reached = true;
+                useBlock(item.inode / g_inodesPerBlock, ROLE_INODE, item.inode % g_inodesPerBlock + 1);
+                if(type == 0040000) {
+                    stack.push_back(item.inode);
+                } else {
+                    scanFile(item.inode, child);
+                }
+            }
+        }
+        g_uses[dirBlock].items = (uint16_t) used;
+        if(changed) {
+            g_dirtyMeta.insert(dirBlock);
+        }
+    }
+    for(auto &it : inodes) {
+        Inode *inode = inodeAt(it.first);
+        uint64_t expected = (inode->mode & 0170000) == 0040000 ? 2 + it.second.subdirs : it.second.links;
+        if(inode->nlink != expected) {
+            problem(true, "Inode #%" PRIu64 " has %" PRIu64 " link(s), counted %" PRIu64 ".", it.first, inode->nlink, expected);
+            inode->nlink = expected;
+            g_dirtyMeta.insert(it.first / g_inodesPerBlock);
+        }
+    }
+    return inodes.size();
+}
+
+// Follow the dedup index chain.  A broken chain is dropped as a whole; the
+// index only holds hints.
+static void checkDedupIndex() {
+    std::vector<uint64_t> chain;
+    for(uint64_t block = g_super->ptrDedupIndex; block != 0;) {
+        char *data = block < g_super->blockCount && g_spacemap[block].blockType == BLK_DEDUP && useBlock(block, ROLE_DEDUP) ? loadBlock(block) : nullptr;
+        if(!data) {
+            problem(true, "Dedup index chain is broken at block %#" PRIx64 ".", block);
+            for(uint64_t b : chain) {
+                g_uses[b] = BlockUse {};
+            }
+            g_super->ptrDedupIndex = 0;
+            g_superDirty = true;
+            return;
+        }
+        chain.push_back(block);
+        block = ((const DedupBlockHeader *) data)->ptrNext;
+    }
+}
+
+// What the space map entry of a block should say, given its uses.
+static SpaceMap expectedEntry(uint64_t block) {
+    SpaceMap entry = g_spacemap[block];
+    if(entry.blockType == BLK_BAD || entry.blockType == BLK_SUPER || entry.blockType == BLK_SPECIAL || entry.blockType == BLK_JOURNAL) {
+        return entry;
+    }
+    const BlockUse &use = g_uses[block];
+    switch(use.role) {
+    case ROLE_DATA:
+        return use.refs == 1 ? SpaceMap { BLK_FILE, BLK_FILE } : SpaceMap { BLK_SHARED, use.refs };
+    case ROLE_INDEX:
+        return SpaceMap { BLK_INDEX, BLK_INDEX };
+    case ROLE_DEDUP:
+        return SpaceMap { BLK_DEDUP, BLK_DEDUP };
+    case ROLE_INODE:
+        return SpaceMap { BLK_INODE, (uint8_t) std::min<uint64_t>(g_inodesPerBlock - use.items, 255) };
+    case ROLE_DIR:
+        return SpaceMap { BLK_DIR, (uint8_t) std::min<uint64_t>(g_itemsPerBlock - use.items, 255) };
+    case ROLE_FRAG:
+        return SpaceMap { BLK_FRAG, (uint8_t) use.items };
+    default:
+        // Inode blocks are allocated a chunk at a time, so an inode block
+        // nothing uses is an unused part of the inode table.  One without
+        // free slots may never have been zeroed, and is given back.
+        if(entry.blockType == BLK_INODE && entry.itemsLeft != 0) {
+            return SpaceMap { BLK_INODE, (uint8_t) std::min<uint64_t>(g_inodesPerBlock, 255) };
+        }
+        return SpaceMap { BLK_UNUSED, BLK_UNUSED };
+    }
+}
+
+// Summarize the repaired space map for the allocator summary area and the
+// superblock totals, and say whether they have to be rewritten.  They are
+// only trusted by mount after a clean unmount, so only then is a mismatch a
+// problem; after a crash they are simply rebuilt.
+static bool checkAllocSummary(std::vector<AllocSummary> *summaries, SuperBlock *totals) {
+    uint64_t entriesPerMap = g_super->blockSize / sizeof (SpaceMap);
+    uint64_t perBlock = g_super->blockSize / sizeof (AllocSummary);
+    summaries->assign(g_super->blkAllocSummary * perBlock, AllocSummary());
+    for(uint64_t group = 0; group < g_super->blkSpaceMap; ++group) {
+        (*summaries)[group] = summarizeSpaceMap(&g_spacemap[group * entriesPerMap], entriesPerMap);
+    }
+    totals->freeBlocks = 0;
+    totals->freeInodes = 0;
+    totals->usedInodes = 0;
+    totals->freeDirItems = 0;
+    countAllocTotals(totals, g_spacemap.data(), g_spacemap.size());
+    if(g_super->dirtyLevel != 0) {
+        std::puts("Filesystem was not cleanly unmounted, rebuilding the allocator summary.");
+        return true;
+    }
+    std::vector<AllocSummary> stored(summaries->size());
+    if(freadat(g_devFile, stored.data(), g_super->ptrAllocSummary * g_super->blockSize, stored.size() * sizeof (AllocSummary)) <= 0) {
+        std::perror("Read error");
+        return true;
+    }
+    for(uint64_t group = 0; group < g_super->blkSpaceMap; ++group) {
+        const AllocSummary &a = stored[group];
+        const AllocSummary &b = (*summaries)[group];
+        if(a.freeBlocks != b.freeBlocks || a.freeInodes != b.freeInodes || a.firstFree != b.firstFree) {
+            problem(true, "Allocator summary of group %" PRIu64 " is stale.", group);
+            return true;
+        }
+    }
+    if(totals->freeBlocks != g_super->freeBlocks || totals->freeInodes != g_super->freeInodes || totals->usedInodes != g_super->usedInodes || totals->freeDirItems != g_super->freeDirItems) {
+        problem(true, "Allocator totals in the superblock are stale.");
+        return true;
+    }
+    return false;
+}
+
+int main(int argc, char *argv[]) {
+    int argi = 1;
+    if(argc >= 3 && argv[1] == std::string("-n")) {
+        g_readOnly = true;
+        argi = 2;
+    }
+    if(argc == argi || argv[argi] == std::string("--help")) {
+        std::puts("Usage: fsck.dogefs [-n] DEVFILE...\n");
+        return 0;
+    }
+    g_devFile = openDeviceSet(std::vector<std::string>(argv + argi, argv + argc), g_readOnly);
+    if(!g_devFile) {
+        std::fprintf(stderr, "Failed to open the device\n");
+        return 8;
+    }
+    g_super = new SuperBlock;
+    if(freadat(g_devFile, g_super, 0, sizeof (SuperBlock)) <= 0) {
+        std::perror("Read error");
+        return 8;
+    }
+    if(g_super->magic != SuperBlockMagic) {
+        std::fprintf(stderr, "Not a DogeFS filesystem.\n");
+        return 8;
+    }
+    BlockPool::setBlockSize(g_super->blockSize);
+    uint64_t blockSize = g_super->blockSize;
+    uint64_t blockCount = g_super->blockCount;
+    uint64_t entriesPerMap = blockSize / sizeof (SpaceMap);
+    g_inodesPerBlock = blockSize / sizeof (Inode);
+    g_itemsPerBlock = blockSize / sizeof (DirItem);
+    g_indexEntries = blockSize / sizeof (uint64_t);
+    std::printf("Device size: %.1lf MiB (%" PRIu64 " blocks)\n", blockCount * (blockSize / 1048576.), blockCount);
+
+    std::printf("Pass 1: Reading %" PRIu64 " space map block(s)...\n", g_super->blkSpaceMap);
+    g_spacemap.resize(g_super->blkSpaceMap * entriesPerMap);
+    std::vector<Run> mapRuns = findRuns(g_super->ptrSpaceMap, g_super->ptrSpaceMap + g_super->blkSpaceMap, [](uint64_t) { return true; });
+    std::atomic<bool> mapOK(true);
+    parallelFor(mapRuns.size(), [&](uint64_t i) {
+        if(!readRun(mapRuns[i], (char *) &g_spacemap[(mapRuns[i].block - g_super->ptrSpaceMap) * entriesPerMap])) {
+            mapOK = false;
+        }
+    });
+    if(!mapOK) {
+        std::fprintf(stderr, "Failed to read the space map.\n");
+        return 8;
+    }
+    g_uses.resize(blockCount);
+
+    std::vector<Run> metaRuns = findRuns(0, blockCount, [](uint64_t block) {
+        uint8_t type = g_spacemap[block].blockType;
+        return type == BLK_INODE || type == BLK_DIR || type == BLK_INDEX;
+    });
+    uint64_t metaBlocks = 0;
+    for(const Run &run : metaRuns) {
+        metaBlocks += run.count;
+    }
+    std::printf("Pass 2: Reading %" PRIu64 " metadata block(s) in %zu run(s)...\n", metaBlocks, metaRuns.size());
+    loadMetadata(metaRuns);
+
+    std::puts("Pass 3: Checking the directory tree...");
+    uint64_t reached = walkTree();
+    checkDedupIndex();
+    uint64_t inodeSlots = 0;
+    for(uint64_t block = 0; block < blockCount; ++block) {
+        if(g_spacemap[block].blockType == BLK_INODE) {
+            inodeSlots += g_inodesPerBlock - std::min<uint64_t>(g_spacemap[block].itemsLeft, g_inodesPerBlock);
+        }
+    }
+    std::printf("%" PRIu64 " reachable inode(s), %" PRIu64 " allocated slot(s)\n", reached, inodeSlots);
+
+    std::puts("Pass 4: Checking the space map...");
+    std::vector<char> dirtyGroups(g_super->blkSpaceMap);
+    std::atomic<uint64_t> wrongEntries(0);
+    std::atomic<uint64_t> reclaimed(0);
+    parallelFor(g_super->blkSpaceMap, [&](uint64_t group) {
+        for(uint64_t block = group * entriesPerMap; block < std::min(blockCount, (group + 1) * entriesPerMap); ++block) {
+            SpaceMap expected = expectedEntry(block);
+            if(expected.blockType != g_spacemap[block].blockType || expected.itemsLeft != g_spacemap[block].itemsLeft) {
+                wrongEntries += 1;
+                if(expected.blockType == BLK_UNUSED) {
+                    reclaimed += 1;
+                }
+                g_spacemap[block] = expected;
+                dirtyGroups[group] = 1;
+            }
+        }
+    });
+    if(wrongEntries != 0) {
+        problem(true, "%" PRIu64 " space map entries are wrong, %" PRIu64 " orphaned block(s) to reclaim.", (uint64_t) wrongEntries, (uint64_t) reclaimed);
+    }
+
+    std::vector<AllocSummary> summaries;
+    bool summaryDirty = false;
+    if(g_super->blkAllocSummary != 0) {
+        std::puts("Pass 5: Checking the allocator summary...");
+        SuperBlock totals = *g_super;
+        summaryDirty = checkAllocSummary(&summaries, &totals) && !g_readOnly;
+        if(summaryDirty) {
+            g_super->freeBlocks = totals.freeBlocks;
+            g_super->freeInodes = totals.freeInodes;
+            g_super->usedInodes = totals.usedInodes;
+            g_super->freeDirItems = totals.freeDirItems;
+            g_super->dirtyLevel = 0;
+            g_superDirty = true;
+        }
+    }
+
+    if(!g_readOnly && (g_fixed != 0 || g_superDirty)) {
+        std::puts("Writing repairs...");
+        for(uint64_t block : g_dirtyMeta) {
+            if(fwritemeta(g_devFile, g_super, g_meta[block], block * blockSize, blockSize) <= 0) {
+                std::perror("Write error");
+                return 8;
+            }
+        }
+        for(uint64_t group = 0; group < g_super->blkSpaceMap; ++group) {
+            if(dirtyGroups[group] && fwritemeta(g_devFile, g_super, &g_spacemap[group * entriesPerMap], (group + g_super->ptrSpaceMap) * blockSize, blockSize) <= 0) {
+                std::perror("Write error");
+                return 8;
+            }
+        }
+        for(uint64_t i = 0; summaryDirty && i < g_super->blkAllocSummary; ++i) {
+            if(fwritemeta(g_devFile, g_super, &summaries[i * (blockSize / sizeof (AllocSummary))], (i + g_super->ptrAllocSummary) * blockSize, blockSize) <= 0) {
+                std::perror("Write error");
+                return 8;
+            }
+        }
+        // The superblock goes last, so that it never calls a half written
+        // summary valid.
+        g_devFile->sync();
+        if(g_superDirty && fwriteat(g_devFile, g_super, 0, sizeof (SuperBlock)) <= 0) {
+            std::perror("Write error");
+            return 8;
+        }
+        g_devFile->sync();
+    }
+    delete g_devFile;
+
+    std::printf("%" PRIu64 " problem(s) fixed, %" PRIu64 " left.\n", (uint64_t) g_fixed, (uint64_t) g_unfixed);
+    delete g_super;
+    return g_unfixed != 0 ? 4 : g_fixed != 0 ? 1 : 0;
+}
@@ -19,8 +19,14 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <random>
 #include <string>
 #include <unistd.h>
+#include <utility>
+#include <vector>
+#include "../common/checksum.h"
+#include "../common/device.h"
+#include "../common/spacemap.h"
 #include "../common/types.h"
 
 constexpr uint64_t defaultBlockSize = 4096;
@@ -33,19 +39,49 @@ static const uint8_t bootCode[64] = {0x45, 0x72, 0x72, 0x6f, 0x72, 0x3a, 0x20, 0
 using namespace DogeFS;
 
 int main(int argc, char *argv[]) {
-    if(argc != 2 || argv[1] == std::string("--help")) {
-        std::puts("Usage: mkdogefs DEVFILE\n");
+    uint32_t checksumFlags = CHECKSUM_META;
+    uint64_t blockSize = defaultBlockSize;
+    // One allocation group per stripe unless told otherwise.
+    uint64_t stripeBlocks = blockSize / sizeof (SpaceMap);
+    int argi = 1;
+    for(; argi + 1 < argc && argv[argi][0] == '-' && argv[argi] != std::string("--help"); argi += 2) {
+        std::string option = argv[argi];
+        std::string value = argv[argi + 1];
+        if(option == "-c" && value == "none") {
+            checksumFlags = 0;
+        } else if(option == "-c" && value == "meta") {
+            checksumFlags = CHECKSUM_META;
+        } else if(option == "-c" && value == "all") {
+            checksumFlags = CHECKSUM_META | CHECKSUM_DATA;
+        } else if(option == "-s") {
+            uint64_t stripeKiB = std::strtoull(value.c_str(), nullptr, 10);
+            if(stripeKiB == 0 || stripeKiB * 1024 % blockSize != 0) {
+                std::fprintf(stderr, "Stripe unit must be a multiple of %" PRIu64 " KiB\n", blockSize / 1024);
+                return 1;
+            }
+            stripeBlocks = stripeKiB * 1024 / blockSize;
+        } else {
+            std::fprintf(stderr, "Unknown option: %s %s\n", option.c_str(), value.c_str());
+            return 1;
+        }
+    }
+    if(argc == argi || argv[argi] == std::string("--help")) {
+        std::puts("Usage: mkdogefs [-c none|meta|all] [-s STRIPE_KIB] DEVFILE...\n\n"
+                  "Several DEVFILEs are striped together, STRIPE_KIB at a time.\n");
         return 0;
     }
-    std::string device = argv[1];
-    std::FILE *devFile = std::fopen(device.c_str(), "r+b");
-    if(!devFile) {
-        std::perror("Failed to open the device");
-        return 1;
+    std::vector<Device *> members;
+    for(int i = argi; i < argc; ++i) {
+        Device *member = openDevice(argv[i]);
+        if(!member) {
+            std::perror("Failed to open the device");
+            return 1;
+        }
+        std::printf("Device %s: %.1lf MiB\n", argv[i], member->size() / 1048576.);
+        members.push_back(member);
     }
-    fseeko(devFile, 0, SEEK_END);
-    uint64_t devSize = (uint64_t) ftello(devFile);
-    uint64_t blockSize = defaultBlockSize;
+    Device *devFile = members.size() == 1 ? members[0] : new StripedDevice(members, stripeBlocks * blockSize);
+    uint64_t devSize = devFile->size();
     uint64_t blockCount = devSize / blockSize;
     std::printf("Device size: %.1lf MiB (%" PRIu64 " blocks)\n", devSize / 1048576., blockCount);
     if(blockCount < defaultMinimumBlocks) {
@@ -58,7 +94,7 @@ int main(int argc, char *argv[]) {
     std::memcpy(super->bootJump, bootJump, sizeof bootJump);
     super->magic = SuperBlockMagic;
     super->version[0] = 1;
-    super->version[1] = 0;
+    super->version[1] = 1;
     super->dirtyLevel = 0;
     super->blockSize = blockSize;
     super->blockCount = blockCount;
@@ -67,22 +103,26 @@ int main(int argc, char *argv[]) {
     super->ptrJournal = blockCount - defaultJournalBlocks;
     super->blkJournal = defaultJournalBlocks;
     super->ptrLabelDirectory = 0;
-    uint64_t ptrRootInodeBlock = super->ptrSpaceMap + super->blkSpaceMap;
-    uint64_t ptrRootDirBlock = ptrRootInodeBlock + 1;
+    super->checksumFlags = checksumFlags;
+    if(members.size() > 1) {
+        std::random_device random;
+        super->deviceCount = members.size();
+        super->stripeBlocks = stripeBlocks;
+        super->setID = (uint64_t) random() << 32 | random();
+        std::printf("Striping %zu devices, %" PRIu64 " KiB at a time\n", members.size(), stripeBlocks * blockSize / 1024);
+    }
+    super->ptrChecksum = checksumFlags != 0 ? super->ptrSpaceMap + super->blkSpaceMap : 0;
+    super->blkChecksum = checksumFlags != 0 ? ceilDiv<uint64_t>(blockCount * sizeof (uint32_t), blockSize) : 0;
+    super->ptrAllocSummary = super->ptrSpaceMap + super->blkSpaceMap + super->blkChecksum;
+    super->blkAllocSummary = ceilDiv<uint64_t>(super->blkSpaceMap * sizeof (AllocSummary), blockSize);
+    uint64_t ptrRootInodeBlock = super->ptrAllocSummary + super->blkAllocSummary;
+    uint64_t ptrRootDirBlock = ptrRootInodeBlock + InodeChunkBlocks;
     super->ptrRootInode = ptrRootInodeBlock * (blockSize / sizeof (Inode));
     std::memcpy(super->bootCode, bootCode, sizeof bootCode);
-    std::printf("Writing superblocks at block:");
-    for(uint64_t i = 0; i < super->ptrJournal; i += 1024) {
-        std::printf(" %zu", i);
-        if(fwriteat(devFile, super, i * blockSize, blockSize) <= 0) {
-            std::puts("");
-            std::perror("Write error");
-            return 1;
-        }
-    }
-    std::puts("");
-
     std::printf("Writing %" PRIu64 " space map block(s)...\n", super->blkSpaceMap);
+    // Checksums of the metadata blocks written here, for the checksum area.
+    std::vector<std::pair<uint64_t, uint32_t>> checksums;
+    std::vector<AllocSummary> summaries;
     SpaceMap *spacemap = (SpaceMap *) new char[blockSize];
     for(uint64_t i = 0; i < super->blkSpaceMap; ++i) {
         for(uint64_t j = 0; j < blockSize / sizeof (SpaceMap); ++j) {
@@ -90,15 +130,16 @@ int main(int argc, char *argv[]) {
             if(targetBlock >= blockCount) {
                 spacemap[j].blockType = BLK_BAD;
                 spacemap[j].itemsLeft = BLK_BAD;
-            } else if(targetBlock >= super->ptrSpaceMap && targetBlock < super->ptrSpaceMap + super->blkSpaceMap) {
+            } else if(targetBlock >= super->ptrSpaceMap && targetBlock < ptrRootInodeBlock) {
                 spacemap[j].blockType = BLK_SPECIAL;
                 spacemap[j].itemsLeft = BLK_SPECIAL;
             } else if(targetBlock >= super->ptrJournal) {
                 spacemap[j].blockType = BLK_JOURNAL;
                 spacemap[j].itemsLeft = BLK_JOURNAL;
-            } else if(targetBlock == ptrRootInodeBlock) {
+            } else if(targetBlock >= ptrRootInodeBlock && targetBlock < ptrRootDirBlock) {
+                // The first inode chunk, holding the root inode.
                 spacemap[j].blockType = BLK_INODE;
-                spacemap[j].itemsLeft = (uint8_t) std::min<uint64_t>(blockSize / sizeof (Inode) - 1, 255);
+                spacemap[j].itemsLeft = (uint8_t) std::min<uint64_t>(blockSize / sizeof (Inode) - (targetBlock == ptrRootInodeBlock ? 1 : 0), 255);
             } else if(targetBlock == ptrRootDirBlock) {
                 spacemap[j].blockType = BLK_DIR;
                 spacemap[j].itemsLeft = (uint8_t) std::min<uint64_t>(blockSize / sizeof (DirItem) - 2, 255);
@@ -114,9 +155,23 @@ int main(int argc, char *argv[]) {
             std::perror("Write error");
             return 1;
         }
+        checksums.push_back(std::make_pair(i + super->ptrSpaceMap, crc32c(spacemap, blockSize)));
+        summaries.push_back(summarizeSpaceMap(spacemap, blockSize / sizeof (SpaceMap)));
+        countAllocTotals(super, spacemap, blockSize / sizeof (SpaceMap));
     }
     delete[] spacemap;
 
+    std::printf("Writing %" PRIu64 " allocator summary block(s)...\n", super->blkAllocSummary);
+    summaries.resize(super->blkAllocSummary * (blockSize / sizeof (AllocSummary)));
+    for(uint64_t i = 0; i < super->blkAllocSummary; ++i) {
+        const AllocSummary *area = &summaries[i * (blockSize / sizeof (AllocSummary))];
+        if(fwriteat(devFile, area, (i + super->ptrAllocSummary) * blockSize, blockSize) <= 0) {
+            std::perror("Write error");
+            return 1;
+        }
+        checksums.push_back(std::make_pair(i + super->ptrAllocSummary, crc32c(area, blockSize)));
+    }
+
     std::puts("Writing root inode...");
     Inode *inode = (Inode *) new char[blockSize];
     std::memset(inode, 0, blockSize);
@@ -131,6 +186,15 @@ int main(int argc, char *argv[]) {
         std::perror("Write error");
         return 1;
     }
+    checksums.push_back(std::make_pair(ptrRootInodeBlock, crc32c(inode, blockSize)));
+    std::memset(inode, 0, blockSize);
+    for(uint64_t i = ptrRootInodeBlock + 1; i < ptrRootDirBlock; ++i) {
+        if(fwriteat(devFile, inode, i * blockSize, blockSize) <= 0) {
+            std::perror("Write error");
+            return 1;
+        }
+        checksums.push_back(std::make_pair(i, crc32c(inode, blockSize)));
+    }
     delete[] inode;
 
     std::puts("Writing root directory...");
@@ -149,8 +213,56 @@ int main(int argc, char *argv[]) {
         std::perror("Write error");
         return 1;
     }
+    checksums.push_back(std::make_pair(ptrRootDirBlock, crc32c(dir, blockSize)));
     delete[] dir;
 
+    if(super->blkChecksum != 0) {
+        std::printf("Writing %" PRIu64 " checksum block(s)...\n", super->blkChecksum);
+        uint64_t perBlock = blockSize / sizeof (uint32_t);
+        uint32_t *area = (uint32_t *) new char[blockSize];
+        for(uint64_t i = 0; i < super->blkChecksum; ++i) {
+            std::memset(area, 0, blockSize);
+            for(const auto &it : checksums) {
+                if(it.first / perBlock == i) {
+                    area[it.first % perBlock] = it.second;
+                }
+            }
+            if(fwriteat(devFile, area, (i + super->ptrChecksum) * blockSize, blockSize) <= 0) {
+                std::perror("Write error");
+                return 1;
+            }
+        }
+        delete[] area;
+    }
+
+    std::printf("Writing superblocks at block:");
+    for(uint64_t i = 0; i < super->ptrJournal; i += 1024) {
+        // Copies that would land in the metadata areas, the root inode
+        // chunk or the root directory give way to them, as in the space map.
+        if(i >= super->ptrSpaceMap && i <= ptrRootDirBlock) {
+            continue;
+        }
+        std::printf(" %zu", i);
+        if(fwriteat(devFile, super, i * blockSize, blockSize) <= 0) {
+            std::puts("");
+            std::perror("Write error");
+            return 1;
+        }
+    }
+    std::puts("");
+
+    if(super->deviceCount > 1) {
+        std::puts("Labelling the devices...");
+        for(size_t i = 0; i < members.size(); ++i) {
+            super->deviceIndex = i;
+            if(fwriteat(members[i], super, 0, blockSize) <= 0) {
+                std::perror("Write error");
+                return 1;
+            }
+        }
+        super->deviceIndex = 0;
+    }
+
     std::printf("Writeing %" PRIu64 " journal blocks...\n", super->blkJournal);
     JournalItem *journal = (JournalItem *) new char[blockSize];
     std::memset(journal, 0, blockSize);
@@ -164,8 +276,8 @@ int main(int argc, char *argv[]) {
     delete[] super;
 
     std::printf("Flushing cache... ");
-    fsync(fileno(devFile));
-    std::fclose(devFile);
+    devFile->sync();
+    delete devFile;
 
     std::puts("Done!");
     return 0;
@@ -0,0 +1,96 @@
+#!/bin/sh
+# Compare the pread and mmap device backends of mount.dogefs.
+#
+# Usage: bench.sh [IMAGE [SIZE_MIB]]
+#
+# Formats IMAGE (default /tmp/dogefs-bench.img), fills it with 2 MiB files, the
+# largest size a file can have with 4 KiB blocks, and a tree of small ones,
+# then for each backend times a cold sequential read of the large files, a
+# second, warm one, and a stat walk of the tree.
+# Dropping the kernel caches between runs needs root; without it the "cold"
+# numbers only drop the filesystem's own caches.
+
+set -e
+
+HERE=$(cd "$(dirname "$0")" && pwd)
+IMAGE=${1:-/tmp/dogefs-bench.img}
+SIZE=${2:-512}
+MNT=$(mktemp -d)
+FILE_COUNT=$((SIZE / 8))
+FILE_MIB=$((FILE_COUNT * 2))
+
+now() {
+    date +%s.%N
+}
+
+rate() {
+    echo "$1 $2 $3" | awk '{ printf "%8.1f MiB/s", $1 / ($3 - $2) }'
+}
+
+elapsed() {
+    echo "$1 $2" | awk '{ printf "%8.3f s", $2 - $1 }'
+}
+
+mountfs() {
+    # mount.dogefs stays in the foreground and logs every request.
+    "$HERE/mount.dogefs" $1 "$IMAGE" "$MNT" >/dev/null 2>&1 &
+    while ! mountpoint -q "$MNT"; do
+        sleep 0.1
+    done
+}
+
+umountfs() {
+    fusermount3 -u "$MNT"
+    wait
+}
+
+# Do not leave the filesystem mounted when a step fails.
+cleanup() {
+    if mountpoint -q "$MNT"; then
+        umountfs
+    fi
+    rmdir "$MNT"
+}
+trap cleanup EXIT
+
+dropcaches() {
+    sync
+    if [ -w /proc/sys/vm/drop_caches ]; then
+        echo 3 > /proc/sys/vm/drop_caches
+    fi
+}
+
+truncate -s "${SIZE}M" "$IMAGE"
+"$HERE/../mkfs.dogefs/mkfs.dogefs" "$IMAGE" >/dev/null
+
+mountfs ""
+mkdir "$MNT/large"
+for i in $(seq "$FILE_COUNT"); do
+    dd if=/dev/urandom of="$MNT/large/$i" bs=1M count=2 status=none
+done
+for d in 0 1 2 3 4 5 6 7; do
+    mkdir "$MNT/d$d"
+    for f in 0 1 2 3 4 5 6 7 8 9 10 11 12 13 14 15 16 17 18 19; do
+        echo "$d/$f" > "$MNT/d$d/f$f"
+    done
+done
+umountfs
+
+for backend in pread mmap; do
+    if [ $backend = mmap ]; then
+        options="-o mmap"
+    else
+        options=""
+    fi
+    dropcaches
+    mountfs "$options"
+    t0=$(now)
+    cat "$MNT"/large/* > /dev/null
+    t1=$(now)
+    cat "$MNT"/large/* > /dev/null
+    t2=$(now)
+    ls -lR "$MNT" > /dev/null
+    t3=$(now)
+    umountfs
+    echo "$backend: cold read $(rate $FILE_MIB $t0 $t1), warm read $(rate $FILE_MIB $t1 $t2), stat walk $(elapsed $t2 $t3)"
+done
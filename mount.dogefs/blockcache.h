@@ -0,0 +1,100 @@
+/*
+    Copyright (C) 2017 Yuchen Ma <15208850@hdu.edu.cn>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+namespace DogeFS {
+
+// LRU cache of device data blocks, keyed by block number.  It is filled by
+// readahead and by reads that miss, and every path that writes a data block
+// must invalidate or refresh the cached copy.
+class BlockCache {
+public:
+    BlockCache(uint64_t blockSize, uint64_t capacity) : blockSize(blockSize), capacity(capacity) {}
+
+    // Copy [begin, end) of a cached block into dst.  Returns false on a miss.
+    bool read(uint64_t block, void *dst, uint64_t begin, uint64_t end) {
+        std::lock_guard<std::mutex> guard(lock);
+        auto it = entries.find(block);
+        if(it == entries.end()) {
+            misses += 1;
+            return false;
+        }
+        lru.splice(lru.begin(), lru, it->second);
+        std::memcpy(dst, it->second->data.get() + begin, end - begin);
+        hits += 1;
+        return true;
+    }
+
+    bool contains(uint64_t block) {
+        std::lock_guard<std::mutex> guard(lock);
+        return entries.count(block) != 0;
+    }
+
+    void insert(uint64_t block, const void *src) {
+        std::lock_guard<std::mutex> guard(lock);
+        auto it = entries.find(block);
+        if(it != entries.end()) {
+            lru.splice(lru.begin(), lru, it->second);
+            std::memcpy(it->second->data.get(), src, blockSize);
+            return;
+        }
+        if(entries.size() >= capacity) {
+            entries.erase(lru.back().block);
+            lru.pop_back();
+        }
+        lru.emplace_front();
+        lru.front().block = block;
+        lru.front().data.reset(new char[blockSize]);
+        std::memcpy(lru.front().data.get(), src, blockSize);
+        entries[block] = lru.begin();
+    }
+
+    void invalidate(uint64_t block, uint64_t count = 1) {
+        std::lock_guard<std::mutex> guard(lock);
+        for(uint64_t i = block; i < block + count; ++i) {
+            auto it = entries.find(i);
+            if(it != entries.end()) {
+                lru.erase(it->second);
+                entries.erase(it);
+            }
+        }
+    }
+
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+
+private:
+    struct Entry {
+        uint64_t block;
+        std::unique_ptr<char[]> data;
+    };
+
+    std::mutex lock;
+    uint64_t blockSize;
+    uint64_t capacity;
+    std::list<Entry> lru;
+    std::unordered_map<uint64_t, std::list<Entry>::iterator> entries;
+};
+
+}
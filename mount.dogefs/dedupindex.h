@@ -0,0 +1,76 @@
+/*
+    Copyright (C) 2017 Yuchen Ma <15208850@hdu.edu.cn>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include "../common/types.h"
+
+namespace DogeFS {
+
+// Fingerprints of the data blocks written while dedup is enabled, so that a
+// block with the same contents can be shared instead of written again.  A
+// hit is only a candidate: the block may have been rewritten or freed since
+// it was recorded, so callers compare the contents before sharing it.
+class DedupIndex {
+public:
+    // Return the block recorded for a fingerprint, or 0.
+    uint64_t find(uint64_t hash) {
+        std::lock_guard<std::mutex> guard(lock);
+        auto it = entries.find(hash);
+        return it == entries.end() ? 0 : it->second;
+    }
+
+    void insert(uint64_t hash, uint64_t block) {
+        std::lock_guard<std::mutex> guard(lock);
+        entries[hash] = block;
+    }
+
+    std::vector<DedupEntry> snapshot() {
+        std::lock_guard<std::mutex> guard(lock);
+        std::vector<DedupEntry> result;
+        result.reserve(entries.size());
+        for(auto &it : entries) {
+            result.push_back(DedupEntry { it.first, it.second });
+        }
+        return result;
+    }
+
+    uint64_t size() {
+        std::lock_guard<std::mutex> guard(lock);
+        return entries.size();
+    }
+
+    // Approximate heap memory held by the index, in bytes.
+    uint64_t memoryUsage() {
+        std::lock_guard<std::mutex> guard(lock);
+        return entries.size() * (sizeof (std::pair<const uint64_t, uint64_t>) + 2 * sizeof (void *)) + entries.bucket_count() * sizeof (void *);
+    }
+
+    // Blocks written to the device and blocks shared instead, since mount.
+    std::atomic<uint64_t> writtenBlocks { 0 };
+    std::atomic<uint64_t> sharedBlocks { 0 };
+
+private:
+    std::mutex lock;
+    std::unordered_map<uint64_t, uint64_t> entries;
+};
+
+}
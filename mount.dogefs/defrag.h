@@ -0,0 +1,111 @@
+/*
+    Copyright (C) 2017 Yuchen Ma <15208850@hdu.edu.cn>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+namespace DogeFS {
+
+// A token bucket holding at most one second worth of bytes.  acquire()
+// sleeps until the bucket can pay for a request, so that background I/O
+// stays below the configured rate however it is split up.
+class RateLimiter {
+public:
+    explicit RateLimiter(uint64_t bytesPerSecond) :
+        rate(std::max<uint64_t>(bytesPerSecond, 1)),
+        tokens((double) rate),
+        last(std::chrono::steady_clock::now()) {}
+
+    // Returns false without waiting the full time if abort becomes set.
+    bool acquire(uint64_t bytes, const std::atomic<bool> &abort) {
+        std::unique_lock<std::mutex> guard(lock);
+        for(;;) {
+            auto now = std::chrono::steady_clock::now();
+            tokens = std::min<double>(tokens + std::chrono::duration<double>(now - last).count() * rate, (double) rate);
+            last = now;
+            // Requests larger than the bucket are let through once it is
+            // full, and leave it in debt.
+            if(tokens >= std::min<double>((double) bytes, (double) rate)) {
+                tokens -= bytes;
+                return true;
+            }
+            if(abort) {
+                return false;
+            }
+            guard.unlock();
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+            guard.lock();
+        }
+    }
+
+private:
+    std::mutex lock;
+    uint64_t rate;
+    double tokens;
+    std::chrono::steady_clock::time_point last;
+};
+
+// A background thread that runs a defragmentation pass over the filesystem
+// once per interval, until destroyed.  The pass gets a flag that is set when
+// it should give up early.
+class DefragWorker {
+public:
+    typedef std::function<void (const std::atomic<bool> &stop)> Pass;
+
+    DefragWorker(Pass pass, std::chrono::seconds interval) :
+        pass(std::move(pass)), interval(interval), stopping(false) {
+        thread = std::thread([this] { run(); });
+    }
+
+    ~DefragWorker() {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stopping = true;
+        }
+        cond.notify_all();
+        thread.join();
+    }
+
+private:
+    void run() {
+        for(;;) {
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                if(cond.wait_for(guard, interval, [this] { return (bool) stopping; })) {
+                    return;
+                }
+            }
+            pass(stopping);
+        }
+    }
+
+    Pass pass;
+    std::chrono::seconds interval;
+    std::atomic<bool> stopping;
+    std::mutex lock;
+    std::condition_variable cond;
+    std::thread thread;
+};
+
+}
@@ -0,0 +1,147 @@
+/*
+    Copyright (C) 2017 Yuchen Ma <15208850@hdu.edu.cn>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+namespace DogeFS {
+
+// Data written to file blocks that have no device block yet.  Allocation is
+// deferred until the pages are flushed, so that whole runs can be placed
+// contiguously and written once, without zero-filling them first.
+//
+// The table itself is guarded by an internal mutex.  The pages of one inode
+// are only touched while the caller holds that inode's lock.
+class DirtyBuffer {
+public:
+    typedef std::map<uint64_t, std::unique_ptr<char[]>> Pages;
+
+    explicit DirtyBuffer(uint64_t blockSize) : blockSize(blockSize) {}
+
+    // Return the buffered page for a file block, or nullptr.
+    char *find(uint64_t ino, uint64_t block) {
+        std::lock_guard<std::mutex> guard(lock);
+        auto it = inodes.find(ino);
+        if(it == inodes.end()) {
+            return nullptr;
+        }
+        auto page = it->second.find(block);
+        return page == it->second.end() ? nullptr : page->second.get();
+    }
+
+    // Return the buffered page for a file block, creating a zero-filled one.
+    char *get(uint64_t ino, uint64_t block) {
+        std::lock_guard<std::mutex> guard(lock);
+        std::unique_ptr<char[]> &page = inodes[ino][block];
+        if(!page) {
+            page.reset(new char[blockSize]);
+            std::memset(page.get(), 0, blockSize);
+            totalPages += 1;
+        }
+        return page.get();
+    }
+
+    // Return the first buffered file block at or after block, or UINT64_MAX.
+    uint64_t nextPage(uint64_t ino, uint64_t block) {
+        std::lock_guard<std::mutex> guard(lock);
+        auto it = inodes.find(ino);
+        if(it == inodes.end()) {
+            return UINT64_MAX;
+        }
+        auto page = it->second.lower_bound(block);
+        return page == it->second.end() ? UINT64_MAX : page->first;
+    }
+
+    uint64_t pageCount(uint64_t ino) {
+        std::lock_guard<std::mutex> guard(lock);
+        auto it = inodes.find(ino);
+        return it == inodes.end() ? 0 : it->second.size();
+    }
+
+    uint64_t pageCount() {
+        std::lock_guard<std::mutex> guard(lock);
+        return totalPages;
+    }
+
+    // Detach every page of an inode, for writeback.
+    Pages take(uint64_t ino) {
+        std::lock_guard<std::mutex> guard(lock);
+        Pages result;
+        auto it = inodes.find(ino);
+        if(it != inodes.end()) {
+            result.swap(it->second);
+            inodes.erase(it);
+            totalPages -= result.size();
+        }
+        return result;
+    }
+
+    // Hand back pages detached by take() that could not be written back.
+    void restore(uint64_t ino, Pages pages) {
+        if(pages.empty()) {
+            return;
+        }
+        std::lock_guard<std::mutex> guard(lock);
+        Pages &target = inodes[ino];
+        for(auto &page : pages) {
+            if(target.emplace(page.first, std::move(page.second)).second) {
+                totalPages += 1;
+            }
+        }
+    }
+
+    // Discard the pages of file blocks [begin, end).
+    void drop(uint64_t ino, uint64_t begin, uint64_t end = UINT64_MAX) {
+        std::lock_guard<std::mutex> guard(lock);
+        auto it = inodes.find(ino);
+        if(it == inodes.end()) {
+            return;
+        }
+        auto first = it->second.lower_bound(begin);
+        auto last = end == UINT64_MAX ? it->second.end() : it->second.lower_bound(end);
+        for(auto page = first; page != last; ++page) {
+            totalPages -= 1;
+        }
+        it->second.erase(first, last);
+        if(it->second.empty()) {
+            inodes.erase(it);
+        }
+    }
+
+    std::vector<uint64_t> dirtyInodes() {
+        std::lock_guard<std::mutex> guard(lock);
+        std::vector<uint64_t> result;
+        for(auto &it : inodes) {
+            result.push_back(it.first);
+        }
+        return result;
+    }
+
+private:
+    std::mutex lock;
+    uint64_t blockSize;
+    uint64_t totalPages = 0;
+    std::unordered_map<uint64_t, Pages> inodes;
+};
+
+}
@@ -0,0 +1,246 @@
+/*
+    Copyright (C) 2017 Yuchen Ma <15208850@hdu.edu.cn>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <mutex>
+#include "../common/device.h"
+
+namespace DogeFS {
+
+// Which queue the device I/O of a request waits in.
+enum class IoClass {
+    Interactive,    // lookups, attributes and directories, served first
+    Data,           // file contents, shared fairly among clients
+    Background,     // readahead and defragmentation, served when idle
+};
+
+struct IoTag {
+    IoClass ioClass;
+    uint32_t client;
+};
+
+// The tag of the I/O the calling thread issues.  Threads that never set one
+// are interactive.
+static inline IoTag &currentIoTag() {
+    static thread_local IoTag tag { IoClass::Interactive, 0 };
+    return tag;
+}
+
+// Tag the I/O of the calling thread for as long as it is in scope.
+class IoTagScope {
+public:
+    explicit IoTagScope(IoClass ioClass, uint32_t client = 0) : saved(currentIoTag()) {
+        currentIoTag() = IoTag { ioClass, client };
+    }
+
+    ~IoTagScope() {
+        currentIoTag() = saved;
+    }
+
+private:
+    IoTag saved;
+};
+
+// Admits at most depth device operations at a time.  Waiting interactive
+// operations go first, then data operations, then background ones.  Data
+// operations are stamped with a virtual start time that advances by their
+// size within each client, and the earliest goes first, so that every busy
+// client gets an equal share of the bytes; a client that was idle starts
+// from the current virtual time instead of banking credit.  Background jobs
+// may hold an inode lock, so one of them still gets in after every
+// backgroundEvery other admissions.
+class IoScheduler {
+public:
+    explicit IoScheduler(unsigned depth) : depth(depth) {}
+
+    void begin(const IoTag &tag, uint64_t bytes) {
+        std::unique_lock<std::mutex> guard(lock);
+        if(inflight < depth && waiting == 0) {
+            inflight += 1;
+            return;
+        }
+        Waiter waiter { 0, false };
+        if(tag.ioClass == IoClass::Interactive) {
+            interactive.push_back(&waiter);
+        } else if(tag.ioClass == IoClass::Background) {
+            background.push_back(&waiter);
+        } else {
+            Client &client = clients[tag.client];
+            waiter.start = std::max(virtualTime, client.finish);
+            client.finish = waiter.start + std::max<uint64_t>(bytes, 1);
+            client.waiters.push_back(&waiter);
+        }
+        waiting += 1;
+        dispatch();
+        admitted.wait(guard, [&waiter] { return waiter.admitted; });
+    }
+
+    void end() {
+        std::lock_guard<std::mutex> guard(lock);
+        inflight -= 1;
+        dispatch();
+    }
+
+private:
+    struct Waiter {
+        uint64_t start;
+        bool admitted;
+    };
+
+    struct Client {
+        std::deque<Waiter *> waiters;
+        uint64_t finish = 0;
+    };
+
+    void dispatch() {
+        bool any = false;
+        while(inflight < depth) {
+            Waiter *waiter = next();
+            if(!waiter) {
+                break;
+            }
+            waiter->admitted = true;
+            waiting -= 1;
+            inflight += 1;
+            any = true;
+        }
+        if(any) {
+            admitted.notify_all();
+        }
+    }
+
+    Waiter *next() {
+        Waiter *waiter = nullptr;
+        if(!background.empty() && passedOver >= backgroundEvery) {
+            passedOver = 0;
+            waiter = background.front();
+            background.pop_front();
+            return waiter;
+        }
+        passedOver += background.empty() ? 0 : 1;
+        if(!interactive.empty()) {
+            waiter = interactive.front();
+            interactive.pop_front();
+            return waiter;
+        }
+        Client *earliest = nullptr;
+        for(auto it = clients.begin(); it != clients.end();) {
+            if(it->second.waiters.empty() && it->second.finish <= virtualTime) {
+                it = clients.erase(it);
+                continue;
+            }
+            if(!it->second.waiters.empty() && (!earliest || it->second.waiters.front()->start < earliest->waiters.front()->start)) {
+                earliest = &it->second;
+            }
+            ++it;
+        }
+        if(earliest) {
+            waiter = earliest->waiters.front();
+            earliest->waiters.pop_front();
+            virtualTime = std::max(virtualTime, waiter->start);
+            return waiter;
+        }
+        if(!background.empty()) {
+            passedOver = 0;
+            waiter = background.front();
+            background.pop_front();
+        }
+        return waiter;
+    }
+
+    static constexpr unsigned backgroundEvery = 8;
+
+    std::mutex lock;
+    std::condition_variable admitted;
+    unsigned depth;
+    unsigned inflight = 0;
+    uint64_t waiting = 0;
+    unsigned passedOver = 0;                // admissions since background last got one
+    std::deque<Waiter *> interactive;
+    std::deque<Waiter *> background;
+    uint64_t virtualTime = 0;
+    std::map<uint32_t, Client> clients;     // those waiting, or ahead of virtualTime
+};
+
+// A device whose reads, writes and syncs pass through an IoScheduler, tagged
+// with the calling thread's IoTag.  Memory lent by view() is read without
+// going through it.  It owns the device underneath.
+class ScheduledDevice : public Device {
+public:
+    ScheduledDevice(Device *device, unsigned depth) : device(device), scheduler(depth) {
+        length = device->size();
+    }
+
+    ~ScheduledDevice() {
+        delete device;
+    }
+
+    bool read(void *ptr, uint64_t pos, size_t size) override {
+        scheduler.begin(currentIoTag(), size);
+        bool ok = device->read(ptr, pos, size);
+        return finish(ok);
+    }
+
+    bool write(const void *ptr, uint64_t pos, size_t size) override {
+        scheduler.begin(currentIoTag(), size);
+        bool ok = device->write(ptr, pos, size);
+        return finish(ok);
+    }
+
+    bool writev(const iovec *iov, int count, uint64_t pos) override {
+        size_t size = 0;
+        for(int i = 0; i < count; ++i) {
+            size += iov[i].iov_len;
+        }
+        scheduler.begin(currentIoTag(), size);
+        bool ok = device->writev(iov, count, pos);
+        return finish(ok);
+    }
+
+    bool sync() override {
+        scheduler.begin(currentIoTag(), 0);
+        bool ok = device->sync();
+        return finish(ok);
+    }
+
+    const char *view(uint64_t pos, size_t size) override {
+        return device->view(pos, size);
+    }
+
+    void advise(uint64_t pos, size_t size, int advice) override {
+        device->advise(pos, size, advice);
+    }
+
+private:
+    bool finish(bool ok) {
+        int error = errno;
+        scheduler.end();
+        errno = error;
+        return ok;
+    }
+
+    Device *device;
+    IoScheduler scheduler;
+};
+
+}
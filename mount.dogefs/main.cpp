@@ -20,30 +20,131 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <deque>
+#include <fcntl.h>
 #include <fuse_lowlevel.h>
+#include <map>
+#include <mutex>
 #include <string>
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/uio.h>
 #include <unistd.h>
+#include <vector>
+#include "../common/blockpool.h"
+#include "../common/device.h"
+#include "../common/hash.h"
+#include "../common/lz4.h"
 #include "../common/types.h"
 #include "../common/spacemap.h"
+#include "blockcache.h"
+#include "dedupindex.h"
+#include "defrag.h"
+#include "dirtybuffer.h"
+#include "iosched.h"
+#include "readahead.h"
+#include "slotreserve.h"
 
 using namespace DogeFS;
 
-std::FILE *g_devFile = nullptr;
+struct MountOptions {
+    bool compress = false;      // store file blocks LZ4 compressed when it pays off
+    bool dedup = false;         // share data blocks whose contents are already stored
+    bool defrag = false;        // move fragmented files into contiguous runs in the background
+    bool mmap = false;          // map the device into memory and read from it in place
+    uint64_t defragRate = 8 << 20;  // bytes per second the defragmenter may read plus write
+    uint64_t dirtyLimit = 32 << 20; // buffered bytes past which writers write back their own data
+    unsigned ioDepth = 8;       // device operations in flight at once
+    bool fairByPid = false;     // share data bandwidth among processes rather than users
+    uint64_t gatherLimit = 4 << 20; // bytes of small writes held to be merged, 0 for none
+    // Capabilities asked of the kernel at init, so each can be benchmarked.
+    bool writebackCache = true; // let the kernel page cache buffer writes
+    bool parallelDirops = true; // allow concurrent lookups and readdirs in one directory
+    bool asyncRead = true;      // allow several reads of one file in flight
+    bool splice = false;        // move request data through pipes instead of copying it
+    uint64_t maxWrite = 1 << 20;
+    uint64_t maxReadahead = 0;  // 0 means maxReadaheadBlocks blocks
+};
+
+MountOptions g_options;
+Device *g_devFile = nullptr;
 SuperBlock *g_super = nullptr;
+AllocGroups g_groups;
+DirtyBuffer *g_dirty = nullptr;
+BlockCache *g_cache = nullptr;
+DedupIndex *g_dedup = nullptr;
+ReadaheadQueue *g_readahead = nullptr;
+SlotReserve *g_slots = nullptr;
+DefragWorker *g_defrag = nullptr;
 
-static int dogefs_stat(uint64_t ino, struct stat *statbuf) {
-    std::printf("stat(%" PRIu64 ", ...);\n", ino);
-    uint64_t realInode = ino == 1 ? g_super->ptrRootInode : ino;
-    Inode inode;
-    if(freadat(g_devFile, &inode, realInode * sizeof (Inode), sizeof (Inode)) <= 0) {
-        std::perror("Read error");
-        return -1;
+// Buffered file data is written back once one file holds this many pages,
+// or all files together hold more than the dirty_limit option allows.
+constexpr uint64_t maxDirtyPagesPerInode = 256;
+
+constexpr uint64_t blockCacheBlocks = 8192;
+constexpr unsigned readaheadThreads = 2;
+
+// Request threads libfuse keeps around when idle.
+constexpr unsigned fuseIdleThreads = 16;
+
+// Inode and directory item slots are reserved for a directory in batches of
+// up to this many.
+constexpr uint64_t maxSlotBatch = 16;
+
+// The background defragmenter walks the whole tree this often.
+constexpr std::chrono::seconds defragInterval(300);
+
+// Small writes held for merging are written back at least this often.
+constexpr std::chrono::seconds gatherInterval(5);
+
+// Requests are served by several threads.  Handlers that modify an inode
+// hold the lock its number hashes to for the whole read-modify-write.
+static std::mutex g_inodeLocks[64];
+
+static inline std::mutex &inodeLock(uint64_t ino) {
+    return g_inodeLocks[ino % (sizeof g_inodeLocks / sizeof g_inodeLocks[0])];
+}
+
+// A data block is only modified in place while its file holds the sole
+// reference.  The lock the block hashes to is held from that check until the
+// write is done, and by dedup from taking a reference until it has compared
+// the contents, so that the block cannot be shared in between.
+static std::mutex g_dataBlockLocks[64];
+
+static inline std::mutex &dataBlockLock(uint64_t block) {
+    return g_dataBlockLocks[block % (sizeof g_dataBlockLocks / sizeof g_dataBlockLocks[0])];
+}
+
+// How many times each file of a snapshot is open.  A snapshot is only
+// dropped while none of its files is, since its blocks may be handed to
+// other files as soon as it is gone.
+static std::mutex g_snapshotOpensLock;
+static std::map<uint64_t, uint64_t> g_snapshotOpens;
+
+static inline uint64_t inodeBlock(uint64_t ino) {
+    return ino * sizeof (Inode) / g_super->blockSize;
+}
+
+static bool writeSuperBlock() {
+    if(fwriteat(g_devFile, g_super, 0, sizeof (SuperBlock)) <= 0) {
+        std::perror("Write error");
+        return false;
     }
+    return true;
+}
+
+// The client a data request is accounted to by the I/O scheduler.
+static uint32_t ioClient(fuse_req_t req) {
+    const fuse_ctx *ctx = fuse_req_ctx(req);
+    return g_options.fairByPid ? ctx->pid : ctx->uid;
+}
+
+static void fillStat(uint64_t realInode, const Inode &inode, struct stat *statbuf) {
     std::memset(statbuf, 0, sizeof (struct stat));
     statbuf->st_ino = realInode;
-    statbuf->st_mode = inode.mode;
+    statbuf->st_mode = inode.mode & INODE_MODE_MASK;
     statbuf->st_nlink = inode.nlink;
     statbuf->st_uid = inode.uid;
     statbuf->st_gid = inode.gid;
@@ -57,18 +158,48 @@ static int dogefs_stat(uint64_t ino, struct stat *statbuf) {
         statbuf->st_rdev = inode.devMajor * 0x100000000 | inode.devMinor;
     } else {
         statbuf->st_size = inode.size;
-        statbuf->st_blocks = inode.size > 64 ? ceilDiv(inode.size, g_super->blockSize) * (g_super->blockSize / 512) : 0;
+        if(isFragment(&inode)) {
+            statbuf->st_blocks = ceilDiv<uint64_t>(inode.fragmentSlots * FragmentSlotSize, 512);
+        } else if(!isInline(&inode) && inode.size != 0) {
+            statbuf->st_blocks = ceilDiv(inode.size, g_super->blockSize) * (g_super->blockSize / 512);
+        }
+    }
+}
+
+static int dogefs_stat(uint64_t ino, struct stat *statbuf) {
+    std::printf("stat(%" PRIu64 ", ...);\n", ino);
+    uint64_t realInode = ino == 1 ? g_super->ptrRootInode : ino;
+    BlockBuffer buffer;
+    const Inode *inode = (const Inode *) fviewmeta(g_devFile, g_super, &buffer, realInode * sizeof (Inode), sizeof (Inode));
+    if(!inode) {
+        std::perror("Read error");
+        return -1;
     }
+    fillStat(realInode, *inode, statbuf);
     return 0;
 }
 
+// Take an inode slot near a directory, and a directory item slot in it, from
+// the directory's reservation.  The caller holds the directory's lock.
+static uint64_t reserveInode(uint64_t dir) {
+    return g_slots->take(g_slots->get(dir).inodes, [&](uint64_t count, uint64_t *taken) {
+        return allocateInodes(g_devFile, g_super, &g_groups, inodeBlock(dir), count, taken);
+    });
+}
+
+static uint64_t reserveDirItem(uint64_t dir, uint64_t ptrDirBlock) {
+    return g_slots->take(g_slots->get(dir).dirItems, [&](uint64_t count, uint64_t *taken) {
+        return allocateDirItems(g_devFile, g_super, &g_groups, ptrDirBlock, count, taken);
+    });
+}
+
 static void dogefs_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
     std::printf("lookup(..., %" PRIu64 ", \"%s\");\n", parent, name);
     if(parent == 1) {
         parent = g_super->ptrRootInode;
     }
     Inode inode;
-    if(freadat(g_devFile, &inode, parent * sizeof (Inode), sizeof (Inode)) <= 0) {
+    if(freadmeta(g_devFile, g_super, &inode, parent * sizeof (Inode), sizeof (Inode)) <= 0) {
         std::perror("Read error");
         fuse_reply_err(req, EIO);
         return;
@@ -78,11 +209,12 @@ static void dogefs_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
         return;
     }
     uint64_t dirBlock = inode.ptrDirect[0];
-    DirItem *dir = (DirItem *) new char[g_super->blockSize];
-    if(freadat(g_devFile, dir, dirBlock * g_super->blockSize, g_super->blockSize) <= 0) {
+    BlockBuffer buffer;
+    const DirItem *dir = (const DirItem *) fviewmeta(g_devFile, g_super, &buffer, dirBlock * g_super->blockSize, g_super->blockSize);
+    if(!dir) {
         std::perror("Read error");
         fuse_reply_err(req, EIO);
-        goto end;
+        return;
     }
     fuse_entry_param e;
     std::memset(&e, 0, sizeof e);
@@ -99,12 +231,10 @@ static void dogefs_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
                 e.entry_timeout = 1.0;
                 fuse_reply_entry(req, &e);
             }
-            goto end;
+            return;
         }
     }
     fuse_reply_err(req, ENOENT);
-end:
-    delete[] dir;
 }
 
 static void dogefs_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *) {
@@ -117,17 +247,202 @@ static void dogefs_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info
     }
 }
 
+// Read and decompress the block a compressed block map entry points at.
+static bool readCompressedBlock(uint64_t index, char *dst) {
+    uint64_t length = compressedLength(index);
+    BlockBuffer buffer(std::max<uint64_t>(length, g_super->blockSize));
+    char *packed = buffer.get();
+    bool ok = freaddata(g_devFile, g_super, packed, compressedAddress(index) * FragmentSlotSize, length) > 0;
+    if(ok && lz4Decompress(packed, length, dst, g_super->blockSize) != (ptrdiff_t) g_super->blockSize) {
+        std::fprintf(stderr, "Corrupted compressed block at %#" PRIx64 "\n", compressedAddress(index));
+        errno = EIO;
+        ok = false;
+    }
+    return ok;
+}
+
+// Read [begin, end) of a data block through the block cache, keyed by its
+// block map entry.  On a miss the whole block is read and cached; a whole
+// block is read or decompressed straight into dst.
+static bool readDataBlock(uint64_t index, char *dst, uint64_t begin, uint64_t end) {
+    if(g_cache->read(index, dst, begin, end)) {
+        return true;
+    }
+    bool whole = begin == 0 && end == g_super->blockSize;
+    BlockBuffer buffer(whole ? 0 : g_super->blockSize);
+    char *block = whole ? dst : buffer.get();
+    bool ok;
+    if(compressedLength(index) != 0) {
+        ok = readCompressedBlock(index, block);
+    } else {
+        ok = freaddata(g_devFile, g_super, block, index * g_super->blockSize, g_super->blockSize) > 0;
+    }
+    if(ok) {
+        g_cache->insert(index, block);
+    }
+    if(!whole) {
+        if(ok) {
+            std::memcpy(dst, block + begin, end - begin);
+        }
+    }
+    return ok;
+}
+
+// Move the inline contents of a file, or its fragment, into a buffered page
+// and switch the inode to block storage.  The slots of a fragment are given
+// back.  The caller holds the inode lock.
+static bool convertToBlocks(uint64_t ino, Inode *inode) {
+    if(isFragment(inode)) {
+        char *page = g_dirty->get(ino, 0);
+        uint64_t length = std::min(inode->size, inode->fragmentSlots * FragmentSlotSize);
+        if(freaddata(g_devFile, g_super, page, inode->ptrFragment * FragmentSlotSize, length) <= 0) {
+            std::perror("Read error");
+            g_dirty->drop(ino, 0, 1);
+            return false;
+        }
+        releaseFragment(g_devFile, g_super, &g_groups, inode->ptrFragment, inode->fragmentSlots);
+        inode->mode &= ~INODE_FRAGMENT;
+    } else if(inode->size != 0) {
+        char *page = g_dirty->get(ino, 0);
+        std::memcpy(page, inode->contents, std::min<uint64_t>(inode->size, sizeof inode->contents));
+    }
+    std::memset(inode->contents, 0, sizeof inode->contents);
+    inode->mode |= INODE_BLOCKS;
+    return true;
+}
+
+// Break the sharing of a file block before it is modified: its contents are
+// copied into a buffered page and the file's reference to the shared device
+// block is dropped.  Writeback then gives the page a block of its own.
+// Compressed blocks are modified the same way.
+static char *unshareBlock(uint64_t ino, Inode *inode, uint64_t block, uint64_t index) {
+    std::printf("\tCopy shared data block [%" PRIu64 "] at %#" PRIx64 "\n", block, index);
+    char *page = g_dirty->get(ino, block);
+    if(!readDataBlock(index, page, 0, g_super->blockSize)) {
+        std::perror("Read error");
+        g_dirty->drop(ino, block, block + 1);
+        return nullptr;
+    }
+    std::vector<uint64_t> freed;
+    if(!punchIndex(g_devFile, g_super, &g_groups, inode, block, block + 1, &freed)) {
+        g_dirty->drop(ino, block, block + 1);
+        return nullptr;
+    }
+    return page;
+}
+
+// Zero the bytes [begin, end) of a file, which must lie within one block.
+static bool zeroFileRange(uint64_t ino, Inode *inode, uint64_t begin, uint64_t end) {
+    uint64_t block = begin / g_super->blockSize;
+    char *page = g_dirty->find(ino, block);
+    uint64_t index = page ? 0 : getIndexForRead(g_devFile, g_super, inode, block);
+    std::unique_lock<std::mutex> blockLock;
+    if(index != 0 && compressedLength(index) == 0) {
+        blockLock = std::unique_lock<std::mutex>(dataBlockLock(index));
+    }
+    if(index != 0 && (compressedLength(index) != 0 || blockRefs(&g_groups, index) > 1)) {
+        page = unshareBlock(ino, inode, block, index);
+        if(!page) {
+            return false;
+        }
+    }
+    if(page) {
+        std::memset(page + begin - block * g_super->blockSize, 0, end - begin);
+        return true;
+    }
+    if(index == 0) {
+        return true;
+    }
+    bool ok = fzerodata(g_devFile, g_super, index * g_super->blockSize + begin - block * g_super->blockSize, end - begin) > 0;
+    g_cache->invalidate(index);
+    if(!ok) {
+        std::perror("Write error");
+    }
+    return ok;
+}
+
+// Drop the file blocks [begin, end), buffered or on the device.
+static bool punchFileBlocks(uint64_t ino, Inode *inode, uint64_t begin, uint64_t end) {
+    g_dirty->drop(ino, begin, end);
+    std::vector<uint64_t> freed;
+    bool ok = punchIndex(g_devFile, g_super, &g_groups, inode, begin, end, &freed);
+    for(uint64_t block : freed) {
+        g_cache->invalidate(block);
+    }
+    if(!freed.empty()) {
+        std::printf("\tFree %zu block(s) of inode #%" PRIu64 "\n", freed.size(), ino);
+    }
+    return ok;
+}
+
+// Change the size of a regular file.  Shrinking releases every block past
+// the new end of file and zeroes the tail of the last one, so that bytes
+// beyond EOF always read back as zero when the file grows again.
+static bool resizeFile(uint64_t ino, Inode *inode, uint64_t newSize) {
+    if(isInline(inode)) {
+        if(newSize <= 64) {
+            if(newSize < inode->size) {
+                std::memset(inode->contents + newSize, 0, sizeof inode->contents - newSize);
+            }
+            inode->size = newSize;
+            return true;
+        }
+        if(!convertToBlocks(ino, inode)) {
+            return false;
+        }
+    } else if(isFragment(inode)) {
+        if(newSize <= inode->fragmentSlots * FragmentSlotSize) {
+            if(newSize < inode->size && fzerodata(g_devFile, g_super, inode->ptrFragment * FragmentSlotSize + newSize, inode->size - newSize) <= 0) {
+                std::perror("Write error");
+                return false;
+            }
+            // Slots past the new end are given back; an empty file goes
+            // back to being inline.
+            uint64_t slots = newSize == 0 ? 0 : ceilDiv(newSize, FragmentSlotSize);
+            if(slots < inode->fragmentSlots) {
+                releaseFragment(g_devFile, g_super, &g_groups, inode->ptrFragment + slots, inode->fragmentSlots - slots);
+                inode->fragmentSlots = slots;
+            }
+            if(slots == 0) {
+                std::memset(inode->contents, 0, sizeof inode->contents);
+                inode->mode &= ~INODE_FRAGMENT;
+            }
+            inode->size = newSize;
+            return true;
+        }
+        if(!convertToBlocks(ino, inode)) {
+            return false;
+        }
+    }
+    bool ok = true;
+    if(newSize < inode->size) {
+        uint64_t keepBlocks = ceilDiv<uint64_t>(newSize, g_super->blockSize);
+        if(newSize % g_super->blockSize != 0) {
+            ok = zeroFileRange(ino, inode, newSize, keepBlocks * g_super->blockSize) && ok;
+        }
+        ok = punchFileBlocks(ino, inode, newSize == 0 ? 0 : keepBlocks, UINT64_MAX) && ok;
+    }
+    inode->size = newSize;
+    return ok;
+}
+
 static void dogefs_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *) {
     std::printf("setattr(..., %" PRIu64 ", %p, %#04x, ...);\n", ino, attr, to_set);
     uint64_t realInode = ino == 1 ? g_super->ptrRootInode : ino;
+    std::unique_lock<std::mutex> lock(inodeLock(realInode));
     Inode inode;
     updateTimestamp(inode.secChange, inode.nsecChange);
-    if(freadat(g_devFile, &inode, realInode * sizeof (Inode), sizeof (Inode)) <= 0) {
+    if(freadmeta(g_devFile, g_super, &inode, realInode * sizeof (Inode), sizeof (Inode)) <= 0) {
         std::perror("Read error");
         fuse_reply_err(req, EIO);
+        return;
+    }
+    if(isSnapshot(&inode)) {
+        fuse_reply_err(req, EROFS);
+        return;
     }
     if(to_set & FUSE_SET_ATTR_MODE) {
-        inode.mode = attr->st_mode;
+        inode.mode = (inode.mode & ~INODE_MODE_MASK) | (attr->st_mode & INODE_MODE_MASK);
     }
     if(to_set & FUSE_SET_ATTR_UID) {
         inode.uid = attr->st_uid;
@@ -138,7 +453,16 @@ static void dogefs_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, in
         inode.mode &= ~02000;
     }
     if(to_set & FUSE_SET_ATTR_SIZE) {
-        inode.size = attr->st_size;
+        if((inode.mode & 0170000) != 0100000) {
+            fuse_reply_err(req, EINVAL);
+            return;
+        }
+        if(!resizeFile(realInode, &inode, attr->st_size)) {
+            fwritemeta(g_devFile, g_super, &inode, realInode * sizeof (Inode), sizeof (Inode));
+            fuse_reply_err(req, EIO);
+            return;
+        }
+        updateTimestamp(inode.secModify, inode.nsecModify);
     }
     if(to_set & FUSE_SET_ATTR_MTIME) {
         inode.secModify = attr->st_atim.tv_sec;
@@ -147,10 +471,12 @@ static void dogefs_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, in
     if(to_set & FUSE_SET_ATTR_MTIME_NOW) {
         updateTimestamp(inode.secModify, inode.nsecModify);
     }
-    if(fwriteat(g_devFile, &inode, realInode * sizeof (Inode), sizeof (Inode)) <= 0) {
+    if(fwritemeta(g_devFile, g_super, &inode, realInode * sizeof (Inode), sizeof (Inode)) <= 0) {
         std::perror("Write error");
         fuse_reply_err(req, EIO);
+        return;
     }
+    lock.unlock();
     struct stat stbuf;
     if(dogefs_stat(ino, &stbuf) < 0) {
         fuse_reply_err(req, EIO);
@@ -165,7 +491,7 @@ static void dogefs_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t of
         ino = g_super->ptrRootInode;
     }
     Inode inode;
-    if(freadat(g_devFile, &inode, ino * sizeof (Inode), sizeof (Inode)) <= 0) {
+    if(freadmeta(g_devFile, g_super, &inode, ino * sizeof (Inode), sizeof (Inode)) <= 0) {
         std::perror("Read error");
         fuse_reply_err(req, EIO);
         return;
@@ -176,11 +502,12 @@ static void dogefs_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t of
     }
     uint64_t dirBlock = inode.ptrDirect[0];
     std::string result;
-    DirItem *dir = (DirItem *) new char[g_super->blockSize];
-    if(freadat(g_devFile, dir, dirBlock * g_super->blockSize, g_super->blockSize) <= 0) {
+    BlockBuffer buffer;
+    const DirItem *dir = (const DirItem *) fviewmeta(g_devFile, g_super, &buffer, dirBlock * g_super->blockSize, g_super->blockSize);
+    if(!dir) {
         std::perror("Read error");
         fuse_reply_err(req, EIO);
-        goto end;
+        return;
     }
     for(size_t i = 0; i < g_super->blockSize / sizeof (DirItem); ++i) {
         if(dir[i].magic != DirItemMagic) {
@@ -189,59 +516,57 @@ static void dogefs_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t of
         struct stat stbuf;
         if(dogefs_stat(dir[i].inode, &stbuf) < 0) {
             fuse_reply_err(req, EIO);
-            goto end;
+            return;
         }
         std::string filename = std::string(dir[i].filename, 32);
         size_t entrySize = fuse_add_direntry(req, nullptr, 0, filename.c_str(), nullptr, 0);
-        char *buf = new char[entrySize];
-        fuse_add_direntry(req, buf, 1024, filename.c_str(), &stbuf, result.length() + entrySize);
-        result.append(buf, entrySize);
-        delete[] buf;
+        size_t entryOffset = result.length();
+        result.resize(entryOffset + entrySize);
+        fuse_add_direntry(req, &result[entryOffset], entrySize, filename.c_str(), &stbuf, entryOffset + entrySize);
     }
     if(off >= result.length()) {
         fuse_reply_buf(req, nullptr, 0);
     } else {
         fuse_reply_buf(req, result.data() + off, std::min(result.length(), size));
     }
-end:
-    delete[] dir;
 }
 
-static void dogefs_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode) {
-    std::printf("mkdir(..., %" PRIu64 ", \"%s\", %" PRIu32 ");\n", parent, name, mode);
-    if(parent == 1) {
-        parent = g_super->ptrRootInode;
-    }
+// Snapshots are taken and dropped by mkdir and rmdir in /.snapshots.
+static int takeSnapshot(const char *name, uint64_t *ino, Inode *result);
+static int dropSnapshot(const char *name);
+
+// Make the directory name in parent.  The caller holds the parent's lock.
+// Returns an errno value, and the new directory in *ino and *result.
+static int makeDirectory(uint64_t parent, const char *name, mode_t mode, uint64_t *ino, Inode *result) {
     Inode inode;
-    if(freadat(g_devFile, &inode, parent * sizeof (Inode), sizeof (Inode)) <= 0) {
+    if(freadmeta(g_devFile, g_super, &inode, parent * sizeof (Inode), sizeof (Inode)) <= 0) {
         std::perror("Read error");
-        fuse_reply_err(req, EIO);
-        return;
+        return EIO;
     }
     if((inode.mode & 0170000) != 0040000) {
-        fuse_reply_err(req, ENOTDIR);
-        return;
+        return ENOTDIR;
+    }
+    if(isSnapshot(&inode)) {
+        return EROFS;
     }
     updateTimestamp(inode.secModify, inode.nsecModify);
     uint64_t ptrDirBlock = inode.ptrDirect[0];
 
-    uint64_t ptrSubdirInode = allocateInode(g_devFile, g_super);
+    uint64_t ptrSubdirInode = reserveInode(parent);
     if(ptrSubdirInode == 0) {
         std::fprintf(stderr, "Cannot allocate inode\n");
-        fuse_reply_err(req, ENOSPC);
-        return;
+        return ENOSPC;
     }
     std::printf("\tAllocate inode #%" PRIu64"\n", ptrSubdirInode);
-    uint64_t ptrSubdirBlock = allocateBlock(g_devFile, g_super, BLK_DIR);
+    uint64_t ptrSubdirBlock = allocateBlock(g_devFile, g_super, &g_groups, BLK_DIR, inodeBlock(ptrSubdirInode));
     if(ptrSubdirBlock == 0) {
         std::fprintf(stderr, "Cannot allocate directory\n");
-        fuse_reply_err(req, ENOSPC);
-        return;
+        return ENOSPC;
     }
     std::printf("\tAllocate directory %#" PRIx64"\n", ptrSubdirBlock);
 
-    DirItem *subdir = (DirItem *) new char[g_super->blockSize];
-    std::memset(subdir, 0, g_super->blockSize);
+    BlockBuffer buffer(g_super->blockSize, true);
+    DirItem *subdir = buffer.as<DirItem>();
     subdir[0].magic = DirItemMagic;
     subdir[0].filename[0] = '.';
     subdir[0].inode = ptrSubdirInode;
@@ -252,7 +577,7 @@ static void dogefs_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mo
     subdir[1].inode = parent;
     subdir[1].nextChunk = 0;
 
-    Inode subdirInode;
+    Inode &subdirInode = *result;
     std::memset(&subdirInode, 0, sizeof (Inode));
     subdirInode.mode = 0040000 | (mode & 0007777);
     subdirInode.nlink = 2;
@@ -262,30 +587,24 @@ static void dogefs_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mo
     updateTimestamp(subdirInode.secChange, subdirInode.nsecChange);
     subdirInode.ptrDirect[0] = ptrSubdirBlock;
 
-    if(fwriteat(g_devFile, subdir, ptrSubdirBlock * g_super->blockSize, g_super->blockSize) <= 0) {
+    if(fwritemeta(g_devFile, g_super, subdir, ptrSubdirBlock * g_super->blockSize, g_super->blockSize) <= 0) {
         std::perror("Write error");
-        fuse_reply_err(req, EIO);
-        delete[] subdir;
-        return;
+        return EIO;
     }
-    delete[] subdir;
-    if(fwriteat(g_devFile, &subdirInode, ptrSubdirInode * sizeof (Inode), sizeof (Inode)) <= 0) {
+    if(fwritemeta(g_devFile, g_super, &subdirInode, ptrSubdirInode * sizeof (Inode), sizeof (Inode)) <= 0) {
         std::perror("Write error");
-        fuse_reply_err(req, EIO);
-        return;
+        return EIO;
     }
     inode.nlink += 1;
-    if(fwriteat(g_devFile, &inode, parent * sizeof (Inode), sizeof (Inode)) <= 0) {
+    if(fwritemeta(g_devFile, g_super, &inode, parent * sizeof (Inode), sizeof (Inode)) <= 0) {
         std::perror("Write error");
-        fuse_reply_err(req, EIO);
-        return;
+        return EIO;
     }
 
-    uint64_t ptrDirItem = allocateDirItem(g_devFile, g_super, ptrDirBlock);
+    uint64_t ptrDirItem = reserveDirItem(parent, ptrDirBlock);
     if(ptrDirItem == 0) {
         std::fprintf(stderr, "Cannot allocate directory item from block %#" PRIx64 "\n", ptrDirBlock);
-        fuse_reply_err(req, ENOSPC);
-        return;
+        return ENOSPC;
     }
     std::printf("\tAllocate directory item at %#" PRIx64"\n", ptrDirItem);
     DirItem dirItem;
@@ -293,19 +612,36 @@ static void dogefs_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mo
     std::strncpy(dirItem.filename, name, 32);
     dirItem.inode = ptrSubdirInode;
     dirItem.nextChunk = 0;
-    if(fwriteat(g_devFile, &dirItem, ptrDirItem * sizeof (DirItem), sizeof (DirItem)) <= 0) {
+    if(fwritemeta(g_devFile, g_super, &dirItem, ptrDirItem * sizeof (DirItem), sizeof (DirItem)) <= 0) {
         std::perror("Write error");
-        fuse_reply_err(req, EIO);
-        return;
+        return EIO;
     }
+    *ino = ptrSubdirInode;
+    return 0;
+}
 
+static void dogefs_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode) {
+    std::printf("mkdir(..., %" PRIu64 ", \"%s\", %" PRIu32 ");\n", parent, name, mode);
+    if(parent == 1) {
+        parent = g_super->ptrRootInode;
+    }
     fuse_entry_param e;
     std::memset(&e, 0, sizeof e);
-    e.ino = ptrSubdirInode;
-    if(dogefs_stat(ptrSubdirInode, &e.attr) < 0) {
-        fuse_reply_err(req, EIO);
+    uint64_t ino;
+    Inode inode;
+    int err;
+    if(parent == g_super->ptrSnapshotDir) {
+        err = takeSnapshot(name, &ino, &inode);
+    } else {
+        std::lock_guard<std::mutex> lock(inodeLock(parent));
+        err = makeDirectory(parent, name, mode, &ino, &inode);
+    }
+    if(err != 0) {
+        fuse_reply_err(req, err);
         return;
     }
+    e.ino = ino;
+    fillStat(ino, inode, &e.attr);
     e.attr_timeout = 1.0;
     e.entry_timeout = 1.0;
     fuse_reply_entry(req, &e);
@@ -316,8 +652,13 @@ static void dogefs_unlink(fuse_req_t req, fuse_ino_t parent, const char *name) {
     if(parent == 1) {
         parent = g_super->ptrRootInode;
     }
+    if(parent == g_super->ptrSnapshotDir) {
+        fuse_reply_err(req, dropSnapshot(name));
+        return;
+    }
+    std::lock_guard<std::mutex> lock(inodeLock(parent));
     Inode inode;
-    if(freadat(g_devFile, &inode, parent * sizeof (Inode), sizeof (Inode)) <= 0) {
+    if(freadmeta(g_devFile, g_super, &inode, parent * sizeof (Inode), sizeof (Inode)) <= 0) {
         std::perror("Read error");
         fuse_reply_err(req, EIO);
         return;
@@ -326,13 +667,18 @@ static void dogefs_unlink(fuse_req_t req, fuse_ino_t parent, const char *name) {
         fuse_reply_err(req, ENOTDIR);
         return;
     }
+    if(isSnapshot(&inode)) {
+        fuse_reply_err(req, EROFS);
+        return;
+    }
     updateTimestamp(inode.secModify, inode.nsecModify);
     uint64_t dirBlock = inode.ptrDirect[0];
-    DirItem *dir = (DirItem *) new char[g_super->blockSize];
-    if(freadat(g_devFile, dir, dirBlock * g_super->blockSize, g_super->blockSize) <= 0) {
+    BlockBuffer buffer(g_super->blockSize);
+    DirItem *dir = buffer.as<DirItem>();
+    if(freadmeta(g_devFile, g_super, dir, dirBlock * g_super->blockSize, g_super->blockSize) <= 0) {
         std::perror("Read error");
         fuse_reply_err(req, EIO);
-        goto end;
+        return;
     }
     fuse_entry_param e;
     std::memset(&e, 0, sizeof e);
@@ -341,195 +687,1759 @@ static void dogefs_unlink(fuse_req_t req, fuse_ino_t parent, const char *name) {
             continue;
         }
         if(strncmp(dir[i].filename, name, 32) == 0) {
+            if(dir[i].inode == g_super->ptrSnapshotDir) {
+                fuse_reply_err(req, EBUSY);
+                return;
+            }
             Inode subInode;
-            if(freadat(g_devFile, &subInode, dir[i].inode * sizeof (Inode), sizeof (Inode)) <= 0) {
+            if(freadmeta(g_devFile, g_super, &subInode, dir[i].inode * sizeof (Inode), sizeof (Inode)) <= 0) {
                 std::perror("Read error");
                 fuse_reply_err(req, EIO);
-                goto end;
+                return;
             }
-            if((inode.mode & 0170000) == 0040000) {
+            if((subInode.mode & 0170000) == 0040000) {
                 inode.nlink -= 1;
             }
             dir[i].magic = 0;
         }
     }
-    if(fwriteat(g_devFile, dir, dirBlock * g_super->blockSize, g_super->blockSize) <= 0) {
+    if(fwritemeta(g_devFile, g_super, dir, dirBlock * g_super->blockSize, g_super->blockSize) <= 0) {
         std::perror("Write error");
         fuse_reply_err(req, EIO);
-        goto end;
+        return;
     }
-    if(fwriteat(g_devFile, &inode, parent * sizeof (Inode), sizeof (Inode)) <= 0) {
+    if(fwritemeta(g_devFile, g_super, &inode, parent * sizeof (Inode), sizeof (Inode)) <= 0) {
         std::perror("Write error");
         fuse_reply_err(req, EIO);
-        goto end;
+        return;
     }
     fuse_reply_err(req, 0);
-end:
-    delete[] dir;
 }
 
 static void dogefs_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
     std::printf("open(..., %" PRIu64 ", ...);\n", ino);
-    fuse_reply_open(req, fi);
-}
-
-static void dogefs_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *) {
-    std::printf("read(..., %" PRIu64 ", %" PRIu64 ", %" PRIu64 ", ...);\n", ino, size, off);
     if(ino == 1) {
         ino = g_super->ptrRootInode;
     }
     Inode inode;
-    if(freadat(g_devFile, &inode, ino * sizeof (Inode), sizeof (Inode)) <= 0) {
+    if(freadmeta(g_devFile, g_super, &inode, ino * sizeof (Inode), sizeof (Inode)) <= 0) {
         std::perror("Read error");
         fuse_reply_err(req, EIO);
         return;
     }
-    if(off >= inode.size) {
-        fuse_reply_buf(req, nullptr, 0);
-    } else if(off + size >= inode.size) {
-        size = inode.size - off;
-    }
-    if(inode.size <= 64) {
-        fuse_reply_buf(req, inode.contents + off, size);
-    } else {
-        uint64_t beginBlock = off / g_super->blockSize;
-        uint64_t endBlock = ceilDiv(off + size, g_super->blockSize);
-        std::printf("\tRead task starts: block [%" PRIu64 " .. %" PRIu64 "]\n", beginBlock, endBlock);
-        char *buf = new char[size];
-        uint64_t bytesRead = 0;
-        for(uint64_t i = beginBlock; i < endBlock; ++i) {
-            uint64_t beginByte = std::max<uint64_t>(off, i * g_super->blockSize);
-            uint64_t endByte = std::min<uint64_t>(off + size, (i + 1) * g_super->blockSize);
-            uint64_t index = getIndexForRead(g_devFile, g_super, &inode, i);
-            if(index != 0) {
-                std::printf("\tRead data block [%#" PRIx64" .. %#" PRIx64 "], %" PRIu64 " bytes\n", beginByte, endByte, endByte - beginByte);
-                if(freadat(g_devFile, buf + bytesRead, index * g_super->blockSize + beginByte - i * g_super->blockSize, endByte - beginByte) <= 0) {
-                    std::perror("Read error");
-                    delete[] buf;
-                    fuse_reply_err(req, EIO);
-                    return;
-                }
-            } else {
-                std::printf("\tZero data block [%#" PRIx64" .. %#" PRIx64 "], %" PRIu64 " bytes\n", beginByte, endByte, endByte - beginByte);
-                std::memset(buf + bytesRead, 0, endByte - beginByte);
-            }
-            bytesRead += endByte - beginByte;
+    if(isSnapshot(&inode)) {
+        if((fi->flags & O_ACCMODE) != O_RDONLY) {
+            fuse_reply_err(req, EROFS);
+            return;
+        }
+        // Check again under the lock, as the snapshot may have been dropped
+        // since.
+        std::lock_guard<std::mutex> lock(g_snapshotOpensLock);
+        if(freadmeta(g_devFile, g_super, &inode, ino * sizeof (Inode), sizeof (Inode)) <= 0) {
+            std::perror("Read error");
+            fuse_reply_err(req, EIO);
+            return;
+        }
+        if(!isSnapshot(&inode)) {
+            fuse_reply_err(req, ENOENT);
+            return;
         }
-        fuse_reply_buf(req, buf, size);
+        g_snapshotOpens[ino] += 1;
     }
+    fi->fh = (uint64_t) new ReadaheadState;
+    fuse_reply_open(req, fi);
 }
 
-static void dogefs_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t off, struct fuse_file_info *) {
-    std::printf("write(..., %" PRIu64 ", %p, %" PRIu64 ", %" PRIu64 ", ...);\n", ino, buf, size, off);
-    if(ino == 1) {
-        ino = g_super->ptrRootInode;
-    }
+// Prefetch the file blocks [begin, end) into the block cache, reading each
+// physically contiguous run with a single request.
+static void readaheadFile(uint64_t ino, uint64_t begin, uint64_t end) {
+    IoTagScope tag(IoClass::Background);
+    std::lock_guard<std::mutex> lock(inodeLock(ino));
     Inode inode;
-    if(freadat(g_devFile, &inode, ino * sizeof (Inode), sizeof (Inode)) <= 0) {
-        std::perror("Read error");
-        fuse_reply_err(req, EIO);
+    if(freadmeta(g_devFile, g_super, &inode, ino * sizeof (Inode), sizeof (Inode)) <= 0 || isInline(&inode) || isFragment(&inode)) {
         return;
     }
-    updateTimestamp(inode.secModify, inode.nsecModify);
-    uint64_t oldSize = inode.size;
-    if(off + size > inode.size) {
-        inode.size = off + size;
-        size = inode.size - off;
+    end = std::min<uint64_t>(end, ceilDiv(inode.size, g_super->blockSize));
+    // The index block is read once for the whole pass.
+    std::vector<uint64_t> indexes;
+    if(begin >= end || !readIndex(g_devFile, g_super, &inode, end, &indexes)) {
+        return;
     }
-    if(oldSize <= 64 && inode.size > 64) {
-        uint64_t ptrDataBlock = allocateBlock(g_devFile, g_super, BLK_FILE);
-        if(ptrDataBlock == 0) {
-            fuse_reply_err(req, ENOSPC);
-            return;
+    BlockBuffer buffer(maxReadaheadBlocks * g_super->blockSize);
+    char *buf = buffer.get();
+    for(uint64_t i = begin; i < end;) {
+        uint64_t index = g_dirty->find(ino, i) ? 0 : indexes[i];
+        if(index == 0 || g_cache->contains(index)) {
+            ++i;
+            continue;
         }
-        if(fwriteat(g_devFile, inode.contents, ptrDataBlock * g_super->blockSize, oldSize) <= 0) {
-            std::perror("Write error");
-            fuse_reply_err(req, EIO);
-            return;
+        if(compressedLength(index) != 0) {
+            if(readCompressedBlock(index, buf)) {
+                g_cache->insert(index, buf);
+            }
+            ++i;
+            continue;
+        }
+        uint64_t count = 1;
+        while(i + count < end && count < maxReadaheadBlocks && !g_dirty->find(ino, i + count) && indexes[i + count] == index + count && !g_cache->contains(index + count)) {
+            ++count;
+        }
+        if(g_options.mmap) {
+            // The mapping is the cache; only start paging the run in.
+            g_devFile->advise(index * g_super->blockSize, count * g_super->blockSize, MADV_WILLNEED);
+            i += count;
+            continue;
+        }
+        std::printf("\tReadahead data blocks [%" PRIu64 " .. %" PRIu64 "] of inode #%" PRIu64 "\n", i, i + count, ino);
+        if(freadat(g_devFile, buf, index * g_super->blockSize, count * g_super->blockSize) <= 0) {
+            break;
+        }
+        if(dataChecksums(g_super) && !verifyChecksums(g_devFile, g_super, index, count, buf)) {
+            break;
         }
-        inode.ptrDirect[0] = ptrDataBlock;
+        for(uint64_t j = 0; j < count; ++j) {
+            g_cache->insert(index + j, buf + j * g_super->blockSize);
+        }
+        i += count;
     }
-    if(inode.size <= 64) {
-        std::memcpy(inode.contents + off, buf, size);
-    } else {
-        uint64_t beginBlock = off / g_super->blockSize;
-        uint64_t endBlock = ceilDiv(off + size, g_super->blockSize);
-        std::printf("\tWrite task starts: Block [%" PRIu64 " .. %" PRIu64 "]\n", beginBlock, endBlock);
-        uint64_t bytesWritten = 0;
-        for(uint64_t i = beginBlock; i < endBlock; ++i) {
-            uint64_t index = getIndexForWrite(g_devFile, g_super, &inode, i);
+}
+
+// Read [off, off + size) of a block-mapped or fragment file, which the
+// caller has clamped to the file size.  The caller holds the inode lock.
+static int readFile(uint64_t ino, Inode *inode, char *buf, uint64_t size, uint64_t off) {
+    if(isFragment(inode)) {
+        std::printf("\tRead fragment %#" PRIx64 ", %" PRIu64 " bytes\n", inode->ptrFragment, size);
+        if(freaddata(g_devFile, g_super, buf, inode->ptrFragment * FragmentSlotSize + off, size) <= 0) {
+            std::perror("Read error");
+            return EIO;
+        }
+        return 0;
+    }
+    uint64_t beginBlock = off / g_super->blockSize;
+    uint64_t endBlock = ceilDiv(off + size, g_super->blockSize);
+    std::printf("\tRead task starts: block [%" PRIu64 " .. %" PRIu64 "]\n", beginBlock, endBlock);
+    uint64_t bytesRead = 0;
+    for(uint64_t i = beginBlock; i < endBlock; ++i) {
+        uint64_t beginByte = std::max<uint64_t>(off, i * g_super->blockSize);
+        uint64_t endByte = std::min<uint64_t>(off + size, (i + 1) * g_super->blockSize);
+        const char *page = g_dirty->find(ino, i);
+        uint64_t index = page ? 0 : getIndexForRead(g_devFile, g_super, inode, i);
+        if(page) {
+            std::printf("\tRead buffered block [%#" PRIx64" .. %#" PRIx64 "], %" PRIu64 " bytes\n", beginByte, endByte, endByte - beginByte);
+            std::memcpy(buf + bytesRead, page + beginByte - i * g_super->blockSize, endByte - beginByte);
+        } else if(index != 0) {
+            std::printf("\tRead data block [%#" PRIx64" .. %#" PRIx64 "], %" PRIu64 " bytes\n", beginByte, endByte, endByte - beginByte);
+            if(!readDataBlock(index, buf + bytesRead, beginByte - i * g_super->blockSize, endByte - i * g_super->blockSize)) {
+                std::perror("Read error");
+                return EIO;
+            }
+        } else {
+            std::printf("\tZero data block [%#" PRIx64" .. %#" PRIx64 "], %" PRIu64 " bytes\n", beginByte, endByte, endByte - beginByte);
+            std::memset(buf + bytesRead, 0, endByte - beginByte);
+        }
+        bytesRead += endByte - beginByte;
+    }
+    return 0;
+}
+
+// Gather [off, off + size) of a block-mapped or fragment file as pieces of
+// the device mapping, buffered pages and zeros, so that the reply needs no
+// bounce buffer.  Returns false when some block cannot be lent, such as a
+// compressed one, and readFile() has to copy instead.  The caller holds the
+// inode lock until it has replied.
+static bool lendFile(uint64_t ino, Inode *inode, uint64_t size, uint64_t off, std::vector<struct iovec> *iov) {
+    if(isFragment(inode)) {
+        const char *data = fviewdata(g_devFile, g_super, nullptr, inode->ptrFragment * FragmentSlotSize + off, size);
+        if(!data) {
+            return false;
+        }
+        iov->push_back(iovec { (void *) data, size });
+        return true;
+    }
+    static const std::vector<char> zero(g_super->blockSize);
+    uint64_t beginBlock = off / g_super->blockSize;
+    uint64_t endBlock = ceilDiv(off + size, g_super->blockSize);
+    std::vector<uint64_t> indexes;
+    if(!readIndex(g_devFile, g_super, inode, endBlock, &indexes)) {
+        return false;
+    }
+    for(uint64_t i = beginBlock; i < endBlock; ++i) {
+        uint64_t beginByte = std::max<uint64_t>(off, i * g_super->blockSize);
+        uint64_t endByte = std::min<uint64_t>(off + size, (i + 1) * g_super->blockSize);
+        const char *page = g_dirty->find(ino, i);
+        if(!page) {
+            uint64_t index = indexes[i];
             if(index == 0) {
-                fuse_reply_err(req, ENOSPC);
-                return;
+                page = zero.data();
+            } else if(compressedLength(index) == 0) {
+                page = fviewdata(g_devFile, g_super, nullptr, index * g_super->blockSize, g_super->blockSize);
             }
-            uint64_t beginByte = std::max<uint64_t>(off, i * g_super->blockSize);
-            uint64_t endByte = std::min<uint64_t>(off + size, (i + 1) * g_super->blockSize);
-            std::printf("\tWriting data block [%#" PRIx64" .. %#" PRIx64 "], %" PRIu64 " bytes\n", beginByte, endByte, endByte - beginByte);
-            if(fwriteat(g_devFile, buf + bytesWritten, index * g_super->blockSize + beginByte - i * g_super->blockSize, endByte - beginByte) <= 0) {
-                std::perror("Write error");
-                fuse_reply_err(req, EIO);
-                return;
+            if(!page) {
+                return false;
             }
-            bytesWritten += endByte - beginByte;
+        }
+        char *data = (char *) page + beginByte - i * g_super->blockSize;
+        if(!iov->empty() && (char *) iov->back().iov_base + iov->back().iov_len == data) {
+            iov->back().iov_len += endByte - beginByte;
+        } else {
+            iov->push_back(iovec { data, endByte - beginByte });
         }
     }
-    if(fwriteat(g_devFile, &inode, ino * sizeof (Inode), sizeof (Inode)) <= 0) {
-        std::perror("Write error");
-        fuse_reply_err(req, EIO);
-        return;
-    }
-    fuse_reply_write(req, size);
+    return true;
 }
 
-static void dogefs_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, struct fuse_file_info *fi) {
-    std::printf("create(..., %" PRIu64 ", \"%s\", %" PRIu32 ", ...);\n", parent, name, mode);
-    if(parent == 1) {
-        parent = g_super->ptrRootInode;
+static void dogefs_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) {
+    std::printf("read(..., %" PRIu64 ", %" PRIu64 ", %" PRIu64 ", ...);\n", ino, size, off);
+    IoTagScope tag(IoClass::Data, ioClient(req));
+    if(ino == 1) {
+        ino = g_super->ptrRootInode;
     }
+    std::lock_guard<std::mutex> lock(inodeLock(ino));
     Inode inode;
-    if(freadat(g_devFile, &inode, parent * sizeof (Inode), sizeof (Inode)) <= 0) {
+    if(freadmeta(g_devFile, g_super, &inode, ino * sizeof (Inode), sizeof (Inode)) <= 0) {
         std::perror("Read error");
         fuse_reply_err(req, EIO);
         return;
     }
-    if((inode.mode & 0170000) != 0040000) {
-        fuse_reply_err(req, ENOTDIR);
-        return;
-    }
-    updateTimestamp(inode.secModify, inode.nsecModify);
-    uint64_t ptrDirBlock = inode.ptrDirect[0];
-
-    uint64_t ptrFileInode = allocateInode(g_devFile, g_super);
-    if(ptrFileInode == 0) {
-        std::fprintf(stderr, "Cannot allocate inode\n");
-        fuse_reply_err(req, ENOSPC);
+    if((uint64_t) off >= inode.size) {
+        fuse_reply_buf(req, nullptr, 0);
         return;
+    } else if(off + size >= inode.size) {
+        size = inode.size - off;
     }
-    std::printf("\tAllocate inode #%" PRIu64"\n", ptrFileInode);
-    Inode fileInode;
-    std::memset(&fileInode, 0, sizeof (Inode));
-    fileInode.mode = 0100000 | (mode & 0007777);
-    fileInode.nlink = 1;
-    fileInode.size = 0;
-    updateTimestamp(fileInode.secCreate, fileInode.nsecCreate);
-    updateTimestamp(fileInode.secModify, fileInode.nsecModify);
-    updateTimestamp(fileInode.secChange, fileInode.nsecChange);
-
-    if(fwriteat(g_devFile, &fileInode, ptrFileInode * sizeof (Inode), sizeof (Inode)) <= 0) {
-        std::perror("Write error");
-        fuse_reply_err(req, EIO);
-        return;
+    std::vector<struct iovec> iov;
+    if(isInline(&inode)) {
+        fuse_reply_buf(req, inode.contents + off, size);
+    } else if(g_options.mmap && lendFile(ino, &inode, size, off, &iov)) {
+        fuse_reply_iov(req, iov.data(), (int) iov.size());
+    } else {
+        BlockBuffer buf(size);
+        int err = readFile(ino, &inode, buf.get(), size, off);
+        if(err != 0) {
+            fuse_reply_err(req, err);
+        } else {
+            fuse_reply_buf(req, buf.get(), size);
+        }
+        if(err != 0) {
+            return;
+        }
     }
-    inode.nlink += 1;
-    if(fwriteat(g_devFile, &inode, parent * sizeof (Inode), sizeof (Inode)) <= 0) {
-        std::perror("Write error");
-        fuse_reply_err(req, EIO);
-        return;
+    ReadaheadState *ra = fi ? (ReadaheadState *) fi->fh : nullptr;
+    if(ra) {
+        uint64_t raBegin, raEnd;
+        ra->update(off, size, g_super->blockSize, &raBegin, &raEnd);
+        if(raBegin < raEnd) {
+            g_readahead->push([ino, raBegin, raEnd] { readaheadFile(ino, raBegin, raEnd); });
+        }
     }
+}
 
-    uint64_t ptrDirItem = allocateDirItem(g_devFile, g_super, ptrDirBlock);
-    if(ptrDirItem == 0) {
-        std::fprintf(stderr, "Cannot allocate directory item from block %#" PRIx64 "\n", ptrDirBlock);
+// Point every page whose contents are already stored in a device block at
+// that block, and take it out of pages.  The fingerprints of the other pages
+// are left in *hashes, to be recorded once they have been written.
+static bool dedupPages(uint64_t ino, Inode *inode, DirtyBuffer::Pages *pages, std::map<uint64_t, uint64_t> *hashes) {
+    BlockBuffer buffer(g_super->blockSize);
+    char *stored = buffer.get();
+    bool ok = true;
+    for(auto it = pages->begin(); it != pages->end();) {
+        uint64_t hash = xxh64(it->second.get(), g_super->blockSize);
+        uint64_t candidate = g_dedup->find(hash);
+        if(candidate == 0) {
+            (*hashes)[it->first] = hash;
+            ++it;
+            continue;
+        }
+        // The reference is taken before comparing, and under the block's
+        // lock, so that the candidate cannot be rewritten in place in the
+        // meantime.  Once it is shared, writers copy it instead.
+        std::unique_lock<std::mutex> blockLock(dataBlockLock(candidate));
+        if(shareBlocks(g_devFile, g_super, &g_groups, candidate, 1) != 1) {
+            (*hashes)[it->first] = hash;
+            ++it;
+            continue;
+        }
+        if(!readDataBlock(candidate, stored, 0, g_super->blockSize) || std::memcmp(stored, it->second.get(), g_super->blockSize) != 0) {
+            releaseBlocks(g_devFile, g_super, &g_groups, std::vector<uint64_t> { candidate });
+            (*hashes)[it->first] = hash;
+            ++it;
+            continue;
+        }
+        blockLock.unlock();
+        std::printf("\tDedup data block [%" PRIu64 "] of inode #%" PRIu64 " to %#" PRIx64 "\n", it->first, ino, candidate);
+        if(!setIndexRun(g_devFile, g_super, &g_groups, inode, it->first, candidate, 1)) {
+            releaseBlocks(g_devFile, g_super, &g_groups, std::vector<uint64_t> { candidate });
+            ok = false;
+            break;
+        }
+        g_dedup->sharedBlocks += 1;
+        it = pages->erase(it);
+    }
+    return ok;
+}
+
+// Store every page that compresses to half a block or less in fragment
+// slots, and take it out of pages.  The rest is left to be written raw.
+static bool compressPages(uint64_t ino, Inode *inode, DirtyBuffer::Pages *pages) {
+    uint64_t capacity = std::min<uint64_t>(g_super->blockSize / 2, UINT16_MAX);
+    BlockBuffer buffer(g_super->blockSize);
+    char *packed = buffer.get();
+    bool ok = true;
+    for(auto it = pages->begin(); it != pages->end();) {
+        uint64_t length = lz4Compress(it->second.get(), g_super->blockSize, packed, capacity);
+        uint64_t slots = ceilDiv(length, FragmentSlotSize);
+        uint64_t ptrFragment = length != 0 ? allocateFragment(g_devFile, g_super, &g_groups, slots, inodeBlock(ino)) : 0;
+        if(ptrFragment == 0) {
+            ++it;
+            continue;
+        }
+        uint64_t index = ptrFragment | length << PtrLengthShift;
+        std::printf("\tCompress data block [%" PRIu64 "] into %" PRIu64 " bytes at %#" PRIx64 "\n", it->first, length, ptrFragment);
+        g_cache->invalidate(index);
+        if(fwritedata(g_devFile, g_super, packed, ptrFragment * FragmentSlotSize, length) <= 0) {
+            std::perror("Write error");
+            ok = false;
+        } else if(!setIndexRun(g_devFile, g_super, &g_groups, inode, it->first, index, 1)) {
+            ok = false;
+        }
+        if(!ok) {
+            releaseFragment(g_devFile, g_super, &g_groups, ptrFragment, slots);
+            break;
+        }
+        it = pages->erase(it);
+    }
+    return ok;
+}
+
+// Write back pages detached from the buffer for an inode.  Consecutive file
+// blocks are given contiguous device blocks and written with one request per
+// run.  Each page is taken out of *pages once the file points at its data.
+static bool writePages(uint64_t ino, Inode *inode, DirtyBuffer::Pages *pages) {
+    if(pages->size() == 1 && pages->begin()->first == 0 && inode->size != 0 && inode->size <= g_super->blockSize / 2 && seekIndex(g_devFile, g_super, inode, 0, true) == 4 + g_super->blockSize / sizeof (uint64_t)) {
+        // A file that fits in half a block and has nothing else mapped is
+        // packed into fragment slots instead of getting a block of its own.
+        uint64_t slots = ceilDiv(inode->size, FragmentSlotSize);
+        uint64_t ptrFragment = allocateFragment(g_devFile, g_super, &g_groups, slots, inodeBlock(ino));
+        if(ptrFragment != 0) {
+            std::printf("\tPack inode #%" PRIu64 " into %" PRIu64 " fragment slot(s) at %#" PRIx64 "\n", ino, slots, ptrFragment);
+            if(fwritedata(g_devFile, g_super, pages->begin()->second.get(), ptrFragment * FragmentSlotSize, slots * FragmentSlotSize) <= 0) {
+                std::perror("Write error");
+                releaseFragment(g_devFile, g_super, &g_groups, ptrFragment, slots);
+                return false;
+            }
+            std::memset(inode->contents, 0, sizeof inode->contents);
+            inode->mode = (inode->mode & ~INODE_BLOCKS) | INODE_FRAGMENT;
+            inode->ptrFragment = ptrFragment;
+            inode->fragmentSlots = slots;
+            pages->clear();
+            return true;
+        }
+    }
+    std::printf("\tFlush %zu buffered block(s) of inode #%" PRIu64 "\n", pages->size(), ino);
+    std::map<uint64_t, uint64_t> hashes;
+    if(g_options.dedup && !dedupPages(ino, inode, pages, &hashes)) {
+        return false;
+    }
+    if(g_options.compress && !compressPages(ino, inode, pages)) {
+        return false;
+    }
+    BlockBuffer buffer;
+    uint64_t bufferBlocks = 0;
+    auto it = pages->begin();
+    while(it != pages->end()) {
+        uint64_t block = it->first;
+        uint64_t count = 1;
+        for(auto next = std::next(it); next != pages->end() && next->first == block + count; ++next) {
+            ++count;
+        }
+        uint64_t goal = block != 0 ? getIndexForRead(g_devFile, g_super, inode, block - 1) : 0;
+        goal = goal != 0 ? ptrDeviceBlock(g_super, goal) + 1 : inodeBlock(ino);
+        while(count != 0) {
+            uint64_t allocated = 0;
+            uint64_t ptrRun = allocateRun(g_devFile, g_super, &g_groups, BLK_FILE, goal, count, &allocated);
+            if(ptrRun == 0) {
+                std::fprintf(stderr, "Cannot allocate data blocks for inode #%" PRIu64 "\n", ino);
+                return false;
+            }
+            std::printf("\tAllocate data blocks [%" PRIu64 " .. %" PRIu64 "] at %#" PRIx64 "\n", block, block + allocated, ptrRun);
+            if(allocated > bufferBlocks) {
+                buffer = BlockBuffer(allocated * g_super->blockSize);
+                bufferBlocks = allocated;
+            }
+            char *buf = buffer.get();
+            auto first = it;
+            for(uint64_t i = 0; i < allocated; ++i, ++it) {
+                std::memcpy(buf + i * g_super->blockSize, it->second.get(), g_super->blockSize);
+            }
+            g_cache->invalidate(ptrRun, allocated);
+            bool ok = fwriteat(g_devFile, buf, ptrRun * g_super->blockSize, allocated * g_super->blockSize) > 0;
+            if(!ok) {
+                std::perror("Write error");
+            }
+            ok = ok && (!dataChecksums(g_super) || storeChecksums(g_devFile, g_super, ptrRun, allocated, buf));
+            if(ok && !setIndexRun(g_devFile, g_super, &g_groups, inode, block, ptrRun, allocated)) {
+                // Only the direct pointers can have been set in memory.
+                for(uint64_t i = block; i < std::min<uint64_t>(block + allocated, 4); ++i) {
+                    inode->ptrDirect[i] = 0;
+                }
+                ok = false;
+            }
+            if(!ok) {
+                // The run was never linked into the file: give it back.
+                std::vector<uint64_t> run;
+                for(uint64_t i = 0; i < allocated; ++i) {
+                    run.push_back(ptrRun + i);
+                }
+                releaseBlocks(g_devFile, g_super, &g_groups, run);
+                return false;
+            }
+            if(g_options.dedup) {
+                for(uint64_t i = 0; i < allocated; ++i) {
+                    g_dedup->insert(hashes[block + i], ptrRun + i);
+                }
+                g_dedup->writtenBlocks += allocated;
+            }
+            it = pages->erase(first, it);
+            block += allocated;
+            count -= allocated;
+            goal = ptrRun + allocated;
+        }
+    }
+    return true;
+}
+
+// Write back the buffered pages of an inode.  The caller holds the inode lock
+// and writes the inode afterwards.  Pages that could not be written are put
+// back in the buffer, to be retried by a later flush.
+static bool flushInode(uint64_t ino, Inode *inode) {
+    DirtyBuffer::Pages pages = g_dirty->take(ino);
+    if(pages.empty()) {
+        return true;
+    }
+    bool ok = writePages(ino, inode, &pages);
+    g_dirty->restore(ino, std::move(pages));
+    return ok;
+}
+
+static bool flushInodeFile(uint64_t ino) {
+    std::lock_guard<std::mutex> lock(inodeLock(ino));
+    if(g_dirty->pageCount(ino) == 0) {
+        return true;
+    }
+    Inode inode;
+    if(freadmeta(g_devFile, g_super, &inode, ino * sizeof (Inode), sizeof (Inode)) <= 0) {
+        std::perror("Read error");
+        return false;
+    }
+    bool ok = flushInode(ino, &inode);
+    if(fwritemeta(g_devFile, g_super, &inode, ino * sizeof (Inode), sizeof (Inode)) <= 0) {
+        std::perror("Write error");
+        return false;
+    }
+    return ok;
+}
+
+// Write [off, off + size) of a file, growing it as needed.  The caller
+// holds the inode lock and writes the inode afterwards.
+static int writeFile(uint64_t ino, Inode *inode, const char *buf, uint64_t size, uint64_t off) {
+    uint64_t beginBlock = off / g_super->blockSize;
+    uint64_t endBlock = ceilDiv(off + size, g_super->blockSize);
+    if(off + size > 64 && endBlock > 4 + g_super->blockSize / sizeof (uint64_t)) {
+        std::printf("\tFailed to write data block [%" PRIu64 "], limits exceeded\n", endBlock - 1);
+        return EFBIG;
+    }
+    if(isFragment(inode)) {
+        if(off + size <= inode->fragmentSlots * FragmentSlotSize) {
+            std::printf("\tWriting fragment %#" PRIx64 ", %" PRIu64 " bytes\n", inode->ptrFragment, size);
+            if(fwritedata(g_devFile, g_super, buf, inode->ptrFragment * FragmentSlotSize + off, size) <= 0) {
+                std::perror("Write error");
+                return EIO;
+            }
+            inode->size = std::max(inode->size, off + size);
+            return 0;
+        }
+        if(!convertToBlocks(ino, inode)) {
+            return EIO;
+        }
+    }
+    bool wasInline = isInline(inode);
+    if(off + size > inode->size) {
+        inode->size = off + size;
+    }
+    if(wasInline && inode->size > 64 && !convertToBlocks(ino, inode)) {
+        return EIO;
+    }
+    if(isInline(inode)) {
+        std::memcpy(inode->contents + off, buf, size);
+        return 0;
+    }
+    std::printf("\tWrite task starts: Block [%" PRIu64 " .. %" PRIu64 "]\n", beginBlock, endBlock);
+    uint64_t bytesWritten = 0;
+    for(uint64_t i = beginBlock; i < endBlock; ++i) {
+        uint64_t beginByte = std::max<uint64_t>(off, i * g_super->blockSize);
+        uint64_t endByte = std::min<uint64_t>(off + size, (i + 1) * g_super->blockSize);
+        char *page = g_dirty->find(ino, i);
+        uint64_t index = page ? 0 : getIndexForRead(g_devFile, g_super, inode, i);
+        std::unique_lock<std::mutex> blockLock;
+        if(index != 0 && compressedLength(index) == 0) {
+            blockLock = std::unique_lock<std::mutex>(dataBlockLock(index));
+        }
+        if(index != 0 && (compressedLength(index) != 0 || blockRefs(&g_groups, index) > 1)) {
+            page = unshareBlock(ino, inode, i, index);
+            if(!page) {
+                return EIO;
+            }
+            index = 0;
+        }
+        if(index != 0) {
+            std::printf("\tWriting data block [%#" PRIx64" .. %#" PRIx64 "], %" PRIu64 " bytes\n", beginByte, endByte, endByte - beginByte);
+            // Dropped after the write, so that a read racing it cannot leave
+            // the old contents cached.
+            bool ok = fwritedata(g_devFile, g_super, buf + bytesWritten, index * g_super->blockSize + beginByte - i * g_super->blockSize, endByte - beginByte) > 0;
+            g_cache->invalidate(index);
+            if(!ok) {
+                std::perror("Write error");
+                return EIO;
+            }
+        } else {
+            std::printf("\tBuffering data block [%#" PRIx64" .. %#" PRIx64 "], %" PRIu64 " bytes\n", beginByte, endByte, endByte - beginByte);
+            if(!page) {
+                page = g_dirty->get(ino, i);
+            }
+            std::memcpy(page + beginByte - i * g_super->blockSize, buf + bytesWritten, endByte - beginByte);
+        }
+        bytesWritten += endByte - beginByte;
+    }
+    // Past the limit the writer pays for the writeback itself, in its own
+    // share of the device, which is what throttles it.
+    if(g_dirty->pageCount(ino) >= maxDirtyPagesPerInode || g_dirty->pageCount() * g_super->blockSize >= g_options.dirtyLimit) {
+        if(!flushInode(ino, inode)) {
+            return ENOSPC;
+        }
+    }
+    return 0;
+}
+
+static void dogefs_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t off, struct fuse_file_info *) {
+    std::printf("write(..., %" PRIu64 ", %p, %" PRIu64 ", %" PRIu64 ", ...);\n", ino, buf, size, off);
+    IoTagScope tag(IoClass::Data, ioClient(req));
+    if(ino == 1) {
+        ino = g_super->ptrRootInode;
+    }
+    std::lock_guard<std::mutex> lock(inodeLock(ino));
+    Inode inode;
+    if(freadmeta(g_devFile, g_super, &inode, ino * sizeof (Inode), sizeof (Inode)) <= 0) {
+        std::perror("Read error");
+        fuse_reply_err(req, EIO);
+        return;
+    }
+    updateTimestamp(inode.secModify, inode.nsecModify);
+    int err = writeFile(ino, &inode, buf, size, off);
+    if(fwritemeta(g_devFile, g_super, &inode, ino * sizeof (Inode), sizeof (Inode)) <= 0) {
+        std::perror("Write error");
+        fuse_reply_err(req, EIO);
+        return;
+    }
+    if(err != 0) {
+        fuse_reply_err(req, err);
+        return;
+    }
+    fuse_reply_write(req, size);
+}
+
+static void dogefs_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *) {
+    std::printf("flush(..., %" PRIu64 ", ...);\n", ino);
+    fuse_reply_err(req, 0);
+}
+
+static void dogefs_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    std::printf("release(..., %" PRIu64 ", ...);\n", ino);
+    IoTagScope tag(IoClass::Data, ioClient(req));
+    delete (ReadaheadState *) fi->fh;
+    fi->fh = 0;
+    if(ino == 1) {
+        ino = g_super->ptrRootInode;
+    }
+    {
+        std::lock_guard<std::mutex> lock(g_snapshotOpensLock);
+        auto it = g_snapshotOpens.find(ino);
+        if(it != g_snapshotOpens.end() && --it->second == 0) {
+            g_snapshotOpens.erase(it);
+        }
+    }
+    fuse_reply_err(req, flushInodeFile(ino) ? 0 : EIO);
+}
+
+static void dogefs_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *) {
+    std::printf("fsync(..., %" PRIu64 ", %d, ...);\n", ino, datasync);
+    IoTagScope tag(IoClass::Data, ioClient(req));
+    if(ino == 1) {
+        ino = g_super->ptrRootInode;
+    }
+    if(!flushInodeFile(ino)) {
+        fuse_reply_err(req, EIO);
+        return;
+    }
+    fuse_reply_err(req, g_devFile->sync() ? 0 : EIO);
+}
+
+// Give the file blocks [begin, end) that have no device block yet zeroed,
+// contiguous device blocks.  The block map is read once to find the holes.
+static bool preallocateFile(uint64_t ino, Inode *inode, uint64_t begin, uint64_t end) {
+    if(!flushInode(ino, inode)) {
+        return false;
+    }
+    std::vector<uint64_t> indexes;
+    if(!readIndex(g_devFile, g_super, inode, end, &indexes)) {
+        return false;
+    }
+    for(uint64_t block = begin; block < end;) {
+        if(indexes[block] != 0) {
+            ++block;
+            continue;
+        }
+        uint64_t count = 1;
+        while(block + count < end && indexes[block + count] == 0) {
+            ++count;
+        }
+        uint64_t goal = block != 0 ? indexes[block - 1] : 0;
+        goal = goal != 0 ? ptrDeviceBlock(g_super, goal) + 1 : inodeBlock(ino);
+        while(count != 0) {
+            uint64_t allocated = 0;
+            uint64_t ptrRun = allocateRun(g_devFile, g_super, &g_groups, BLK_FILE, goal, count, &allocated);
+            if(ptrRun == 0) {
+                std::fprintf(stderr, "Cannot preallocate data blocks for inode #%" PRIu64 "\n", ino);
+                return false;
+            }
+            std::printf("\tPreallocate data blocks [%" PRIu64 " .. %" PRIu64 "] at %#" PRIx64 "\n", block, block + allocated, ptrRun);
+            g_cache->invalidate(ptrRun, allocated);
+            bool ok = fzeroat(g_devFile, ptrRun * g_super->blockSize, allocated * g_super->blockSize) > 0;
+            if(!ok) {
+                std::perror("Write error");
+            }
+            ok = ok && (!dataChecksums(g_super) || storeChecksums(g_devFile, g_super, ptrRun, allocated, nullptr));
+            if(ok && !setIndexRun(g_devFile, g_super, &g_groups, inode, block, ptrRun, allocated)) {
+                // Only the direct pointers can have been set in memory.
+                for(uint64_t i = block; i < std::min<uint64_t>(block + allocated, 4); ++i) {
+                    inode->ptrDirect[i] = 0;
+                }
+                ok = false;
+            }
+            if(!ok) {
+                // The run was never linked into the file: give it back.
+                std::vector<uint64_t> run;
+                for(uint64_t i = 0; i < allocated; ++i) {
+                    run.push_back(ptrRun + i);
+                }
+                releaseBlocks(g_devFile, g_super, &g_groups, run);
+                return false;
+            }
+            block += allocated;
+            count -= allocated;
+            goal = ptrRun + allocated;
+        }
+    }
+    return true;
+}
+
+static void dogefs_fallocate(fuse_req_t req, fuse_ino_t ino, int mode, off_t offset, off_t length, struct fuse_file_info *) {
+    std::printf("fallocate(..., %" PRIu64 ", %#x, %" PRIu64 ", %" PRIu64 ", ...);\n", ino, mode, offset, length);
+    IoTagScope tag(IoClass::Data, ioClient(req));
+    if((mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE)) != 0 || mode == FALLOC_FL_PUNCH_HOLE) {
+        fuse_reply_err(req, EOPNOTSUPP);
+        return;
+    }
+    if(offset < 0 || length <= 0) {
+        fuse_reply_err(req, EINVAL);
+        return;
+    }
+    if(ino == 1) {
+        ino = g_super->ptrRootInode;
+    }
+    std::lock_guard<std::mutex> lock(inodeLock(ino));
+    Inode inode;
+    if(freadmeta(g_devFile, g_super, &inode, ino * sizeof (Inode), sizeof (Inode)) <= 0) {
+        std::perror("Read error");
+        fuse_reply_err(req, EIO);
+        return;
+    }
+    if((inode.mode & 0170000) != 0100000) {
+        fuse_reply_err(req, ENODEV);
+        return;
+    }
+    uint64_t begin = offset;
+    uint64_t end = offset + length;
+    bool ok = true;
+    if(mode & FALLOC_FL_PUNCH_HOLE) {
+        end = std::min<uint64_t>(end, inode.size);
+        if(begin >= end) {
+            fuse_reply_err(req, 0);
+            return;
+        }
+        if(isInline(&inode)) {
+            std::memset(inode.contents + begin, 0, end - begin);
+        } else if(isFragment(&inode)) {
+            if(fzerodata(g_devFile, g_super, inode.ptrFragment * FragmentSlotSize + begin, end - begin) <= 0) {
+                std::perror("Write error");
+                ok = false;
+            }
+        } else {
+            uint64_t beginBlock = (begin + g_super->blockSize - 1) / g_super->blockSize;
+            uint64_t endBlock = end / g_super->blockSize;
+            if(beginBlock > endBlock) {
+                ok = zeroFileRange(ino, &inode, begin, end);
+            } else {
+                if(begin < beginBlock * g_super->blockSize) {
+                    ok = zeroFileRange(ino, &inode, begin, beginBlock * g_super->blockSize) && ok;
+                }
+                if(end > endBlock * g_super->blockSize) {
+                    ok = zeroFileRange(ino, &inode, endBlock * g_super->blockSize, end) && ok;
+                }
+                if(beginBlock < endBlock) {
+                    ok = punchFileBlocks(ino, &inode, beginBlock, endBlock) && ok;
+                }
+            }
+        }
+    } else {
+        uint64_t endBlock = ceilDiv(end, g_super->blockSize);
+        if(endBlock > 4 + g_super->blockSize / sizeof (uint64_t)) {
+            fuse_reply_err(req, EFBIG);
+            return;
+        }
+        if((isInline(&inode) && (end > 64 || (mode & FALLOC_FL_KEEP_SIZE) != 0)) || isFragment(&inode)) {
+            ok = convertToBlocks(ino, &inode);
+        }
+        if(ok && !isInline(&inode)) {
+            ok = preallocateFile(ino, &inode, begin / g_super->blockSize, endBlock);
+        }
+        if(ok && (mode & FALLOC_FL_KEEP_SIZE) == 0 && end > inode.size) {
+            inode.size = end;
+        }
+    }
+    updateTimestamp(inode.secChange, inode.nsecChange);
+    if(fwritemeta(g_devFile, g_super, &inode, ino * sizeof (Inode), sizeof (Inode)) <= 0) {
+        std::perror("Write error");
+        fuse_reply_err(req, EIO);
+        return;
+    }
+    fuse_reply_err(req, ok ? 0 : ENOSPC);
+}
+
+constexpr uint64_t maxCopyChunk = 1048576;
+
+// Copy file data through a bounce buffer, in large chunks, without ever
+// passing it through the kernel.  The caller holds both inode locks.
+static int copyFileData(uint64_t inoIn, Inode *in, uint64_t offIn, uint64_t inoOut, Inode *out, uint64_t offOut, uint64_t len) {
+    BlockBuffer buffer(std::min(len, maxCopyChunk));
+    char *buf = buffer.get();
+    int err = 0;
+    for(uint64_t done = 0; done < len && err == 0;) {
+        uint64_t chunk = std::min(len - done, maxCopyChunk);
+        if(isInline(in)) {
+            std::memcpy(buf, in->contents + offIn + done, chunk);
+        } else {
+            err = readFile(inoIn, in, buf, chunk, offIn + done);
+        }
+        if(err == 0) {
+            err = writeFile(inoOut, out, buf, chunk, offOut + done);
+        }
+        done += chunk;
+    }
+    return err;
+}
+
+// Make the destination point at the source's device blocks instead of
+// copying them.  Both offsets must be block aligned.  A partial last block
+// is only shared when it ends both the source and the destination, and
+// sharing stops at the first compressed block.  Returns how many bytes were
+// handled; the caller copies whatever is left.
+static uint64_t shareFileBlocks(Inode *in, uint64_t offIn, uint64_t inoOut, Inode *out, uint64_t offOut, uint64_t len) {
+    uint64_t blockCount = len / g_super->blockSize;
+    if(len % g_super->blockSize != 0 && offIn + len == in->size && offOut + len >= out->size) {
+        blockCount += 1;
+    }
+    uint64_t beginIn = offIn / g_super->blockSize;
+    uint64_t beginOut = offOut / g_super->blockSize;
+    if(blockCount == 0 || beginOut + blockCount > 4 + g_super->blockSize / sizeof (uint64_t)) {
+        return 0;
+    }
+    if((isInline(out) || isFragment(out)) && !convertToBlocks(inoOut, out)) {
+        return 0;
+    }
+    // The source's map is read once; the ranges never overlap, so sharing
+    // into the destination leaves it valid.
+    std::vector<uint64_t> indexes;
+    if(!readIndex(g_devFile, g_super, in, beginIn + blockCount, &indexes)) {
+        return 0;
+    }
+    uint64_t done = 0;
+    while(done < blockCount) {
+        uint64_t index = indexes[beginIn + done];
+        if(compressedLength(index) != 0) {
+            break;
+        }
+        uint64_t count = 1;
+        while(done + count < blockCount) {
+            uint64_t next = indexes[beginIn + done + count];
+            if(index == 0 ? next != 0 : next != index + count) {
+                break;
+            }
+            ++count;
+        }
+        if(index != 0) {
+            count = shareBlocks(g_devFile, g_super, &g_groups, index, count);
+            if(count == 0) {
+                break;
+            }
+            std::printf("\tShare data blocks [%" PRIu64 " .. %" PRIu64 "] at %#" PRIx64 "\n", beginOut + done, beginOut + done + count, index);
+        }
+        if(!punchFileBlocks(inoOut, out, beginOut + done, beginOut + done + count)) {
+            break;
+        }
+        if(index != 0 && !setIndexRun(g_devFile, g_super, &g_groups, out, beginOut + done, index, count)) {
+            std::vector<uint64_t> blocks;
+            for(uint64_t i = 0; i < count; ++i) {
+                blocks.push_back(index + i);
+            }
+            releaseBlocks(g_devFile, g_super, &g_groups, blocks);
+            break;
+        }
+        done += count;
+    }
+    uint64_t handled = std::min(len, done * g_super->blockSize);
+    out->size = std::max(out->size, offOut + handled);
+    return handled;
+}
+
+static void dogefs_copy_file_range(fuse_req_t req, fuse_ino_t inoIn, off_t offIn, struct fuse_file_info *, fuse_ino_t inoOut, off_t offOut, struct fuse_file_info *, size_t len, int flags) {
+    std::printf("copy_file_range(..., %" PRIu64 ", %" PRIu64 ", ..., %" PRIu64 ", %" PRIu64 ", ..., %zu, %d);\n", inoIn, offIn, inoOut, offOut, len, flags);
+    IoTagScope tag(IoClass::Data, ioClient(req));
+    if(flags != 0) {
+        fuse_reply_err(req, EINVAL);
+        return;
+    }
+    if(inoIn == 1) {
+        inoIn = g_super->ptrRootInode;
+    }
+    if(inoOut == 1) {
+        inoOut = g_super->ptrRootInode;
+    }
+    std::unique_lock<std::mutex> lockIn(inodeLock(inoIn), std::defer_lock);
+    std::unique_lock<std::mutex> lockOut(inodeLock(inoOut), std::defer_lock);
+    if(lockIn.mutex() == lockOut.mutex()) {
+        lockIn.lock();
+    } else {
+        std::lock(lockIn, lockOut);
+    }
+    Inode inodeIn, inodeOut;
+    Inode *out = inoIn == inoOut ? &inodeIn : &inodeOut;
+    if(freadmeta(g_devFile, g_super, &inodeIn, inoIn * sizeof (Inode), sizeof (Inode)) <= 0 || freadmeta(g_devFile, g_super, out, inoOut * sizeof (Inode), sizeof (Inode)) <= 0) {
+        std::perror("Read error");
+        fuse_reply_err(req, EIO);
+        return;
+    }
+    if((inodeIn.mode & 0170000) != 0100000 || (out->mode & 0170000) != 0100000) {
+        fuse_reply_err(req, EINVAL);
+        return;
+    }
+    if((uint64_t) offIn >= inodeIn.size) {
+        fuse_reply_write(req, 0);
+        return;
+    }
+    len = std::min<uint64_t>(len, inodeIn.size - offIn);
+    int err = flushInode(inoIn, &inodeIn) ? 0 : EIO;
+    uint64_t handled = 0;
+    if(err == 0 && !isInline(&inodeIn) && !isFragment(&inodeIn) && offIn % g_super->blockSize == 0 && offOut % g_super->blockSize == 0) {
+        handled = shareFileBlocks(&inodeIn, offIn, inoOut, out, offOut, len);
+    }
+    if(err == 0 && handled < len) {
+        err = copyFileData(inoIn, &inodeIn, offIn + handled, inoOut, out, offOut + handled, len - handled);
+    }
+    updateTimestamp(out->secModify, out->nsecModify);
+    if((inoIn != inoOut && fwritemeta(g_devFile, g_super, &inodeIn, inoIn * sizeof (Inode), sizeof (Inode)) <= 0) || fwritemeta(g_devFile, g_super, out, inoOut * sizeof (Inode), sizeof (Inode)) <= 0) {
+        std::perror("Write error");
+        fuse_reply_err(req, EIO);
+        return;
+    }
+    if(err != 0) {
+        fuse_reply_err(req, err);
+        return;
+    }
+    fuse_reply_write(req, len);
+}
+
+// SEEK_DATA and SEEK_HOLE over the block map and the buffered pages.  The
+// kernel handles every other whence value by itself.
+static void dogefs_lseek(fuse_req_t req, fuse_ino_t ino, off_t off, int whence, struct fuse_file_info *) {
+    std::printf("lseek(..., %" PRIu64 ", %" PRIu64 ", %d, ...);\n", ino, off, whence);
+    if(whence != SEEK_DATA && whence != SEEK_HOLE) {
+        fuse_reply_err(req, EINVAL);
+        return;
+    }
+    if(ino == 1) {
+        ino = g_super->ptrRootInode;
+    }
+    std::lock_guard<std::mutex> lock(inodeLock(ino));
+    Inode inode;
+    if(freadmeta(g_devFile, g_super, &inode, ino * sizeof (Inode), sizeof (Inode)) <= 0) {
+        std::perror("Read error");
+        fuse_reply_err(req, EIO);
+        return;
+    }
+    if(off < 0 || (uint64_t) off >= inode.size) {
+        fuse_reply_err(req, ENXIO);
+        return;
+    }
+    if(isInline(&inode) || isFragment(&inode)) {
+        fuse_reply_lseek(req, whence == SEEK_DATA ? off : inode.size);
+        return;
+    }
+    uint64_t block = off / g_super->blockSize;
+    uint64_t found;
+    if(whence == SEEK_DATA) {
+        found = std::min(seekIndex(g_devFile, g_super, &inode, block, true), g_dirty->nextPage(ino, block));
+    } else {
+        for(found = block;; ++found) {
+            found = seekIndex(g_devFile, g_super, &inode, found, false);
+            if(g_dirty->nextPage(ino, found) != found) {
+                break;
+            }
+        }
+    }
+    uint64_t result = std::max<uint64_t>(off, std::min<uint64_t>(found, inode.size / g_super->blockSize + 1) * g_super->blockSize);
+    if(whence == SEEK_DATA && result >= inode.size) {
+        fuse_reply_err(req, ENXIO);
+        return;
+    }
+    fuse_reply_lseek(req, std::min<uint64_t>(result, inode.size));
+}
+
+// A snapshot is a read-only copy of the tree, one of the subdirectories of
+// /.snapshots.  It has inodes, directory and index blocks of its own but
+// shares every data block with the live files, which copy a shared block
+// before modifying it, so taking one costs in proportion to the metadata
+// only.  Fragments are copied, as they are rewritten in place.  Every inode
+// of a snapshot is flagged INODE_SNAPSHOT and refuses to be modified.
+
+// Hold every inode lock, so that the tree stays put while it is copied.
+static std::vector<std::unique_lock<std::mutex>> lockAllInodes() {
+    std::vector<std::unique_lock<std::mutex>> locks;
+    for(std::mutex &lock : g_inodeLocks) {
+        locks.emplace_back(lock);
+    }
+    return locks;
+}
+
+// Return a block map entry for another file to use: the same one with one
+// more reference taken, or a copy of the block once its count is full.
+// Compressed blocks are never modified in place, so they are shared the same
+// way through their fragment slots.  Returns 0 on failure.
+static uint64_t shareEntry(uint64_t index) {
+    uint64_t length = compressedLength(index);
+    if(length != 0) {
+        uint64_t slots = ceilDiv(length, FragmentSlotSize);
+        if(shareFragment(g_devFile, g_super, &g_groups, compressedAddress(index), slots)) {
+            return index;
+        }
+        uint64_t ptrFragment = allocateFragment(g_devFile, g_super, &g_groups, slots, ptrDeviceBlock(g_super, index));
+        if(ptrFragment == 0) {
+            std::fprintf(stderr, "Cannot allocate fragment\n");
+            return 0;
+        }
+        BlockBuffer buffer(slots * FragmentSlotSize);
+        if(freaddata(g_devFile, g_super, buffer.get(), compressedAddress(index) * FragmentSlotSize, length) <= 0 || fwritedata(g_devFile, g_super, buffer.get(), ptrFragment * FragmentSlotSize, length) <= 0) {
+            std::perror("Copy error");
+            releaseFragment(g_devFile, g_super, &g_groups, ptrFragment, slots);
+            return 0;
+        }
+        g_cache->invalidate(ptrFragment | length << PtrLengthShift);
+        return ptrFragment | length << PtrLengthShift;
+    }
+    if(shareBlocks(g_devFile, g_super, &g_groups, index, 1) == 1) {
+        return index;
+    }
+    uint64_t block = allocateBlock(g_devFile, g_super, &g_groups, BLK_FILE, index);
+    if(block == 0) {
+        std::fprintf(stderr, "Cannot allocate data block\n");
+        return 0;
+    }
+    BlockBuffer buffer(g_super->blockSize);
+    if(freaddata(g_devFile, g_super, buffer.get(), index * g_super->blockSize, g_super->blockSize) <= 0 || fwritedata(g_devFile, g_super, buffer.get(), block * g_super->blockSize, g_super->blockSize) <= 0) {
+        std::perror("Copy error");
+        releaseBlocks(g_devFile, g_super, &g_groups, std::vector<uint64_t> { block });
+        return 0;
+    }
+    g_cache->invalidate(block);
+    return block;
+}
+
+// Give the copy *inode of file ino a block map or fragment of its own.  The
+// map is read once, and each run of consecutive blocks is shared at once,
+// with one space map write for each group it spans.  On failure every
+// reference taken is dropped again and *inode is left as it was.
+static bool copyFileMap(uint64_t ino, Inode *inode) {
+    if(isInline(inode)) {
+        return true;
+    }
+    if(isFragment(inode)) {
+        uint64_t ptrFragment = allocateFragment(g_devFile, g_super, &g_groups, inode->fragmentSlots, inodeBlock(ino));
+        if(ptrFragment == 0) {
+            std::fprintf(stderr, "Cannot allocate fragment\n");
+            return false;
+        }
+        BlockBuffer buffer(inode->fragmentSlots * FragmentSlotSize);
+        if(freaddata(g_devFile, g_super, buffer.get(), inode->ptrFragment * FragmentSlotSize, inode->fragmentSlots * FragmentSlotSize) <= 0 || fwritedata(g_devFile, g_super, buffer.get(), ptrFragment * FragmentSlotSize, inode->fragmentSlots * FragmentSlotSize) <= 0) {
+            std::perror("Copy error");
+            releaseFragment(g_devFile, g_super, &g_groups, ptrFragment, inode->fragmentSlots);
+            return false;
+        }
+        inode->ptrFragment = ptrFragment;
+        return true;
+    }
+    std::vector<uint64_t> map;
+    if(!readIndex(g_devFile, g_super, inode, inode->ptrIndirect1 != 0 ? 4 + g_super->blockSize / sizeof (uint64_t) : 4, &map)) {
+        return false;
+    }
+    for(uint64_t i = 0; i < map.size();) {
+        if(map[i] == 0) {
+            ++i;
+            continue;
+        }
+        uint64_t count = 0;
+        if(compressedLength(map[i]) == 0) {
+            uint64_t run = 1;
+            while(i + run < map.size() && map[i + run] == map[i] + run) {
+                ++run;
+            }
+            count = shareBlocks(g_devFile, g_super, &g_groups, map[i], run);
+        }
+        if(count == 0) {
+            // A compressed block, or one whose count is full.
+            if((map[i] = shareEntry(map[i])) == 0) {
+                map.resize(i);
+                releaseEntries(g_devFile, g_super, &g_groups, map);
+                return false;
+            }
+            count = 1;
+        }
+        i += count;
+    }
+    uint64_t ptrIndexBlock = 0;
+    if(inode->ptrIndirect1 != 0) {
+        ptrIndexBlock = allocateBlock(g_devFile, g_super, &g_groups, BLK_INDEX, inodeBlock(ino));
+        if(ptrIndexBlock == 0) {
+            std::fprintf(stderr, "Cannot allocate index block\n");
+            releaseEntries(g_devFile, g_super, &g_groups, map);
+            return false;
+        }
+        if(fwritemeta(g_devFile, g_super, map.data() + 4, ptrIndexBlock * g_super->blockSize, g_super->blockSize) <= 0) {
+            std::perror("Write error");
+            map.push_back(ptrIndexBlock);
+            releaseEntries(g_devFile, g_super, &g_groups, map);
+            return false;
+        }
+    }
+    for(uint64_t i = 0; i < 4; ++i) {
+        inode->ptrDirect[i] = map[i];
+    }
+    inode->ptrIndirect1 = ptrIndexBlock;
+    return true;
+}
+
+static bool dropInode(uint64_t ino, Inode *inode);
+
+// Clear the inode ino of a snapshot and give its slot back.  The slot is
+// only returned while it is the last one taken from its block; otherwise it
+// is left for fsck to reclaim, as with unlink.
+static bool freeSnapshotInode(uint64_t ino) {
+    Inode inode;
+    std::memset(&inode, 0, sizeof inode);
+    if(fwritemeta(g_devFile, g_super, &inode, ino * sizeof (Inode), sizeof (Inode)) <= 0) {
+        std::perror("Write error");
+        return false;
+    }
+    returnSlots(g_devFile, g_super, &g_groups, BLK_INODE, ino, 1);
+    return true;
+}
+
+// Drop the children the copy of a directory holds in dir, last first, so
+// that their inode slots can go back in the order they were taken.
+static bool dropChildren(const DirItem *dir, size_t count) {
+    bool ok = true;
+    for(size_t i = count; i-- > 0;) {
+        if(dir[i].magic != DirItemMagic || strncmp(dir[i].filename, ".", 32) == 0 || strncmp(dir[i].filename, "..", 32) == 0) {
+            continue;
+        }
+        Inode child;
+        if(freadmeta(g_devFile, g_super, &child, dir[i].inode * sizeof (Inode), sizeof (Inode)) <= 0) {
+            std::perror("Read error");
+            ok = false;
+            continue;
+        }
+        ok = dropInode(dir[i].inode, &child) && ok;
+    }
+    return ok;
+}
+
+// Copy the tree under inode ino into a snapshot whose copy of it lives in
+// the directory parent, leaving out /.snapshots.  The caller holds every
+// inode lock.  Returns the copy's inode number, also in *result, or 0 after
+// giving back whatever the partial copy took.
+static uint64_t copyTree(uint64_t ino, uint64_t parent, Inode *result) {
+    Inode &inode = *result;
+    if(freadmeta(g_devFile, g_super, &inode, ino * sizeof (Inode), sizeof (Inode)) <= 0) {
+        std::perror("Read error");
+        return 0;
+    }
+    uint64_t copy = allocateInode(g_devFile, g_super, &g_groups, inodeBlock(parent));
+    if(copy == 0) {
+        std::fprintf(stderr, "Cannot allocate inode\n");
+        return 0;
+    }
+    inode.mode |= INODE_SNAPSHOT;
+    if((inode.mode & 0170000) != 0040000) {
+        if(!copyFileMap(copy, &inode)) {
+            freeSnapshotInode(copy);
+            return 0;
+        }
+    } else {
+        BlockBuffer buffer(g_super->blockSize);
+        DirItem *dir = buffer.as<DirItem>();
+        if(freadmeta(g_devFile, g_super, dir, inode.ptrDirect[0] * g_super->blockSize, g_super->blockSize) <= 0) {
+            std::perror("Read error");
+            freeSnapshotInode(copy);
+            return 0;
+        }
+        uint64_t used = 2;
+        uint64_t subdirs = 0;
+        size_t i;
+        for(i = 0; i < g_super->blockSize / sizeof (DirItem); ++i) {
+            if(dir[i].magic != DirItemMagic) {
+                continue;
+            }
+            if(strncmp(dir[i].filename, ".", 32) == 0) {
+                dir[i].inode = copy;
+            } else if(strncmp(dir[i].filename, "..", 32) == 0) {
+                dir[i].inode = parent;
+            } else if(dir[i].inode == g_super->ptrSnapshotDir) {
+                dir[i].magic = 0;
+                continue;
+            } else {
+                Inode child;
+                if((dir[i].inode = copyTree(dir[i].inode, copy, &child)) == 0) {
+                    break;
+                }
+                subdirs += (child.mode & 0170000) == 0040000 ? 1 : 0;
+            }
+            used = std::max<uint64_t>(used, i + 1);
+        }
+        uint64_t ptrDirBlock = 0;
+        uint64_t taken = 0;
+        bool copied = false;
+        if(i == g_super->blockSize / sizeof (DirItem)) {
+            ptrDirBlock = allocateBlock(g_devFile, g_super, &g_groups, BLK_DIR, inodeBlock(copy));
+            if(ptrDirBlock == 0 || (used > 2 && allocateDirItems(g_devFile, g_super, &g_groups, ptrDirBlock, used - 2, &taken) == 0)) {
+                std::fprintf(stderr, "Cannot allocate directory\n");
+            } else if(fwritemeta(g_devFile, g_super, dir, ptrDirBlock * g_super->blockSize, g_super->blockSize) <= 0) {
+                std::perror("Write error");
+            } else {
+                copied = true;
+            }
+        }
+        if(copied) {
+            inode.ptrDirect[0] = ptrDirBlock;
+            inode.nlink = 2 + subdirs;
+        } else {
+            if(ptrDirBlock != 0) {
+                releaseBlocks(g_devFile, g_super, &g_groups, std::vector<uint64_t> { ptrDirBlock });
+            }
+            dropChildren(dir, i);
+            freeSnapshotInode(copy);
+            return 0;
+        }
+    }
+    if(fwritemeta(g_devFile, g_super, &inode, copy * sizeof (Inode), sizeof (Inode)) <= 0) {
+        std::perror("Write error");
+        dropInode(copy, &inode);
+        return 0;
+    }
+    return copy;
+}
+
+// Drop the copy *inode of a snapshot at inode ino along with everything
+// under it: the references it holds on data and index blocks, its
+// directory blocks and its inode slots.  The caller holds every inode lock.
+static bool dropInode(uint64_t ino, Inode *inode) {
+    bool ok = true;
+    if((inode->mode & 0170000) == 0040000) {
+        BlockBuffer buffer(g_super->blockSize);
+        DirItem *dir = buffer.as<DirItem>();
+        if(freadmeta(g_devFile, g_super, dir, inode->ptrDirect[0] * g_super->blockSize, g_super->blockSize) <= 0) {
+            std::perror("Read error");
+            return false;
+        }
+        ok = dropChildren(dir, g_super->blockSize / sizeof (DirItem));
+        ok = releaseBlocks(g_devFile, g_super, &g_groups, std::vector<uint64_t> { inode->ptrDirect[0] }) && ok;
+    } else if(isFragment(inode)) {
+        ok = releaseFragment(g_devFile, g_super, &g_groups, inode->ptrFragment, inode->fragmentSlots);
+    } else if(!isInline(inode)) {
+        ok = punchFileBlocks(ino, inode, 0, UINT64_MAX);
+    }
+    return freeSnapshotInode(ino) && ok;
+}
+
+static bool dropTree(uint64_t ino) {
+    Inode inode;
+    if(freadmeta(g_devFile, g_super, &inode, ino * sizeof (Inode), sizeof (Inode)) <= 0) {
+        std::perror("Read error");
+        return false;
+    }
+    return dropInode(ino, &inode);
+}
+
+// Find out whether any file in the snapshot tree under inode ino is open.
+// The caller holds g_snapshotOpensLock.
+static bool treeIsOpen(uint64_t ino, bool *open) {
+    if(g_snapshotOpens.count(ino) != 0) {
+        *open = true;
+        return true;
+    }
+    Inode inode;
+    if(freadmeta(g_devFile, g_super, &inode, ino * sizeof (Inode), sizeof (Inode)) <= 0) {
+        std::perror("Read error");
+        return false;
+    }
+    if((inode.mode & 0170000) != 0040000) {
+        return true;
+    }
+    BlockBuffer buffer(g_super->blockSize);
+    DirItem *dir = buffer.as<DirItem>();
+    if(freadmeta(g_devFile, g_super, dir, inode.ptrDirect[0] * g_super->blockSize, g_super->blockSize) <= 0) {
+        std::perror("Read error");
+        return false;
+    }
+    for(size_t i = 0; i < g_super->blockSize / sizeof (DirItem) && !*open; ++i) {
+        if(dir[i].magic == DirItemMagic && strncmp(dir[i].filename, ".", 32) != 0 && strncmp(dir[i].filename, "..", 32) != 0 && !treeIsOpen(dir[i].inode, open)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Read /.snapshots into *dir and *items and find the entry name in it.
+// *index is the entry's, or the number of entries a block holds when there
+// is none.
+static bool findSnapshot(const char *name, Inode *dir, BlockBuffer *items, size_t *index) {
+    if(freadmeta(g_devFile, g_super, dir, g_super->ptrSnapshotDir * sizeof (Inode), sizeof (Inode)) <= 0) {
+        std::perror("Read error");
+        return false;
+    }
+    *items = BlockBuffer(g_super->blockSize);
+    DirItem *item = items->as<DirItem>();
+    if(freadmeta(g_devFile, g_super, item, dir->ptrDirect[0] * g_super->blockSize, g_super->blockSize) <= 0) {
+        std::perror("Read error");
+        return false;
+    }
+    for(*index = 0; *index < g_super->blockSize / sizeof (DirItem); ++*index) {
+        if(item[*index].magic == DirItemMagic && strncmp(item[*index].filename, name, 32) == 0) {
+            break;
+        }
+    }
+    return true;
+}
+
+static int takeSnapshot(const char *name, uint64_t *ino, Inode *result) {
+    std::vector<std::unique_lock<std::mutex>> locks = lockAllInodes();
+    std::printf("\tTake snapshot \"%s\"\n", name);
+    // Buffered file data belongs in the snapshot too.
+    for(uint64_t dirty : g_dirty->dirtyInodes()) {
+        Inode inode;
+        if(freadmeta(g_devFile, g_super, &inode, dirty * sizeof (Inode), sizeof (Inode)) <= 0 || !flushInode(dirty, &inode) || fwritemeta(g_devFile, g_super, &inode, dirty * sizeof (Inode), sizeof (Inode)) <= 0) {
+            return EIO;
+        }
+    }
+    Inode dir;
+    BlockBuffer items;
+    size_t perBlock = g_super->blockSize / sizeof (DirItem);
+    size_t i;
+    if(!findSnapshot(name, &dir, &items, &i)) {
+        return EIO;
+    } else if(i != perBlock) {
+        return EEXIST;
+    }
+    // Reuse the entry of a dropped snapshot when there is one before the
+    // last entry in use, which lies within the slots already taken.
+    const DirItem *item = items.as<DirItem>();
+    size_t last = perBlock;
+    while(last != 0 && item[last - 1].magic != DirItemMagic) {
+        --last;
+    }
+    for(i = 2; i < last && item[i].magic == DirItemMagic; ++i) {
+    }
+    bool newItem = i >= last;
+    uint64_t ptrDirItem = newItem ? allocateDirItem(g_devFile, g_super, &g_groups, dir.ptrDirect[0]) : dir.ptrDirect[0] * perBlock + i;
+    if(ptrDirItem == 0) {
+        return ENOSPC;
+    }
+    uint64_t root = copyTree(g_super->ptrRootInode, g_super->ptrSnapshotDir, result);
+    if(root == 0) {
+        if(newItem) {
+            returnSlots(g_devFile, g_super, &g_groups, BLK_DIR, ptrDirItem, 1);
+        }
+        return EIO;
+    }
+    // The root of a snapshot was made when the snapshot was taken.
+    updateTimestamp(result->secCreate, result->nsecCreate);
+    updateTimestamp(result->secChange, result->nsecChange);
+    DirItem dirItem;
+    std::memset(&dirItem, 0, sizeof dirItem);
+    dirItem.magic = DirItemMagic;
+    std::strncpy(dirItem.filename, name, 32);
+    dirItem.inode = root;
+    dir.nlink += 1;
+    updateTimestamp(dir.secModify, dir.nsecModify);
+    if(fwritemeta(g_devFile, g_super, result, root * sizeof (Inode), sizeof (Inode)) <= 0 || fwritemeta(g_devFile, g_super, &dirItem, ptrDirItem * sizeof (DirItem), sizeof (DirItem)) <= 0 || fwritemeta(g_devFile, g_super, &dir, g_super->ptrSnapshotDir * sizeof (Inode), sizeof (Inode)) <= 0) {
+        std::perror("Write error");
+        std::memset(&dirItem, 0, sizeof dirItem);
+        fwritemeta(g_devFile, g_super, &dirItem, ptrDirItem * sizeof (DirItem), sizeof (DirItem));
+        dropInode(root, result);
+        if(newItem) {
+            returnSlots(g_devFile, g_super, &g_groups, BLK_DIR, ptrDirItem, 1);
+        }
+        return EIO;
+    }
+    if(!g_devFile->sync()) {
+        return EIO;
+    }
+    *ino = root;
+    return 0;
+}
+
+static int dropSnapshot(const char *name) {
+    std::vector<std::unique_lock<std::mutex>> locks = lockAllInodes();
+    std::printf("\tDrop snapshot \"%s\"\n", name);
+    if(strncmp(name, ".", 32) == 0 || strncmp(name, "..", 32) == 0) {
+        return EINVAL;
+    }
+    Inode dir;
+    BlockBuffer items;
+    size_t i;
+    if(!findSnapshot(name, &dir, &items, &i)) {
+        return EIO;
+    } else if(i == g_super->blockSize / sizeof (DirItem)) {
+        return ENOENT;
+    }
+    DirItem *item = items.as<DirItem>();
+    uint64_t root = item[i].inode;
+    // Held until the snapshot is gone, so that none of its files is opened
+    // meanwhile.
+    std::lock_guard<std::mutex> opensLock(g_snapshotOpensLock);
+    if(!g_snapshotOpens.empty()) {
+        bool open = false;
+        if(!treeIsOpen(root, &open)) {
+            return EIO;
+        } else if(open) {
+            return EBUSY;
+        }
+    }
+    // The entry goes first, so that a failure part way leaves nothing that
+    // points at blocks whose references are gone.
+    item[i].magic = 0;
+    dir.nlink -= 1;
+    updateTimestamp(dir.secModify, dir.nsecModify);
+    if(fwritemeta(g_devFile, g_super, item, dir.ptrDirect[0] * g_super->blockSize, g_super->blockSize) <= 0 || fwritemeta(g_devFile, g_super, &dir, g_super->ptrSnapshotDir * sizeof (Inode), sizeof (Inode)) <= 0) {
+        std::perror("Write error");
+        return EIO;
+    }
+    // The entry's slot goes back when it was the last one taken; otherwise
+    // the next snapshot reuses it.
+    returnSlots(g_devFile, g_super, &g_groups, BLK_DIR, dir.ptrDirect[0] * (g_super->blockSize / sizeof (DirItem)) + i, 1);
+    return dropTree(root) ? 0 : EIO;
+}
+
+// Give the root a /.snapshots directory on the first mount that knows about
+// snapshots.  When the name is taken already, snapshots stay off.
+static bool makeSnapshotDir() {
+    if(g_super->ptrSnapshotDir != 0) {
+        return true;
+    }
+    uint64_t root = g_super->ptrRootInode;
+    std::lock_guard<std::mutex> lock(inodeLock(root));
+    Inode inode;
+    if(freadmeta(g_devFile, g_super, &inode, root * sizeof (Inode), sizeof (Inode)) <= 0) {
+        std::perror("Read error");
+        return false;
+    }
+    BlockBuffer buffer;
+    const DirItem *dir = (const DirItem *) fviewmeta(g_devFile, g_super, &buffer, inode.ptrDirect[0] * g_super->blockSize, g_super->blockSize);
+    if(!dir) {
+        std::perror("Read error");
+        return false;
+    }
+    for(size_t i = 0; i < g_super->blockSize / sizeof (DirItem); ++i) {
+        if(dir[i].magic == DirItemMagic && strncmp(dir[i].filename, ".snapshots", 32) == 0) {
+            std::fprintf(stderr, "/.snapshots is taken, snapshots are off.\n");
+            return true;
+        }
+    }
+    uint64_t ino;
+    if(makeDirectory(root, ".snapshots", 0755, &ino, &inode) != 0) {
+        return false;
+    }
+    inode.mode |= INODE_SNAPSHOT;
+    if(fwritemeta(g_devFile, g_super, &inode, ino * sizeof (Inode), sizeof (Inode)) <= 0) {
+        std::perror("Write error");
+        return false;
+    }
+    g_super->ptrSnapshotDir = ino;
+    return writeSuperBlock();
+}
+
+// Load the dedup index saved at the last unmount and free its blocks; it is
+// saved afresh at the next one.  The superblock forgets the chain first, so
+// that a crash never leaves it pointing at freed blocks.
+static bool loadDedupIndex() {
+    uint64_t ptrBlock = g_super->ptrDedupIndex;
+    if(ptrBlock == 0) {
+        return true;
+    }
+    g_super->ptrDedupIndex = 0;
+    if(!writeSuperBlock()) {
+        return false;
+    }
+    uint64_t perBlock = g_super->blockSize / sizeof (DedupEntry) - 1;
+    BlockBuffer buffer(g_super->blockSize);
+    char *block = buffer.get();
+    std::vector<uint64_t> chain;
+    bool ok = true;
+    while(ptrBlock != 0 && ptrBlock < g_super->blockCount && chain.size() < g_super->blockCount) {
+        if(freadmeta(g_devFile, g_super, block, ptrBlock * g_super->blockSize, g_super->blockSize) <= 0) {
+            std::perror("Read error");
+            ok = false;
+            break;
+        }
+        chain.push_back(ptrBlock);
+        const DedupBlockHeader *header = (const DedupBlockHeader *) block;
+        const DedupEntry *entries = (const DedupEntry *) (block + sizeof (DedupBlockHeader));
+        for(uint64_t i = 0; i < std::min(header->count, perBlock); ++i) {
+            if(entries[i].ptrBlock != 0 && entries[i].ptrBlock < g_super->blockCount) {
+                g_dedup->insert(entries[i].hash, entries[i].ptrBlock);
+            }
+        }
+        ptrBlock = header->ptrNext;
+    }
+    std::printf("Loaded %" PRIu64 " dedup index entries from %zu block(s)\n", g_dedup->size(), chain.size());
+    return releaseBlocks(g_devFile, g_super, &g_groups, chain) && ok;
+}
+
+// Save the dedup index as a chain of BLK_DEDUP blocks and record it in the
+// superblock.  The chain is built back to front, so that every block is
+// written once, already pointing at its successor.
+static bool saveDedupIndex() {
+    std::vector<DedupEntry> entries = g_dedup->snapshot();
+    uint64_t perBlock = g_super->blockSize / sizeof (DedupEntry) - 1;
+    BlockBuffer buffer(g_super->blockSize);
+    char *block = buffer.get();
+    std::vector<uint64_t> chain;
+    uint64_t ptrNext = 0;
+    bool ok = true;
+    for(uint64_t end = entries.size(); end != 0;) {
+        uint64_t begin = (end - 1) / perBlock * perBlock;
+        uint64_t ptrBlock = allocateBlock(g_devFile, g_super, &g_groups, BLK_DEDUP, ptrNext);
+        if(ptrBlock == 0) {
+            std::fprintf(stderr, "Cannot allocate dedup index block\n");
+            ok = false;
+            break;
+        }
+        chain.push_back(ptrBlock);
+        std::memset(block, 0, g_super->blockSize);
+        DedupBlockHeader *header = (DedupBlockHeader *) block;
+        header->ptrNext = ptrNext;
+        header->count = end - begin;
+        std::memcpy(block + sizeof (DedupBlockHeader), &entries[begin], (end - begin) * sizeof (DedupEntry));
+        if(fwritemeta(g_devFile, g_super, block, ptrBlock * g_super->blockSize, g_super->blockSize) <= 0) {
+            std::perror("Write error");
+            ok = false;
+            break;
+        }
+        ptrNext = ptrBlock;
+        end = begin;
+    }
+    if(!ok) {
+        releaseBlocks(g_devFile, g_super, &g_groups, chain);
+        return false;
+    }
+    std::printf("Saved %zu dedup index entries in %zu block(s)\n", entries.size(), chain.size());
+    g_super->ptrDedupIndex = ptrNext;
+    return writeSuperBlock();
+}
+
+// Answered from the allocator totals, without touching the device.  Free
+// inodes include the slots of inode blocks that could still be allocated.
+static void dogefs_statfs(fuse_req_t req, fuse_ino_t ino) {
+    uint64_t freeBlocks = g_groups.freeBlocks;
+    uint64_t freeInodes = g_groups.freeInodes;
+    uint64_t usedInodes = g_groups.usedInodes;
+    std::printf("statfs(%" PRIu64 "); free blocks %" PRIu64 ", used inodes %" PRIu64 ", free dir items %" PRIu64 "\n", ino, freeBlocks, usedInodes, (uint64_t) g_groups.freeDirItems);
+    uint64_t inodesPerBlock = g_super->blockSize / sizeof (Inode);
+    struct statvfs st;
+    std::memset(&st, 0, sizeof st);
+    st.f_bsize = g_super->blockSize;
+    st.f_frsize = g_super->blockSize;
+    st.f_blocks = g_super->blockCount;
+    st.f_bfree = freeBlocks;
+    st.f_bavail = freeBlocks;
+    st.f_files = usedInodes + freeInodes + freeBlocks * inodesPerBlock;
+    st.f_ffree = freeInodes + freeBlocks * inodesPerBlock;
+    st.f_favail = st.f_ffree;
+    st.f_namemax = sizeof ((DirItem *) nullptr)->filename;
+    fuse_reply_statfs(req, &st);
+}
+
+// Move a fragmented file into one contiguous run.  Only files whose blocks
+// are all mapped, unshared and uncompressed are moved.  The copy is written
+// first, the block map is then switched over under the inode lock, and the
+// old blocks are freed last, so a crash at any point leaves one complete copy
+// mapped.  Returns the number of blocks moved.
+static uint64_t defragFile(uint64_t ino, RateLimiter *limiter, const std::atomic<bool> &stop) {
+    Inode inode;
+    if(freadmeta(g_devFile, g_super, &inode, ino * sizeof (Inode), sizeof (Inode)) <= 0 || (inode.mode & 0170000) != 0100000 || isInline(&inode) || isFragment(&inode)) {
+        return 0;
+    }
+    uint64_t count = ceilDiv(inode.size, g_super->blockSize);
+    if(inode.size == 0 || count < 2) {
+        return 0;
+    }
+    // Pay for the read and the write before holding up the file.
+    if(!limiter->acquire(2 * count * g_super->blockSize, stop)) {
+        return 0;
+    }
+    std::lock_guard<std::mutex> lock(inodeLock(ino));
+    if(freadmeta(g_devFile, g_super, &inode, ino * sizeof (Inode), sizeof (Inode)) <= 0 || (inode.mode & 0170000) != 0100000 || isInline(&inode) || isFragment(&inode) || g_dirty->pageCount(ino) != 0) {
+        return 0;
+    }
+    count = ceilDiv(inode.size, g_super->blockSize);
+    std::vector<uint64_t> index;
+    if(inode.size == 0 || count < 2 || !readIndex(g_devFile, g_super, &inode, count, &index)) {
+        return 0;
+    }
+    uint64_t extents = 0;
+    for(uint64_t i = 0; i < count; ++i) {
+        if(index[i] == 0 || compressedLength(index[i]) != 0 || blockRefs(&g_groups, index[i]) != 1) {
+            return 0;
+        }
+        if(i == 0 || index[i] != index[i - 1] + 1) {
+            extents += 1;
+        }
+    }
+    if(extents <= 1) {
+        return 0;
+    }
+    uint64_t allocated = 0;
+    uint64_t ptrRun = allocateRun(g_devFile, g_super, &g_groups, BLK_FILE, index[0], count, &allocated);
+    if(ptrRun == 0) {
+        return 0;
+    }
+    std::vector<uint64_t> run;
+    for(uint64_t i = 0; i < allocated; ++i) {
+        run.push_back(ptrRun + i);
+    }
+    if(allocated < count) {
+        releaseBlocks(g_devFile, g_super, &g_groups, run);
+        return 0;
+    }
+    std::printf("\tDefragment inode #%" PRIu64 ": %" PRIu64 " block(s) in %" PRIu64 " extent(s) to %#" PRIx64 "\n", ino, count, extents, ptrRun);
+    BlockBuffer buf(count * g_super->blockSize);
+    bool ok = true;
+    for(uint64_t i = 0; ok && i < count;) {
+        uint64_t length = 1;
+        while(i + length < count && index[i + length] == index[i] + length) {
+            ++length;
+        }
+        char *dst = buf.get() + i * g_super->blockSize;
+        if(freadat(g_devFile, dst, index[i] * g_super->blockSize, length * g_super->blockSize) <= 0) {
+            std::perror("Read error");
+            ok = false;
+        } else if(dataChecksums(g_super) && !verifyChecksums(g_devFile, g_super, index[i], length, dst)) {
+            ok = false;
+        }
+        i += length;
+    }
+    g_cache->invalidate(ptrRun, count);
+    if(ok && fwriteat(g_devFile, buf.get(), ptrRun * g_super->blockSize, count * g_super->blockSize) <= 0) {
+        std::perror("Write error");
+        ok = false;
+    }
+    if(ok && dataChecksums(g_super) && !storeChecksums(g_devFile, g_super, ptrRun, count, buf.get())) {
+        ok = false;
+    }
+    if(ok) {
+        g_devFile->sync();
+    }
+    if(!ok || !setIndexRun(g_devFile, g_super, &g_groups, &inode, 0, ptrRun, count) || fwritemeta(g_devFile, g_super, &inode, ino * sizeof (Inode), sizeof (Inode)) <= 0) {
+        // The old map may be partly switched over already; keep both
+        // copies allocated rather than risk freeing live blocks.
+        if(!ok) {
+            releaseBlocks(g_devFile, g_super, &g_groups, run);
+        }
+        return 0;
+    }
+    releaseBlocks(g_devFile, g_super, &g_groups, index);
+    for(uint64_t block : index) {
+        g_cache->invalidate(block);
+    }
+    return count;
+}
+
+// Walk the directory tree and defragment every file on the way.
+static void defragPass(const std::atomic<bool> &stop) {
+    IoTagScope tag(IoClass::Background);
+    RateLimiter limiter(g_options.defragRate);
+    uint64_t files = 0;
+    uint64_t blocks = 0;
+    std::deque<uint64_t> dirs { g_super->ptrRootInode };
+    while(!dirs.empty() && !stop) {
+        uint64_t ino = dirs.front();
+        dirs.pop_front();
+        Inode inode;
+        if(freadmeta(g_devFile, g_super, &inode, ino * sizeof (Inode), sizeof (Inode)) <= 0 || (inode.mode & 0170000) != 0040000) {
+            continue;
+        }
+        BlockBuffer buffer;
+        const DirItem *dir = (const DirItem *) fviewmeta(g_devFile, g_super, &buffer, inode.ptrDirect[0] * g_super->blockSize, g_super->blockSize);
+        if(!dir) {
+            continue;
+        }
+        for(size_t i = 0; i < g_super->blockSize / sizeof (DirItem) && !stop; ++i) {
+            if(dir[i].magic != DirItemMagic || strncmp(dir[i].filename, ".", 32) == 0 || strncmp(dir[i].filename, "..", 32) == 0) {
+                continue;
+            }
+            Inode sub;
+            if(freadmeta(g_devFile, g_super, &sub, dir[i].inode * sizeof (Inode), sizeof (Inode)) <= 0) {
+                continue;
+            }
+            if(isSnapshot(&sub)) {
+                // Snapshots are read-only and share their blocks anyway.
+                continue;
+            } else if((sub.mode & 0170000) == 0040000) {
+                dirs.push_back(dir[i].inode);
+            } else if(uint64_t moved = defragFile(dir[i].inode, &limiter, stop)) {
+                files += 1;
+                blocks += moved;
+            }
+        }
+    }
+    if(files != 0) {
+        std::printf("Defrag: moved %" PRIu64 " file(s), %" PRIu64 " block(s)\n", files, blocks);
+    }
+}
+
+// Ask for a capability when the options want it and the kernel offers it.
+static void negotiate(struct fuse_conn_info *conn, unsigned capability, bool enable) {
+    if(enable && (conn->capable & capability)) {
+        conn->want |= capability;
+    } else {
+        conn->want &= ~capability;
+    }
+}
+
+static void dogefs_init(void *, struct fuse_conn_info *conn) {
+    std::printf("init(...);\n");
+    negotiate(conn, FUSE_CAP_WRITEBACK_CACHE, g_options.writebackCache);
+    negotiate(conn, FUSE_CAP_PARALLEL_DIROPS, g_options.parallelDirops);
+    negotiate(conn, FUSE_CAP_ASYNC_READ, g_options.asyncRead);
+    negotiate(conn, FUSE_CAP_SPLICE_READ, g_options.splice);
+    negotiate(conn, FUSE_CAP_SPLICE_WRITE, g_options.splice);
+    negotiate(conn, FUSE_CAP_SPLICE_MOVE, g_options.splice);
+    conn->max_write = (unsigned) g_options.maxWrite;
+    conn->max_readahead = (unsigned) std::min<uint64_t>(conn->max_readahead, g_options.maxReadahead != 0 ? g_options.maxReadahead : maxReadaheadBlocks * g_super->blockSize);
+    std::printf("\tCapabilities %#x of %#x, max_write %u, max_readahead %u\n", conn->want, conn->capable, conn->max_write, conn->max_readahead);
+    if(g_options.defrag) {
+        g_defrag = new DefragWorker(defragPass, defragInterval);
+    }
+}
+
+static void dogefs_destroy(void *) {
+    std::printf("destroy(...);\n");
+    delete g_defrag;
+    g_defrag = nullptr;
+    for(uint64_t ino : g_dirty->dirtyInodes()) {
+        flushInodeFile(ino);
+    }
+    if(g_super->ptrChecksum != 0) {
+        std::printf("Checksums: %" PRIu64 " block(s) verified, %" PRIu64 " failure(s)\n", (uint64_t) checksumStats().verified, (uint64_t) checksumStats().failures);
+    }
+    if(g_options.dedup) {
+        uint64_t written = g_dedup->writtenBlocks;
+        uint64_t shared = g_dedup->sharedBlocks;
+        std::printf("Dedup: %" PRIu64 " block(s) written, %" PRIu64 " shared, ratio %.2f, index %" PRIu64 " entries in %.1f KiB\n", written, shared, written != 0 ? (double) (written + shared) / written : 1.0, g_dedup->size(), g_dedup->memoryUsage() / 1024.);
+        saveDedupIndex();
+    }
+    for(const auto &it : g_slots->takeAll()) {
+        const SlotReserve::Slots &slots = it.second;
+        returnSlots(g_devFile, g_super, &g_groups, BLK_INODE, slots.inodes.next, slots.inodes.end - slots.inodes.next);
+        returnSlots(g_devFile, g_super, &g_groups, BLK_DIR, slots.dirItems.next, slots.dirItems.end - slots.dirItems.next);
+    }
+    // The summary has to be on disk before the superblock calls it valid.
+    g_devFile->sync();
+    if(writeAllocSummary(g_devFile, g_super, &g_groups) && g_devFile->sync()) {
+        g_super->dirtyLevel = 0;
+        writeSuperBlock();
+    }
+}
+
+static void dogefs_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, struct fuse_file_info *fi) {
+    std::printf("create(..., %" PRIu64 ", \"%s\", %" PRIu32 ", ...);\n", parent, name, mode);
+    if(parent == 1) {
+        parent = g_super->ptrRootInode;
+    }
+    std::lock_guard<std::mutex> lock(inodeLock(parent));
+    Inode inode;
+    if(freadmeta(g_devFile, g_super, &inode, parent * sizeof (Inode), sizeof (Inode)) <= 0) {
+        std::perror("Read error");
+        fuse_reply_err(req, EIO);
+        return;
+    }
+    if((inode.mode & 0170000) != 0040000) {
+        fuse_reply_err(req, ENOTDIR);
+        return;
+    }
+    if(isSnapshot(&inode)) {
+        fuse_reply_err(req, EROFS);
+        return;
+    }
+    updateTimestamp(inode.secModify, inode.nsecModify);
+    uint64_t ptrDirBlock = inode.ptrDirect[0];
+
+    uint64_t ptrFileInode = reserveInode(parent);
+    if(ptrFileInode == 0) {
+        std::fprintf(stderr, "Cannot allocate inode\n");
+        fuse_reply_err(req, ENOSPC);
+        return;
+    }
+    std::printf("\tAllocate inode #%" PRIu64"\n", ptrFileInode);
+    Inode fileInode;
+    std::memset(&fileInode, 0, sizeof (Inode));
+    fileInode.mode = 0100000 | (mode & 0007777);
+    fileInode.nlink = 1;
+    fileInode.size = 0;
+    updateTimestamp(fileInode.secCreate, fileInode.nsecCreate);
+    updateTimestamp(fileInode.secModify, fileInode.nsecModify);
+    updateTimestamp(fileInode.secChange, fileInode.nsecChange);
+
+    if(fwritemeta(g_devFile, g_super, &fileInode, ptrFileInode * sizeof (Inode), sizeof (Inode)) <= 0) {
+        std::perror("Write error");
+        fuse_reply_err(req, EIO);
+        return;
+    }
+    if(fwritemeta(g_devFile, g_super, &inode, parent * sizeof (Inode), sizeof (Inode)) <= 0) {
+        std::perror("Write error");
+        fuse_reply_err(req, EIO);
+        return;
+    }
+
+    uint64_t ptrDirItem = reserveDirItem(parent, ptrDirBlock);
+    if(ptrDirItem == 0) {
+        std::fprintf(stderr, "Cannot allocate directory item from block %#" PRIx64 "\n", ptrDirBlock);
         fuse_reply_err(req, ENOSPC);
         return;
     }
@@ -539,7 +2449,7 @@ static void dogefs_create(fuse_req_t req, fuse_ino_t parent, const char *name, m
     std::strncpy(dirItem.filename, name, 32);
     dirItem.inode = ptrFileInode;
     dirItem.nextChunk = 0;
-    if(fwriteat(g_devFile, &dirItem, ptrDirItem * sizeof (DirItem), sizeof (DirItem)) <= 0) {
+    if(fwritemeta(g_devFile, g_super, &dirItem, ptrDirItem * sizeof (DirItem), sizeof (DirItem)) <= 0) {
         std::perror("Write error");
         fuse_reply_err(req, EIO);
         return;
@@ -548,41 +2458,137 @@ static void dogefs_create(fuse_req_t req, fuse_ino_t parent, const char *name, m
     fuse_entry_param e;
     std::memset(&e, 0, sizeof e);
     e.ino = ptrFileInode;
-    if(dogefs_stat(ptrFileInode, &e.attr) < 0) {
-        fuse_reply_err(req, EIO);
-        return;
-    }
+    fillStat(ptrFileInode, fileInode, &e.attr);
     e.attr_timeout = 1.0;
     e.entry_timeout = 1.0;
+    fi->fh = (uint64_t) new ReadaheadState;
     fuse_reply_create(req, &e, fi);
 }
 
 static fuse_lowlevel_ops dogefs_oper = {
-    .lookup  = dogefs_lookup,
-    .getattr = dogefs_getattr,
-    .setattr = dogefs_setattr,
-    .readdir = dogefs_readdir,
-    .mkdir   = dogefs_mkdir,
-    .unlink  = dogefs_unlink,
-    .rmdir   = dogefs_unlink,
-    .open    = dogefs_open,
-    .read    = dogefs_read,
-    .write   = dogefs_write,
-    .create  = dogefs_create,
+    .init      = dogefs_init,
+    .destroy   = dogefs_destroy,
+    .lookup    = dogefs_lookup,
+    .getattr   = dogefs_getattr,
+    .setattr   = dogefs_setattr,
+    .mkdir     = dogefs_mkdir,
+    .unlink    = dogefs_unlink,
+    .rmdir     = dogefs_unlink,
+    .open      = dogefs_open,
+    .read      = dogefs_read,
+    .write     = dogefs_write,
+    .flush     = dogefs_flush,
+    .release   = dogefs_release,
+    .fsync     = dogefs_fsync,
+    .readdir   = dogefs_readdir,
+    .statfs    = dogefs_statfs,
+    .create    = dogefs_create,
+    .fallocate = dogefs_fallocate,
+    .copy_file_range = dogefs_copy_file_range,
+    .lseek           = dogefs_lseek,
 };
 
+// Parse the number of a "name=NUMBER" option.
+static bool parseNumberOption(const std::string &option, const char *name, uint64_t *value) {
+    size_t length = std::strlen(name);
+    if(option.compare(0, length, name) != 0 || option.length() <= length || option[length] != '=' || option.find_first_not_of("0123456789", length + 1) != std::string::npos) {
+        return false;
+    }
+    *value = std::strtoull(option.c_str() + length + 1, nullptr, 10);
+    return true;
+}
+
+// Parse a comma separated list of mount options.  Options that are not ours
+// are appended to *fuseOptions and handed to libfuse.
+static void parseMountOptions(const std::string &options, std::string *fuseOptions) {
+    size_t begin = 0;
+    while(begin <= options.length()) {
+        size_t end = std::min(options.find(',', begin), options.length());
+        std::string option = options.substr(begin, end - begin);
+        uint64_t value;
+        if(option == "compress") {
+            g_options.compress = true;
+        } else if(option == "nocompress") {
+            g_options.compress = false;
+        } else if(option == "dedup") {
+            g_options.dedup = true;
+        } else if(option == "nodedup") {
+            g_options.dedup = false;
+        } else if(option == "defrag") {
+            g_options.defrag = true;
+        } else if(option == "nodefrag") {
+            g_options.defrag = false;
+        } else if(option == "mmap") {
+            g_options.mmap = true;
+        } else if(option == "nommap") {
+            g_options.mmap = false;
+        } else if(parseNumberOption(option, "defrag_rate", &value)) {
+            // In MiB/s.
+            g_options.defragRate = value << 20;
+        } else if(parseNumberOption(option, "dirty_limit", &value)) {
+            // In MiB.
+            g_options.dirtyLimit = value << 20;
+        } else if(parseNumberOption(option, "io_depth", &value)) {
+            g_options.ioDepth = std::max<uint64_t>(value, 1);
+        } else if(parseNumberOption(option, "gather", &value)) {
+            // In KiB.
+            g_options.gatherLimit = value << 10;
+        } else if(option == "fair=uid") {
+            g_options.fairByPid = false;
+        } else if(option == "fair=pid") {
+            g_options.fairByPid = true;
+        } else if(option == "writeback_cache") {
+            g_options.writebackCache = true;
+        } else if(option == "no_writeback_cache") {
+            g_options.writebackCache = false;
+        } else if(option == "parallel_dirops") {
+            g_options.parallelDirops = true;
+        } else if(option == "no_parallel_dirops") {
+            g_options.parallelDirops = false;
+        } else if(option == "async_read") {
+            g_options.asyncRead = true;
+        } else if(option == "sync_read") {
+            g_options.asyncRead = false;
+        } else if(option == "splice") {
+            g_options.splice = true;
+        } else if(option == "no_splice") {
+            g_options.splice = false;
+        } else if(parseNumberOption(option, "max_write", &value)) {
+            g_options.maxWrite = value;
+        } else if(parseNumberOption(option, "max_readahead", &value)) {
+            g_options.maxReadahead = value;
+        } else if(!option.empty()) {
+            *fuseOptions += fuseOptions->empty() ? option : "," + option;
+        }
+        begin = end + 1;
+    }
+}
+
 int main(int argc, char *argv[]) {
-    if(argc != 3 || argv[1] == std::string("--help")) {
-        std::puts("Usage: mkdogefs DEVFILE MOUNTPOINT\n");
+    int argi = 1;
+    std::string fuseOptions;
+    while(argi + 1 < argc && argv[argi] == std::string("-o")) {
+        parseMountOptions(argv[argi + 1], &fuseOptions);
+        argi += 2;
+    }
+    if(argc - argi < 2 || argv[argi] == std::string("--help")) {
+        std::puts("Usage: mount.dogefs [-o OPTION,...] DEVFILE... MOUNTPOINT\n\n"
+                  "Options:\n"
+                  "    compress, dedup, defrag, defrag_rate=MIBS, mmap\n"
+                  "    dirty_limit=MIB, io_depth=N, fair=uid|pid, gather=KIB\n"
+                  "    [no_]writeback_cache, [no_]parallel_dirops, async_read|sync_read, [no_]splice\n"
+                  "    max_write=BYTES, max_readahead=BYTES\n"
+                  "Any other option is passed to libfuse.\n");
         return 0;
     }
-    std::string device = argv[1];
-    std::string mountpoint = argv[2];
-    g_devFile = std::fopen(device.c_str(), "r+b");
-    if(!g_devFile) {
-        std::perror("Failed to open the device");
+    std::vector<std::string> devices(argv + argi, argv + argc - 1);
+    std::string mountpoint = argv[argc - 1];
+    Device *device = openDeviceSet(devices, false, g_options.mmap);
+    if(!device) {
+        std::fprintf(stderr, "Failed to open the device\n");
         return 1;
     }
+    g_devFile = new ScheduledDevice(device, g_options.ioDepth);
     g_super = new SuperBlock;
     if(freadat(g_devFile, g_super, 0, sizeof (SuperBlock)) <= 0) {
         std::perror("Read error");
@@ -593,31 +2599,78 @@ int main(int argc, char *argv[]) {
         std::fprintf(stderr, "Not a DogeFS filesystem.\n");
         return 1;
     }
-    std::printf("Device size: %.1lf MiB (%" PRIu64 " blocks)\n\n", g_super->blockCount * (g_super->blockSize / 1048576.), g_super->blockCount);
-
-    const char *fakeArgv[] = { "" };
-    fuse_args args = FUSE_ARGS_INIT(1, (char **) fakeArgv);
-    fuse_chan *ch = fuse_mount(mountpoint.c_str(), &args);
-    if(!ch) {
-        std::fprintf(stderr, "Failed to mount filesystem.\n");
+    BlockPool::setBlockSize(g_super->blockSize);
+    if(g_options.gatherLimit != 0) {
+        // Held blocks go out as background work, whoever triggers the flush.
+        g_devFile = new WritebackDevice(g_devFile, g_super->blockSize, g_options.gatherLimit, gatherInterval, [](Device *device, const struct iovec *iov, int count, uint64_t pos) {
+            IoTagScope tag(IoClass::Background);
+            return device->writev(iov, count, pos);
+        });
+    }
+    std::printf("Device size: %.1lf MiB (%" PRIu64 " blocks)\n", g_super->blockCount * (g_super->blockSize / 1048576.), g_super->blockCount);
+    if(g_super->deviceCount > 1) {
+        std::printf("Striped across %" PRIu32 " devices, %" PRIu64 " KiB at a time\n", g_super->deviceCount, g_super->stripeBlocks * g_super->blockSize / 1024);
+    }
+    std::printf("Checksums: %s\n\n", dataChecksums(g_super) ? "metadata and data" : metaChecksums(g_super) ? "metadata" : "off");
+    if(g_super->dirtyLevel != 0) {
+        std::puts("Filesystem was not cleanly unmounted, scanning space map...");
+    }
+    if(!loadAllocGroups(g_devFile, g_super, &g_groups)) {
+        std::fprintf(stderr, "Failed to load space map.\n");
+        return 1;
+    }
+    // From now on the summary area is stale until dogefs_destroy rewrites it.
+    g_super->dirtyLevel = 1;
+    if(!writeSuperBlock() || !g_devFile->sync()) {
+        std::fprintf(stderr, "Failed to mark filesystem as mounted.\n");
         return 1;
     }
-    fuse_session *se = fuse_lowlevel_new(&args, &dogefs_oper, sizeof dogefs_oper, nullptr);
+    g_dirty = new DirtyBuffer(g_super->blockSize);
+    g_cache = new BlockCache(g_super->blockSize, blockCacheBlocks);
+    g_dedup = new DedupIndex;
+    if(g_options.dedup && !loadDedupIndex()) {
+        std::fprintf(stderr, "Failed to load dedup index.\n");
+    }
+    g_readahead = new ReadaheadQueue(readaheadThreads);
+    g_slots = new SlotReserve(maxSlotBatch);
+    if(!makeSnapshotDir()) {
+        std::fprintf(stderr, "Failed to make /.snapshots.\n");
+    }
+
+    std::vector<const char *> fuseArgv { argv[0] };
+    if(!fuseOptions.empty()) {
+        fuseArgv.push_back("-o");
+        fuseArgv.push_back(fuseOptions.c_str());
+    }
+    fuse_args args = FUSE_ARGS_INIT((int) fuseArgv.size(), (char **) fuseArgv.data());
+    fuse_session *se = fuse_session_new(&args, &dogefs_oper, sizeof dogefs_oper, nullptr);
     if(!se) {
         std::fprintf(stderr, "Failed to create FUSE session.\n");
         return 1;
     }
-    fuse_set_signal_handlers(se);
-    fuse_session_add_chan(se, ch);
+    if(fuse_set_signal_handlers(se) != 0 || fuse_session_mount(se, mountpoint.c_str()) != 0) {
+        std::fprintf(stderr, "Failed to mount filesystem.\n");
+        fuse_session_destroy(se);
+        return 1;
+    }
     fuse_daemonize(true);
-    fuse_session_loop(se);
-    fuse_session_remove_chan(ch);
+    fuse_loop_config config;
+    std::memset(&config, 0, sizeof config);
+    config.clone_fd = 1;
+    config.max_idle_threads = fuseIdleThreads;
+    fuse_session_loop_mt(se, &config);
+    fuse_session_unmount(se);
     fuse_remove_signal_handlers(se);
     fuse_session_destroy(se);
-    fuse_unmount(mountpoint.c_str(), ch);
+    fuse_opt_free_args(&args);
 
+    delete g_slots;
+    delete g_readahead;
+    delete g_dedup;
+    delete g_cache;
+    delete g_dirty;
     delete g_super;
-    fsync(fileno(g_devFile));
-    std::fclose(g_devFile);
+    g_devFile->sync();
+    delete g_devFile;
     return 0;
 }
@@ -0,0 +1,123 @@
+/*
+    Copyright (C) 2017 Yuchen Ma <15208850@hdu.edu.cn>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace DogeFS {
+
+constexpr uint64_t minReadaheadBlocks = 4;
+constexpr uint64_t maxReadaheadBlocks = 256;
+
+// Per open file sequential access state, hung off fuse_file_info::fh.  The
+// window doubles on every read that continues where the previous one ended
+// and collapses back to nothing on a seek.
+struct ReadaheadState {
+    std::mutex lock;
+    uint64_t nextOffset = 0;
+    uint64_t window = 0;
+    uint64_t readaheadEnd = 0;    // first file block not yet queued
+
+    // Feed one read request through the detector.  Returns the file block
+    // range [*begin, *end) to prefetch, which may be empty.
+    void update(uint64_t off, uint64_t size, uint64_t blockSize, uint64_t *begin, uint64_t *end) {
+        std::lock_guard<std::mutex> guard(lock);
+        uint64_t lastBlock = (off + size - 1) / blockSize + 1;
+        *begin = *end = 0;
+        if(off != nextOffset || size == 0) {
+            window = 0;
+            readaheadEnd = 0;
+        } else {
+            window = window == 0 ? minReadaheadBlocks : std::min(window * 2, maxReadaheadBlocks);
+            // Issue the next window once the reader has consumed half of
+            // the previous one, so that the prefetch stays ahead of it.
+            if(readaheadEnd < lastBlock + window / 2) {
+                *begin = std::max(readaheadEnd, lastBlock);
+                *end = lastBlock + window;
+                readaheadEnd = *end;
+            }
+        }
+        nextOffset = off + size;
+    }
+};
+
+// A small pool of threads that run prefetch jobs in the background.
+class ReadaheadQueue {
+public:
+    explicit ReadaheadQueue(unsigned threadCount) {
+        for(unsigned i = 0; i < threadCount; ++i) {
+            threads.emplace_back([this] { run(); });
+        }
+    }
+
+    ~ReadaheadQueue() {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stopping = true;
+        }
+        cond.notify_all();
+        for(std::thread &t : threads) {
+            t.join();
+        }
+    }
+
+    // Jobs beyond the queue limit are dropped: readahead is only a hint.
+    void push(std::function<void ()> job) {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            if(jobs.size() >= maxQueuedJobs) {
+                return;
+            }
+            jobs.push_back(std::move(job));
+        }
+        cond.notify_one();
+    }
+
+private:
+    static constexpr size_t maxQueuedJobs = 64;
+
+    void run() {
+        for(;;) {
+            std::function<void ()> job;
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                cond.wait(guard, [this] { return stopping || !jobs.empty(); });
+                if(stopping) {
+                    return;
+                }
+                job = std::move(jobs.front());
+                jobs.pop_front();
+            }
+            job();
+        }
+    }
+
+    std::mutex lock;
+    std::condition_variable cond;
+    std::deque<std::function<void ()>> jobs;
+    std::vector<std::thread> threads;
+    bool stopping = false;
+};
+
+}
@@ -0,0 +1,86 @@
+/*
+    Copyright (C) 2017 Yuchen Ma <15208850@hdu.edu.cn>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
+
+namespace DogeFS {
+
+// Inode and directory item slots taken from the allocator ahead of use, a
+// batch per directory, so that a burst of creates in one directory costs one
+// space map write per batch instead of two per file.  Batches start at one
+// slot and double with every refill, so that directories which only ever
+// get a file or two do not strand slots.
+//
+// The table itself is guarded by an internal mutex.  The reservation of one
+// directory is only touched while the caller holds that directory's lock.
+class SlotReserve {
+public:
+    struct Range {
+        uint64_t next = 0;
+        uint64_t end = 0;
+        uint64_t batch = 0;
+    };
+
+    struct Slots {
+        Range inodes;
+        Range dirItems;
+    };
+
+    explicit SlotReserve(uint64_t maxBatch) : maxBatch(maxBatch) {}
+
+    Slots &get(uint64_t dir) {
+        std::lock_guard<std::mutex> guard(lock);
+        return dirs[dir];
+    }
+
+    // Hand out the next slot of a range.  An empty range is refilled by
+    // calling allocate(count, &taken), which returns the first slot of a
+    // batch of up to count, or 0.
+    template <typename F>
+    uint64_t take(Range &range, F allocate) {
+        if(range.next == range.end) {
+            range.batch = std::min(std::max<uint64_t>(range.batch * 2, 1), maxBatch);
+            uint64_t taken = 0;
+            uint64_t first = allocate(range.batch, &taken);
+            if(first == 0 || taken == 0) {
+                return 0;
+            }
+            range.next = first;
+            range.end = first + taken;
+        }
+        return range.next++;
+    }
+
+    // Detach every reservation, so that the unused slots can be given back.
+    std::unordered_map<uint64_t, Slots> takeAll() {
+        std::lock_guard<std::mutex> guard(lock);
+        std::unordered_map<uint64_t, Slots> result;
+        result.swap(dirs);
+        return result;
+    }
+
+private:
+    std::mutex lock;
+    uint64_t maxBatch;
+    std::unordered_map<uint64_t, Slots> dirs;
+};
+
+}